@@ -0,0 +1,77 @@
+# Decode the events published by sensor_reader, JSON (text/plain) or CBOR
+# (application/cbor, MESSAGE_ENCODING in sensor_reader.h) - see format_message()
+# in src/rabbitmq.c. Only the part of CBOR (RFC 8949) the gate writes is read:
+# unsigned and negative integers, byte and text strings, arrays, maps, tags,
+# false/true/null. No dependency.
+import json
+import struct
+
+CBOR_KEYS = {1: 'timestamp', 2: 'event_type', 3: 'source', 4: 'data', 5: 'sensor_id'}
+
+
+def _cbor_item(body, pos):
+    head = body[pos]
+    major, info = head >> 5, head & 0x1F
+    pos += 1
+    if info < 24:
+        arg = info
+    elif info <= 27:
+        n = 1 << (info - 24)
+        arg = int.from_bytes(body[pos:pos + n], 'big')
+        pos += n
+    else:
+        raise ValueError('unsupported CBOR head 0x%02x' % head)
+
+    if major == 0:
+        return arg, pos
+    if major == 1:
+        return -1 - arg, pos
+    if major in (2, 3):
+        raw = bytes(body[pos:pos + arg])
+        if len(raw) != arg:
+            raise ValueError('truncated CBOR string')
+        return (raw if major == 2 else raw.decode('utf-8')), pos + arg
+    if major == 4:
+        items = []
+        for _ in range(arg):
+            item, pos = _cbor_item(body, pos)
+            items.append(item)
+        return items, pos
+    if major == 5:
+        items = {}
+        for _ in range(arg):
+            key, pos = _cbor_item(body, pos)
+            items[key], pos = _cbor_item(body, pos)
+        return items, pos
+    if major == 6:
+        return _cbor_item(body, pos)  # 55799 (self-describe) and the like, the item only
+    if info in (20, 21, 22):
+        return (False, True, None)[info - 20], pos
+    raise ValueError('unsupported CBOR simple value %d' % info)
+
+
+def cbor_loads(body):
+    item, pos = _cbor_item(body, 0)
+    if pos != len(body):
+        raise ValueError('trailing bytes after the CBOR item')
+    return item
+
+
+def decode(body, content_type=None):
+    """Event as a dict with the JSON names, from either encoding.
+
+    The CBOR self-describe tag (D9 D9 F7) is enough to tell them apart
+    when the content type is not known."""
+    if content_type == 'application/cbor' or (content_type is None and body[:3] == b'\xd9\xd9\xf7'):
+        raw = cbor_loads(body)
+        if raw.get(0) != 1:
+            raise ValueError('unknown event version %r' % raw.get(0))
+        return {CBOR_KEYS[k]: v for k, v in raw.items() if k in CBOR_KEYS}
+    return json.loads(body)
+
+
+if __name__ == '__main__':
+    sample = (b'\xd9\xd9\xf7\xa6\x00\x01\x01\x1b' + struct.pack('>Q', 1603100000000) +
+              b'\x02\x63pir\x03\x65pir.1\x04\x68pir_id:1\x05\x01')
+    print(decode(sample))
+    print(decode(b'{"timestamp":1603100000000,"event_type":"pir","source":"pir.1","data":"pir_id:1"}'))
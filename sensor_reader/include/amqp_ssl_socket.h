@@ -57,6 +57,47 @@ AMQP_BEGIN_DECLS
 AMQP_PUBLIC_FUNCTION
 amqp_socket_t *AMQP_CALL amqp_ssl_socket_new(amqp_connection_state_t state);
 
+/**
+ * Create a new SSL/TLS socket object on an OpenSSL context kept by the
+ * caller, e.g. one context for every connection made to a broker.
+ *
+ * The socket takes a reference on the context and drops it when it is
+ * destroyed: the settings of the context (CA certificates, versions, session
+ * cache) are shared, amqp_ssl_socket_set_cacert() and the like change them for
+ * every socket on it.
+ *
+ * \param [in,out] state The connection object that owns the SSL/TLS socket
+ * \param [in] ctx An <tt>SSL_CTX*</tt>, NULL for a new one like
+ *             amqp_ssl_socket_new()
+ * \return A new socket object or NULL if an error occurred.
+ */
+AMQP_PUBLIC_FUNCTION
+amqp_socket_t *AMQP_CALL amqp_ssl_socket_new_with_context(
+    amqp_connection_state_t state, void *ctx);
+
+/**
+ * Set the TLS session to resume on the next open of the socket.
+ *
+ * The socket takes a reference on the session. If the server does not resume
+ * it, the handshake is a full one and nothing else changes.
+ *
+ * \param [in,out] self An SSL/TLS socket object.
+ * \param [in] session An <tt>SSL_SESSION*</tt> of an earlier connection to the
+ *             same server, NULL for none
+ * \return \ref AMQP_STATUS_OK on success.
+ */
+AMQP_PUBLIC_FUNCTION
+int AMQP_CALL amqp_ssl_socket_set_session(amqp_socket_t *self, void *session);
+
+/**
+ * Tell if the handshake of the open socket resumed a session.
+ *
+ * \param [in] self An SSL/TLS socket object.
+ * \return 1 if the session was resumed, 0 for a full handshake
+ */
+AMQP_PUBLIC_FUNCTION
+amqp_boolean_t AMQP_CALL amqp_ssl_socket_session_reused(amqp_socket_t *self);
+
 /**
  * Get the internal OpenSSL context. Caveat emptor.
  *
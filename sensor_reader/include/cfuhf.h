@@ -0,0 +1,78 @@
+/** ------------------------------------------------------------*-
+ * Chafon UHF USB reader - header file
+ * CheckinGate Project.
+ * (c) Minh-An Dao 2020
+ * version 1.00 - 19/10/2020
+ *--------------------------------------------------------------
+ * The CFHid reader: tags streamed by the library callback or polled
+ * with InventoryG2 rounds, handed to our own thread, and the device
+ * reopened in-process when it drops. Every reader is known by its
+ * serial number and reports under its own source id.
+ *
+ -------------------------------------------------------------- */
+#ifndef __CFUHF_H
+#define __CFUHF_H
+
+#include <stdint.h>
+#include <tag_pool.h>
+// ------ Public constants ------------------------------------
+// Reading modes
+#define CFUHF_CALLBACK        0 // the reader streams every read (CFHid_StartRead)
+#define CFUHF_POLL            1 // we ask for inventory rounds (CFHid_InventoryG2)
+
+#define CFUHF_DEFAULT_OPTS    {CFUHF_CALLBACK, 0, 1500}
+#define CFUHF_POLL_BUF_LEN    4096 // bytes of one InventoryG2 answer
+// An InventoryG2 answer is CardNum records back to back, each laid out like a callback report
+// (cfuhf_tag_handler()): [len, 2 bytes, EPC], len counting the whole record, itself included
+#define CFUHF_REC_HDR_LEN     3    // bytes of a record before the EPC
+#define CFUHF_BACKOFF_MIN     20   // ms between two reopen tries at first, doubled after every failure
+#define CFUHF_BACKOFF_MAX     400  // ms, keeps the blind time under a second once the device is back
+#define CFUHF_PROBE_INTERVAL  0    // ms between device info probes while connected, 0 = trust the unplug callback
+#define CFUHF_SN_LEN          7    // bytes of a device serial number
+#define CFUHF_DEVICE_MAX      8    // serial numbers given a source id of their own
+// ------ Public types ----------------------------------------
+typedef struct {
+    uint8_t mode;           // CFUHF_CALLBACK or CFUHF_POLL
+    uint16_t poll_interval; // ms from the start of a round to the next, 0 = rounds only after cfuhf_trigger()
+    uint16_t active_time;   // ms of back to back rounds after cfuhf_trigger()
+} cfuhf_opts_t;
+
+/** @brief Connection statistics, blind time is from the unplug to reading again */
+typedef struct {
+    uint8_t connected;
+    uint8_t sn[CFUHF_SN_LEN]; // device opened last
+    uint8_t source;           // its source id
+    uint32_t disconnects;
+    uint32_t recoveries;
+    uint32_t open_failures;
+    uint64_t blind_last;   // ms
+    uint64_t blind_max;    // ms
+    uint64_t blind_total;  // ms
+    uint32_t tags;         // reports given to the tag handler
+    uint32_t rounds;       // InventoryG2 rounds
+    uint32_t round_errors;
+    uint32_t round_bad;    // answers which do not frame as CardNum records
+} cfuhf_stats_t;
+
+/** @brief One reader seen on this host */
+typedef struct {
+    uint8_t sn[CFUHF_SN_LEN];
+    uint8_t source;
+    uint8_t open;          // the device the library has open now
+    uint32_t opens;
+    uint32_t disconnects;
+    uint32_t tags;         // reports received
+    uint64_t last_seen;    // ms, wall clock of the last report
+} cfuhf_device_t;
+
+typedef void (*cfuhf_tag_handler_t)(const tag_slot_t*);
+typedef void (*cfuhf_state_handler_t)(const cfuhf_stats_t*);
+// ------ Public function prototypes --------------------------
+int cfuhf_add_device(const char*);
+void cfuhf_init(uint8_t, const cfuhf_opts_t*, cfuhf_tag_handler_t, cfuhf_state_handler_t);
+void cfuhf_trigger(void);
+void cfuhf_stats(cfuhf_stats_t*);
+uint8_t cfuhf_devices(cfuhf_device_t*, uint8_t);
+uint16_t cfuhf_decode(const uint8_t*, uint16_t, uint16_t, uint8_t, uint64_t, cfuhf_tag_handler_t, uint16_t*);
+
+#endif //__CFUHF_H
@@ -0,0 +1,51 @@
+/** ------------------------------------------------------------*-
+ * Encoding kernels - header file
+ * CheckinGate Project.
+ * (c) Minh-An Dao 2020
+ * version 1.00 - 19/10/2020
+ *--------------------------------------------------------------
+ * Hex, decimal, JSON and CBOR encoding into caller buffers, without
+ * printf and without allocation.
+ *
+ -------------------------------------------------------------- */
+#ifndef __ENCODE_H
+#define __ENCODE_H
+
+#include <stdint.h>
+#include <stddef.h>
+// ------ Public constants ------------------------------------
+#define ENCODE_U64_MAX_LEN 20 // digits of UINT64_MAX
+// ------ Public types ----------------------------------------
+/** @brief Fixed-capacity output buffer, always NUL terminated (CBOR may hold NULs: use len) */
+typedef struct {
+    char* buf;
+    size_t cap;       // bytes, the terminating NUL included
+    size_t len;
+    uint8_t overflow; // set once something did not fit, that part is left out
+    uint8_t fields;   // members written in the current JSON object
+} encode_buf_t;
+// ------ Public function prototypes --------------------------
+char* encode_hex_raw(char*, const uint8_t*, size_t);
+char* encode_u64_raw(char*, uint64_t);
+
+void encode_init(encode_buf_t*, char*, size_t);
+void encode_mem(encode_buf_t*, const char*, size_t);
+void encode_str(encode_buf_t*, const char*);
+void encode_char(encode_buf_t*, char);
+void encode_hex(encode_buf_t*, const uint8_t*, size_t);
+void encode_u64(encode_buf_t*, uint64_t);
+void encode_i64(encode_buf_t*, int64_t);
+
+void encode_json_begin(encode_buf_t*);
+void encode_json_end(encode_buf_t*);
+void encode_json_key(encode_buf_t*, const char*);
+void encode_json_string(encode_buf_t*, const char*);
+void encode_json_str(encode_buf_t*, const char*, const char*);
+void encode_json_u64(encode_buf_t*, const char*, uint64_t);
+
+void encode_cbor_u64(encode_buf_t*, uint64_t);
+void encode_cbor_text(encode_buf_t*, const char*);
+void encode_cbor_map(encode_buf_t*, size_t);
+void encode_cbor_tag(encode_buf_t*, uint64_t);
+
+#endif //__ENCODE_H
@@ -0,0 +1,68 @@
+/** ------------------------------------------------------------*-
+ * Message queue - header file
+ * CheckinGate Project.
+ * (c) Minh-An Dao 2020
+ * version 1.00 - 19/10/2020
+ *--------------------------------------------------------------
+ * Hand formatted messages from the sensor threads over to the thread
+ * owning the broker connection: bounded queues of preallocated
+ * slots, lock-free on the producer side, one per priority lane.
+ *
+ -------------------------------------------------------------- */
+#ifndef __MSG_QUEUE_H
+#define __MSG_QUEUE_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <semaphore.h>
+// ------ Public constants ------------------------------------
+#define MSG_QUEUE_SIZE        1024 // slots of each lane, a power of 2
+#define MSG_QUEUE_LANES       3    // RABBITMQ_LANES
+#define MSG_QUEUE_BODY_LEN    400  // bytes, MESSAGE_MAX_LEN
+#define MSG_QUEUE_EXCHANGE_LEN 32
+#define MSG_QUEUE_KEY_LEN     48   // routing key
+// Results of msg_queue_put()
+#define MSG_QUEUE_OK          0
+#define MSG_QUEUE_FULL        1    // dropped, the lane is full
+#define MSG_QUEUE_OVERSIZE    2    // dropped, too long or no such lane
+// ------ Public types ----------------------------------------
+/** @brief One message waiting to be published */
+typedef struct {
+    char body[MSG_QUEUE_BODY_LEN];
+    uint16_t body_len;
+    char exchange[MSG_QUEUE_EXCHANGE_LEN];
+    char routing_key[MSG_QUEUE_KEY_LEN];
+    uint64_t queued;  // us, monotonic, when it was put
+    uint8_t lane;
+} msg_t;
+
+/** @brief One lane, a ring of its own: a full lane drops its messages only */
+typedef struct {
+    struct {
+        atomic_uint seq;  // which turn of the ring the slot is ready for
+        msg_t msg;
+    } cells[MSG_QUEUE_SIZE];
+    atomic_uint tail;     // next slot to fill, shared by the producers
+    unsigned int head;    // next slot to take, owned by the consumer
+    atomic_uint put;
+    atomic_uint dropped;  // lane full
+    unsigned int high_water;
+} msg_lane_t;
+
+typedef struct {
+    msg_lane_t lanes[MSG_QUEUE_LANES];
+    sem_t ready;          // one post per filled slot, of any lane, msg_queue_wait() takes them all
+    atomic_uint oversize; // body, exchange or routing key too long, or no such lane
+} msg_queue_t;
+// ------ Public function prototypes --------------------------
+void msg_queue_init(msg_queue_t*);
+uint8_t msg_queue_put(msg_queue_t*, uint8_t, const char*, const char*, const char*, size_t, uint64_t);
+uint8_t msg_queue_get(msg_queue_t*, uint8_t, msg_t*);
+uint8_t msg_queue_wait(msg_queue_t*, int);
+void msg_queue_wake(msg_queue_t*);
+unsigned int msg_queue_depth(msg_queue_t*);
+unsigned int msg_queue_lane_depth(msg_queue_t*, uint8_t);
+void msg_queue_stats(msg_queue_t*, uint32_t*, uint32_t*, uint32_t*, uint32_t*);
+void msg_queue_lane_stats(msg_queue_t*, uint8_t, uint32_t*, uint32_t*, uint32_t*);
+
+#endif //__MSG_QUEUE_H
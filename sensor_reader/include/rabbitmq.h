@@ -1,8 +1,101 @@
 #include <amqp.h>
 
+#define MESSAGE_MAX_LEN 400 // formatted message, every sensor fits (MSG_QUEUE_BODY_LEN)
+
+// Encodings of the messages (MESSAGE_ENCODING), told apart by the content_type of each message
+#define RABBITMQ_JSON           0 // text/plain: {"timestamp":..,"event_type":..,"source":..,"data":..}
+#define RABBITMQ_CBOR           1 // application/cbor: tag 55799, then {0: version, 1: timestamp, 2: event_type, 3: source, 4: data, 5: sensor_id}
+#define RABBITMQ_CBOR_VERSION   1
+
+// Lanes of the publish queue (send_message()), each with its own ring: the first one goes first
+#define RABBITMQ_LANE_TAG       0 // badges, RFID and UHF tags
+#define RABBITMQ_LANE_EVENT     1 // PIR triggers, status
+#define RABBITMQ_LANE_STATE     2 // PIR state, every PIR_STATE_DEBOUNCE while there is motion
+#define RABBITMQ_LANES          3 // MSG_QUEUE_LANES
+// Schedules of the lanes (PUBLISH_SCHEDULE)
+#define RABBITMQ_STRICT         0 // a lane is only published once the ones before it are all sent
+#define RABBITMQ_WEIGHTED       1 // turns of RABBITMQ_LANE_WEIGHTS messages, no lane is starved
+#define RABBITMQ_LANE_WEIGHTS   {8, 2, 1}
+#define RABBITMQ_CONNECT_TIMEOUT 3000 // ms for the TCP connect to a broker
+#define RABBITMQ_LOGIN_TIMEOUT  5000  // ms for the login, and for each call made on connect
+#define RABBITMQ_SEND_TIMEOUT   10000 // ms for a write to the socket, the connection is lost after that
+#define RABBITMQ_HEARTBEAT      5     // s asked for at login, the broker may lower it: a broker silent for two is gone. 0 for none
+#define RABBITMQ_KEEPALIVE_IDLE 5     // s of silence on the socket before TCP probes the broker
+#define RABBITMQ_KEEPALIVE_INTVL 2    // s between two probes
+#define RABBITMQ_KEEPALIVE_CNT  3     // probes unanswered, or as long unacknowledged data, before the socket fails
+#define RABBITMQ_BACKOFF_MIN    500   // ms before trying the pool again once every broker failed, doubled after every turn
+#define RABBITMQ_BACKOFF_MAX    30000 // ms, each wait is jittered between half and all of it
+#define RABBITMQ_STATS_INTERVAL 60000 // ms between two queue/latency logs
+#define RABBITMQ_CONFIRM_WINDOW 256   // messages published and not confirmed by the broker, at most
+#define RABBITMQ_CONFIRM_TIMEOUT 10000 // ms without the confirm of a message before the connection is given up
+#define RABBITMQ_CONFIRM_BUCKETS 12   // confirm latency histogram: < 1 ms, < 2 ms, < 4 ms ... >= 1024 ms
+#define RABBITMQ_BATCH_BYTES    16384 // publishes coalesced in one socket write, at most
+#define RABBITMQ_BATCH_MIN      32    // messages, a batch goes at once from that many
+#define RABBITMQ_BATCH_DELAY    5     // ms a smaller batch may wait while confirms are expected, 0 to never wait
+#define RABBITMQ_BROKER_MAX     4     // brokers in the pool
+#define RABBITMQ_HEALTH_INTERVAL 2000 // ms between two checks of the pool
+#define RABBITMQ_HEALTH_TIMEOUT 1000  // ms for the TCP connect of a check
+
+/** @brief Publisher counters, latency is from send_message() to the socket, confirm latency from the socket to the ack */
+typedef struct {
+	uint32_t queued;
+	uint32_t dropped;      // queue full or message too long, see msg_queue.h
+	uint32_t published;    // on the socket
+	uint32_t writes;       // socket writes, published / writes messages each
+	uint32_t confirmed;    // acked by the broker, out of the spool
+	uint32_t nacked;       // nacks, the messages from the nacked one on are sent again
+	uint32_t in_flight;    // published, not confirmed yet
+	uint32_t reconnects;
+	uint32_t heartbeat;    // s, negotiated with the active broker, 0 for none
+	uint32_t heartbeat_timeouts; // brokers silent for two heartbeats, connection given up
+	uint32_t connect_failures;
+	uint32_t switches;     // of the active broker
+	uint32_t switch_time;  // ms from leaving a broker to publishing on the next one, last switch
+	uint32_t depth;        // messages waiting (queue and spool), when last published
+	uint32_t depth_max;
+	uint32_t spooled;      // in the spool, not published yet
+	uint32_t spool_dropped; // overwritten in a full spool before they were published
+	uint64_t latency_avg;  // us, over the last RABBITMQ_STATS_INTERVAL
+	uint64_t latency_max;  // us, over the last RABBITMQ_STATS_INTERVAL
+	uint64_t hold_avg;     // us a batch was held back, over the last RABBITMQ_STATS_INTERVAL
+	uint64_t hold_max;     // us, over the last RABBITMQ_STATS_INTERVAL
+	uint32_t tls_handshakes; // TLS connections opened, 0 without TLS
+	uint32_t tls_resumed;  // of which resumed the previous session
+	uint64_t tls_full_avg; // us to connect with a full handshake
+	uint64_t tls_resumed_avg; // us to connect with a resumed one
+	uint32_t confirm_hist[RABBITMQ_CONFIRM_BUCKETS]; // since the start
+	uint32_t lane_dropped[RABBITMQ_LANES];     // lane full
+	uint64_t lane_latency_avg[RABBITMQ_LANES]; // us, over the last RABBITMQ_STATS_INTERVAL
+	uint64_t lane_latency_max[RABBITMQ_LANES]; // us, over the last RABBITMQ_STATS_INTERVAL
+} rabbitmq_stats_t;
+
+/** @brief One broker of the pool */
+typedef struct {
+	char host[64];
+	int port;
+	uint8_t active;          // the one publishing
+	uint8_t healthy;         // last checks passed
+	uint32_t rtt;            // us, smoothed TCP connect time: the score, lower is better
+	uint32_t checks;
+	uint32_t check_failures;
+	uint32_t activations;    // switches to it
+	uint32_t failures;       // connection lost while active
+} rabbitmq_broker_t;
+
+typedef void (*rabbitmq_switch_handler_t)(const rabbitmq_broker_t* from, const rabbitmq_broker_t* to);
+typedef void (*rabbitmq_stats_handler_t)(void);
+
+int rabbitmq_add_broker(const char*, int);
 void rabbitmq_set_connection_params(const char*,const char*,const char*,int);
+void rabbitmq_set_tls(const char*, uint8_t);
+void rabbitmq_on_switch(rabbitmq_switch_handler_t);
+void rabbitmq_on_stats(rabbitmq_stats_handler_t);
 int rabbitmq_init();
 void close_connection();
-void send_message(char*,char*,char*);
-char* format_message(uint64_t now, char* sensor, char* src, char* data, uint8_t sensor_id);
+void send_message(const char*,size_t,char*,char*,uint8_t);
+void rabbitmq_stats(rabbitmq_stats_t*);
+uint8_t rabbitmq_brokers(rabbitmq_broker_t*, uint8_t);
+size_t format_message(char* out, size_t out_len, uint64_t now, const char* sensor, const char* src, const char* data, uint8_t sensor_id);
+char* format_source(char* out, size_t out_len, const char* sensor, uint8_t id);
+char* format_routing_key(char* out, size_t out_len, const char* src);
 uint64_t get_current_time(void);
@@ -11,10 +11,17 @@
 // --- RabitMQ server infos
 #define EXCHANGE_NAME 		"ex_sensors"
 #define ROUTING_KEY_PREFIX	"event"
+#define STATUS_ROUTING_KEY_PREFIX "status" //reader health (USB blind time), not bound by the event consumers
 #define HOST				"demo1.gate.mekosoft.vn"
 #define USERNAME			"admin"
 #define PASSWORD			"admin"
 #define PORT 				5672
+#define HOSTS				{HOST} //broker pool, "host" or "host:port" (PORT if none), the first one preferred - see rabbitmq.c
+#define HOST_CNT			1
+#define MESSAGE_ENCODING	RABBITMQ_JSON //or RABBITMQ_CBOR, 25-50% fewer bytes, the consumers decode it with event_decode.py
+#define PUBLISH_SCHEDULE	RABBITMQ_STRICT //or RABBITMQ_WEIGHTED: tags before PIR triggers before PIR states - see the lanes in rabbitmq.h
+#define AMQP_TLS			0 //1: TLS to every broker (amqps, PORT is then usually 5671) - see tls.c
+#define AMQP_CACERT			"./sensor_reader/ca.pem" //CA certificates of the brokers, NULL for the system ones
 
 // --- PIR parameters
 #define PIR_DEBOUNCE 	   200000 //us
@@ -26,6 +33,13 @@
 #define PIR_STATE_ID	   3
 #define OTHER_SENSOR_ID    0
 
+// --- Tag pipeline, every reader - see tag.c
+#define TAG_DEDUP_WINDOW   1000 //ms, a tag is published once per window and reader, 0 to publish every read
+
+// --- Message spool, kept until the broker has them - see spool.c
+#define SPOOL_PATH         "./sensor_reader/spool.bin" // from the working directory, memory only if it cannot be opened
+#define SPOOL_SIZE         (4*1024*1024) //bytes, about 10000 messages
+
 // --- RFID parameters
 #define MAIN_RFID_1 1 //index for rfid module 1
 #define MAIN_RFID_2 2 //index for rfid module 2
@@ -38,11 +52,30 @@
 // --- UHF parameters
 #define UHF_PORT 	  "/dev/serial0"
 #define UHF_BAUDRATE  115200
+#define UHF_PORTS     {UHF_PORT} //one RS232 reader per lane, source ids start at MAIN_UHF
+#define UHF_READER_CNT 1
 #define MAIN_UHF   3  //index for uhf
 #define UHF_D0_PIN 10 //wiringpi pin
 #define UHF_D1_PIN 11 //wiringpi pin
-#define UHF_DELAY  5000 //read interval (ms)
+#define UHF_RX_TIMEOUT  5 //ms waiting for the next packet before the tracker is ticked
+#define UHF_SERIAL_OPTS {8, 1, 1} //VMIN bytes, VTIME (1/10 s), low latency - see serial.h
+#define en_uhf_track  1    //one pass event per tag instead of one event per read
+#define UHF_TRACK_LEAVE_TIMEOUT 1000 //ms without reads before a tag has left the field
+#define en_uhf_tune   1    //tune session/target/repeat of every round to the tag population - see uhf_tune.c
+#define UHF_TUNE_ACTIVE_TIME 1500 //ms of back to back tuned rounds after a PIR trigger
+#define en_uhf_mem    1    //read the membank below once per tag and add it to the pass event (needs en_uhf_track)
+#define UHF_MEM_BANK      TID_MEMBANK //TID_MEMBANK or USER_MEMBANK (employee number)
+#define UHF_MEM_WORD_ADD  0x00
+#define UHF_MEM_WORD_CNT  6 //words, a word is 2 bytes
+#define UHF_EPC_FILTERS   {"E200C0DE"} //EPCs of our badges, "VALUE" or "VALUE/MASK" in hex - see uhf_filter.c
+#define UHF_EPC_FILTER_CNT 1 //0 to publish every tag
+#define CFUHF_OPTS {CFUHF_CALLBACK, 0, 1500} //USB reader: mode, poll interval (ms, 0 = on PIR only), ms of rounds after a PIR trigger - see cfuhf.h
+#define CFUHF_SERIALS {""} //USB readers in hex (14 digits), source ids from MAIN_UHF in this order
+#define CFUHF_SERIAL_CNT 0 //readers not listed take the next ids as they show up
 
 // --- Camera parameter
 #define IMAGE_LIMIT	  10000
 #define IMAGE_DIR 	  "./web/public/images"
+
+// ------------------------- Shared functions -----------------------------
+void uhf_inventory_all(void);
@@ -0,0 +1,38 @@
+/** ------------------------------------------------------------*-
+ * Raw serial port - header file
+ * CheckinGate Project.
+ * (c) Minh-An Dao 2020
+ * version 1.00 - 19/10/2020
+ *--------------------------------------------------------------
+ * Binary-safe replacement for wiringSerial, with raw termios,
+ * VMIN/VTIME batching, the kernel low-latency flag and baud rates
+ * above 115200.
+ *
+ -------------------------------------------------------------- */
+#ifndef __SERIAL_H
+#define __SERIAL_H
+
+#include <stdint.h>
+#include <stddef.h>
+// ------ Public types ----------------------------------------
+/** @brief Port tuning, see termios(3) for VMIN and VTIME */
+typedef struct {
+    uint8_t vmin;        // bytes a read() waits for
+    uint8_t vtime;       // inter-byte timeout of a read() (1/10 s), 0 = none
+    uint8_t low_latency; // ask the UART driver to push every byte at once
+} serial_opts_t;
+
+// ------ Public constants ------------------------------------
+#define SERIAL_DEFAULT_OPTS  {1, 0, 1}
+
+// ------ Public function prototypes --------------------------
+int serial_open(const char*, uint32_t, const serial_opts_t*);
+void serial_close(int);
+int serial_set_opts(int, uint32_t, const serial_opts_t*);
+int serial_write(int, const void*, size_t);
+int serial_read(int, void*, size_t, int);
+int serial_wait(int, int);
+int serial_available(int);
+void serial_flush(int);
+
+#endif //__SERIAL_H
@@ -0,0 +1,67 @@
+/** ------------------------------------------------------------*-
+ * Message spool - header file
+ * CheckinGate Project.
+ * (c) Minh-An Dao 2020
+ * version 1.00 - 19/10/2020
+ *--------------------------------------------------------------
+ * Write-ahead journal of the messages to publish: a ring of CRC
+ * checked records in a memory-mapped file, kept until the broker has
+ * them, replayed after an outage or a restart. Each lane of the
+ * queue is given out on its own, see spool_next().
+ *
+ -------------------------------------------------------------- */
+#ifndef __SPOOL_H
+#define __SPOOL_H
+
+#include <stdint.h>
+#include <msg_queue.h>
+// ------ Public constants ------------------------------------
+#define SPOOL_HEADER_LEN  4096 // bytes before the ring, one page
+#define SPOOL_LANES       MSG_QUEUE_LANES
+// ------ Public types ----------------------------------------
+/** @brief One record, pointing into the map: valid until it is acked */
+typedef struct {
+    uint64_t seq;
+    const char* exchange;
+    const char* routing_key;
+    const char* body;
+    uint16_t body_len;
+    uint64_t queued;  // us, monotonic, when it was given to send_message()
+    uint8_t lane;     // of the queue it came through
+} spool_rec_t;
+
+/** @brief Where a lane is given out from */
+typedef struct {
+    uint64_t seq;        // next record to look at
+    uint32_t off;        // its offset
+    uint32_t unsent;     // records of the lane from there on, not acked
+} spool_cursor_t;
+
+typedef struct {
+    uint8_t* map;
+    uint8_t* ring;       // map + SPOOL_HEADER_LEN
+    uint32_t size;       // bytes of the ring
+    int fd;              // -1 if the ring only lives in memory
+    uint64_t head_seq;   // oldest record not acked
+    uint32_t head;       // its offset
+    spool_cursor_t lanes[SPOOL_LANES];
+    uint8_t* acked;      // one bit per record, by sequence number: acked, not trimmed yet
+    uint32_t acked_mask;
+    uint64_t tail_seq;   // next record to append
+    uint32_t tail;
+    uint32_t dirty_lo, dirty_hi; // ring bytes written since the last commit
+    uint8_t header_dirty;
+    uint32_t dropped;    // records overwritten before they were acked
+} spool_t;
+// ------ Public function prototypes --------------------------
+int spool_open(spool_t*, const char*, uint32_t);
+void spool_append(spool_t*, const msg_t*);
+void spool_commit(spool_t*);
+uint8_t spool_next(spool_t*, uint8_t, spool_rec_t*);
+void spool_ack(spool_t*, uint64_t);
+void spool_rewind(spool_t*);
+uint32_t spool_pending(const spool_t*);
+uint32_t spool_unsent(const spool_t*);
+uint32_t spool_lane_unsent(const spool_t*, uint8_t);
+
+#endif //__SPOOL_H
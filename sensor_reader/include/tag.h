@@ -0,0 +1,58 @@
+/** ------------------------------------------------------------*-
+ * Tag pipeline - header file
+ * CheckinGate Project.
+ * (c) Minh-An Dao 2020
+ * version 1.00 - 19/10/2020
+ *--------------------------------------------------------------
+ * One way in for the tags of every reader (Wiegand, RS232 and USB
+ * UHF): binary id, source and time in, dedup, enrichment and
+ * publishing done once here.
+ *
+ -------------------------------------------------------------- */
+#ifndef __TAG_H
+#define __TAG_H
+
+#include <stdint.h>
+#include <tag_key.h>
+// ------ Public constants ------------------------------------
+#define TAG_ID_MAX_LEN    32 // bytes, the longest EPC
+#define TAG_MEM_MAX_LEN   64 // bytes, the whole USER membank
+#define TAG_DEDUP_SIZE    256 // tags remembered for the dedup window, a power of 2
+
+// Reader kinds
+#define TAG_WIEGAND       0
+#define TAG_UHF_RS232     1
+#define TAG_UHF_USB       2
+
+// Optional fields of an event
+#define TAG_HAS_RSSI      0x01 // rssi, ant
+#define TAG_HAS_PASS      0x02 // dir, reads, dwell: already one event per pass, never deduplicated
+#define TAG_HAS_MEM       0x04 // mem
+// ------ Public types ----------------------------------------
+/** @brief One tag read, or one pass of a tag through the gate */
+typedef struct {
+    uint8_t id[TAG_ID_MAX_LEN]; // 24 bit Wiegand number or EPC, big endian, for the message
+    uint8_t id_len;
+    tag_key_t key;    // the same id, for every comparison
+    uint8_t kind;     // TAG_WIEGAND, TAG_UHF_RS232 or TAG_UHF_USB
+    uint8_t source;   // published as rfid.<source>
+    uint8_t flags;    // TAG_HAS_...
+    uint64_t time;    // ms, wall clock of the read (peak read of a pass)
+    int16_t rssi;     // dBm
+    uint8_t ant;
+    const char* dir;  // direction of a pass, a static string
+    uint32_t reads;
+    uint32_t dwell;   // ms in the field
+    uint8_t mem[TAG_MEM_MAX_LEN];
+    uint8_t mem_len;
+} tag_event_t;
+
+/** @brief Called on every event kept by the dedup, before it is published */
+typedef void (*tag_enricher_t)(tag_event_t*);
+// ------ Public function prototypes --------------------------
+void tag_init(uint32_t, tag_enricher_t);
+void tag_event_init(tag_event_t*, uint8_t, uint8_t, const uint8_t*, uint8_t, uint64_t);
+uint8_t tag_submit(tag_event_t*);
+void tag_stats(uint32_t*, uint32_t*, uint32_t*);
+
+#endif //__TAG_H
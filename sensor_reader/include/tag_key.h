@@ -0,0 +1,45 @@
+/** ------------------------------------------------------------*-
+ * Tag key - header file
+ * CheckinGate Project.
+ * (c) Minh-An Dao 2020
+ * version 1.00 - 19/10/2020
+ *--------------------------------------------------------------
+ * Fixed-width binary identity of a tag (a 24 bit Wiegand number or an
+ * EPC up to 128 bits), compared and hashed as two words. Caches and
+ * dedup tables key on it, hex is only written when publishing.
+ *
+ -------------------------------------------------------------- */
+#ifndef __TAG_KEY_H
+#define __TAG_KEY_H
+
+#include <stdint.h>
+// ------ Public constants ------------------------------------
+#define TAG_KEY_BYTES     16 // id bytes kept as they are, longer EPCs are folded
+
+// Id types
+#define TAG_KEY_WIEGAND   0
+#define TAG_KEY_EPC       1
+// ------ Public types ----------------------------------------
+typedef struct {
+    uint64_t hi, lo; // id bytes zero padded; a longer id keeps 8 bytes and a hash of the rest
+    uint8_t type;    // TAG_KEY_...
+    uint8_t len;     // bytes of the id
+} tag_key_t;
+// ------ Public function prototypes --------------------------
+void tag_key_make(tag_key_t*, uint8_t, const uint8_t*, uint8_t);
+
+static inline uint8_t tag_key_equal(const tag_key_t* a, const tag_key_t* b)
+{
+    return a->hi == b->hi && a->lo == b->lo && a->type == b->type && a->len == b->len;
+}
+
+static inline uint32_t tag_key_hash(const tag_key_t* k)
+{
+    uint64_t h = k->hi * 0x9E3779B97F4A7C15ull ^ k->lo * 0xC2B2AE3D27D4EB4Full ^ ((uint64_t)k->type << 8 | k->len);
+    h ^= h >> 33; // murmur3 finalizer
+    h *= 0xFF51AFD7ED558CCDull;
+    h ^= h >> 33;
+    return (uint32_t)h;
+}
+
+#endif //__TAG_KEY_H
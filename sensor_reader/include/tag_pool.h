@@ -0,0 +1,51 @@
+/** ------------------------------------------------------------*-
+ * Tag pool - header file
+ * CheckinGate Project.
+ * (c) Minh-An Dao 2020
+ * version 1.00 - 19/10/2020
+ *--------------------------------------------------------------
+ * Hand raw tag reports from a callback thread we do not own (the
+ * CFHid library) over to our own thread: a bounded pool of
+ * preallocated slots, lock-free on the producer side.
+ *
+ -------------------------------------------------------------- */
+#ifndef __TAG_POOL_H
+#define __TAG_POOL_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <semaphore.h>
+// ------ Public constants ------------------------------------
+#define TAG_POOL_SIZE      256 // slots, a power of 2
+#define TAG_POOL_DATA_LEN  64  // raw bytes kept per report
+// ------ Public types ----------------------------------------
+/** @brief One raw report, as given by the callback */
+typedef struct {
+    uint8_t data[TAG_POOL_DATA_LEN];
+    uint8_t len;
+    uint8_t source;
+    uint16_t tag_cnt;  // tags in the report, as given by the reader
+    uint64_t time;     // ms, when the report came in
+} tag_slot_t;
+
+typedef struct {
+    struct {
+        atomic_uint seq;  // which turn of the ring the slot is ready for
+        tag_slot_t slot;
+    } cells[TAG_POOL_SIZE];
+    atomic_uint tail;     // next slot to fill, shared by the producers
+    unsigned int head;    // next slot to take, owned by the consumer
+    sem_t ready;          // one post per filled slot
+    atomic_uint put;
+    atomic_uint dropped;  // pool full
+    atomic_uint oversize; // report longer than TAG_POOL_DATA_LEN
+    unsigned int high_water;
+} tag_pool_t;
+// ------ Public function prototypes --------------------------
+void tag_pool_init(tag_pool_t*);
+uint8_t tag_pool_put(tag_pool_t*, uint8_t, uint16_t, const uint8_t*, int, uint64_t);
+uint8_t tag_pool_get(tag_pool_t*, tag_slot_t*);
+uint8_t tag_pool_wait(tag_pool_t*, int);
+void tag_pool_stats(tag_pool_t*, uint32_t*, uint32_t*, uint32_t*, uint32_t*);
+
+#endif //__TAG_POOL_H
@@ -0,0 +1,36 @@
+/** ------------------------------------------------------------*-
+ * TLS to the brokers - header file
+ * CheckinGate Project.
+ * (c) Minh-An Dao 2020
+ * version 1.00 - 19/10/2020
+ *--------------------------------------------------------------
+ * One OpenSSL context per broker for the whole run, and the last
+ * session the broker gave us, resumed by the next connection.
+ *
+ -------------------------------------------------------------- */
+#ifndef __TLS_H
+#define __TLS_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <openssl/ssl.h>
+#include <amqp.h>
+// ------ Public types ----------------------------------------
+typedef struct {
+    SSL_CTX* ctx;          // every connection to the broker
+    SSL_SESSION* session;  // to resume, NULL if none yet
+    uint8_t verify;        // certificate and host name checked
+    pthread_mutex_t lock;  // session and counters, the new session callback runs on any thread
+    uint32_t handshakes;
+    uint32_t resumed;      // handshakes which resumed the session
+    uint64_t full_us;      // sum of the open times (TCP connect and handshake), full handshakes
+    uint64_t resumed_us;   // the same, resumed ones
+} tls_t;
+// ------ Public function prototypes --------------------------
+int tls_init(tls_t*, const char*, uint8_t);
+amqp_socket_t* tls_socket(tls_t*, amqp_connection_state_t);
+void tls_opened(tls_t*, amqp_socket_t*, uint64_t);
+void tls_forget(tls_t*);
+void tls_stats(tls_t*, uint32_t*, uint32_t*, uint64_t*, uint64_t*);
+
+#endif //__TLS_H
@@ -32,18 +32,81 @@
  * @ref https://mlab.vn/index.php?_route_=15129-bai-4-lap-trinh-raspberry-pi-su-dung-cong-truyen-thong-uart.html
  * 
  -------------------------------------------------------------- */
+#ifndef __UHF_H
+#define __UHF_H
+
 #include <stdint.h>
+#include <stddef.h>
+#include <serial.h>
 // ------ Public constants ------------------------------------
 // Membanks
 #define RESERVED_MEMBANK  0x00
 #define EPC_MEMBANK       0x01
 #define TID_MEMBANK       0x02
 #define USER_MEMBANK      0x03
+
+#define UHF_EPC_MAX_LEN   32 // bytes
+#define UHF_READ_MAX_LEN  64 // bytes, the whole USER membank
+#define UHF_RSSI_TO_DBM(r) ((int)(r) - 129) // see RSSI parameter reference table
+
+// ------ Public types ----------------------------------------
+/** @brief One RS232 reader, see uhf_open() */
+typedef struct uhf_reader uhf_reader_t;
+struct uhf_filter; // see uhf_filter.h
+
+/** @brief One tag report from a real-time inventory round */
+typedef struct {
+    uint8_t epc[UHF_EPC_MAX_LEN];
+    uint8_t epc_len;
+    uint16_t pc;
+    uint8_t rssi; // raw RSSI parameter
+    uint8_t ant;  // antenna id (0-3)
+    uint8_t freq; // frequency parameter
+} uhf_tag_t;
+
+/** @brief End of a real-time inventory round */
+typedef struct {
+    uint8_t ant;
+    uint16_t read_rate;  // tags/s, as measured by the reader
+    uint32_t total_read; // reads in the round, the same tag counted every time
+    uint8_t error;       // error code if the round failed, 0 otherwise
+} uhf_round_t;
+
+/** @brief Answer of one tag to uhf_request_read() */
+typedef struct {
+    uint8_t epc[UHF_EPC_MAX_LEN];
+    uint8_t epc_len;
+    uint8_t data[UHF_READ_MAX_LEN];
+    uint8_t data_len;
+    uint8_t ant;
+    uint8_t error; // error code if the read failed (no EPC then), 0 otherwise
+} uhf_read_t;
+
+/** @brief Answer of one tag to uhf_request_write() */
+typedef struct {
+    uint8_t epc[UHF_EPC_MAX_LEN];
+    uint8_t epc_len;
+    uint16_t tag_cnt; // tags which took the write, more than 1 if they share the matched EPC
+    uint8_t ant;
+    uint8_t error;    // error code if the write failed, 0 otherwise
+} uhf_write_t;
 // ------ Public function prototypes --------------------------
-uint8_t uhf_init(const char*,uint32_t,uint8_t);
-uint8_t uhf_set_param(uint8_t,uint8_t,uint8_t);
+uhf_reader_t* uhf_open(const char*,uint32_t,int8_t,const serial_opts_t*);
+void uhf_close(uhf_reader_t*);
+void uhf_set_rx_timeout(uhf_reader_t*,int);
+uint8_t uhf_set_param(uhf_reader_t*,uint8_t,uint8_t,uint8_t);
+uint8_t uhf_set_filter(uhf_reader_t*,struct uhf_filter*);
 void uhf_show_usage();
-char* uhf_read_tag();
-void uhf_realtime_inventory();
-char* uhf_read_rt_inventory();
+uint8_t uhf_read_tag(uhf_reader_t*,char*,size_t);
+void uhf_realtime_inventory(uhf_reader_t*);
+void uhf_session_inventory(uhf_reader_t*,uint8_t,uint8_t,uint8_t);
+uint8_t uhf_get_round(uhf_reader_t*,uhf_round_t*);
+void uhf_request_read(uhf_reader_t*,const uint8_t*,uint8_t);
+uint8_t uhf_get_read(uhf_reader_t*,uhf_read_t*);
+void uhf_request_write(uhf_reader_t*,const uint8_t*,uint8_t,uint8_t,uint8_t,const uint8_t*,uint8_t);
+uint8_t uhf_get_write(uhf_reader_t*,uhf_write_t*);
+uint8_t uhf_read_rt_inventory(uhf_reader_t*,char*);
+uint8_t uhf_read_rt_inventory_tag(uhf_reader_t*,uhf_tag_t*);
 // ------ Public variable -------------------------------------
+
+#endif //__UHF_H
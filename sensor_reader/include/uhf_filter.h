@@ -0,0 +1,40 @@
+/** ------------------------------------------------------------*-
+ * UHF EPC filter - header file
+ * CheckinGate Project.
+ * (c) Minh-An Dao 2020
+ * version 1.00 - 19/10/2020
+ *--------------------------------------------------------------
+ * Keep only the EPCs of our own badges: value/mask rules on the
+ * start of the EPC, checked right after a tag report is parsed and
+ * pushed down to the reader as tag select masks where possible.
+ *
+ -------------------------------------------------------------- */
+#ifndef __UHF_FILTER_H
+#define __UHF_FILTER_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <uhf.h>
+// ------ Public constants ------------------------------------
+#define UHF_FILTER_MAX  4 // rules, a tag is kept if it matches any of them
+// ------ Public types ----------------------------------------
+typedef struct {
+    uint8_t value[UHF_EPC_MAX_LEN];
+    uint8_t mask[UHF_EPC_MAX_LEN];
+    uint8_t len;         // bytes compared from the start of the EPC
+    uint16_t prefix_bits; // the mask is this many leading 1 bits, 0 if it is not a plain prefix
+} uhf_filter_rule_t;
+
+typedef struct uhf_filter {
+    uhf_filter_rule_t rules[UHF_FILTER_MAX];
+    uint8_t cnt;         // no rule: every tag is kept
+    atomic_uint accepted; // counted by the reader thread, read by uhf_filter_stats() from any thread
+    atomic_uint rejected;
+} uhf_filter_t;
+// ------ Public function prototypes --------------------------
+void uhf_filter_init(uhf_filter_t*);
+int uhf_filter_add(uhf_filter_t*, const char*);
+uint8_t uhf_filter_match(uhf_filter_t*, const uint8_t*, uint8_t);
+void uhf_filter_stats(uhf_filter_t*, uint32_t*, uint32_t*);
+
+#endif //__UHF_FILTER_H
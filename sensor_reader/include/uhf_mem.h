@@ -0,0 +1,30 @@
+/** ------------------------------------------------------------*-
+ * UHF membank cache - header file
+ * CheckinGate Project.
+ * (c) Minh-An Dao 2020
+ * version 1.00 - 19/10/2020
+ *--------------------------------------------------------------
+ * Read the TID/USER membank of every tag once, in the background,
+ * and answer later passages of the same tag from memory.
+ *
+ -------------------------------------------------------------- */
+#ifndef __UHF_MEM_H
+#define __UHF_MEM_H
+
+#include <stdint.h>
+#include <uhf.h>
+#include <tag_key.h>
+// ------ Public constants ------------------------------------
+#define UHF_MEM_CACHE_SIZE  256  // tags kept, least recently seen dropped first
+#define UHF_MEM_TIMEOUT     500  // ms before an unanswered read is tried again
+#define UHF_MEM_TRIES       3    // reads tried before a tag is given up for a while
+#define UHF_MEM_HOLDOFF     5000 // ms before a given up tag is tried again
+// ------ Public function prototypes --------------------------
+void uhf_mem_init(void);
+void uhf_mem_touch(const uint8_t*, uint8_t, uint8_t, uint64_t);
+uint8_t uhf_mem_next(uint8_t, uint64_t, uint8_t*, uint8_t*);
+void uhf_mem_complete(uint8_t, const uhf_read_t*);
+uint8_t uhf_mem_get(const tag_key_t*, uint8_t*, uint8_t*);
+void uhf_mem_stats(uint32_t*, uint32_t*);
+
+#endif //__UHF_MEM_H
@@ -0,0 +1,49 @@
+/** ------------------------------------------------------------*-
+ * UHF pass tracker - header file
+ * CheckinGate Project.
+ * (c) Minh-An Dao 2020
+ * version 1.00 - 19/10/2020
+ *--------------------------------------------------------------
+ * Keep a short RSSI/antenna time series for every EPC in the field
+ * and turn the stream of raw inventory reads into one pass event
+ * per tag, emitted when the tag leaves the field.
+ *
+ -------------------------------------------------------------- */
+#ifndef __UHF_TRACK_H
+#define __UHF_TRACK_H
+
+#include <stdint.h>
+#include <uhf.h>
+#include <tag_key.h>
+// ------ Public constants ------------------------------------
+#define UHF_TRACK_SLOTS    32 // tags tracked at the same time
+#define UHF_TRACK_SAMPLES  16 // RSSI samples kept per tag
+#define UHF_TRACK_ANT_CNT  4
+
+// Pass direction, inferred from the order the antennas saw the peak
+#define UHF_DIR_UNKNOWN    0
+#define UHF_DIR_IN         1 // lower antenna id first
+#define UHF_DIR_OUT        2 // higher antenna id first
+// ------ Public types ----------------------------------------
+/** @brief One tag passing through the gate */
+typedef struct {
+    uint8_t source; // reader the tag passed, as given to uhf_track_add()
+    uint8_t epc[UHF_EPC_MAX_LEN];
+    uint8_t epc_len;
+    uint8_t direction;
+    uint8_t peak_rssi; // raw RSSI parameter, smoothed
+    uint8_t peak_ant;
+    uint16_t reads;
+    uint64_t first_seen; // ms
+    uint64_t peak_time;  // ms, closest approach
+    uint64_t last_seen;  // ms
+} uhf_pass_t;
+
+typedef void (*uhf_pass_handler_t)(const uhf_pass_t*);
+// ------ Public function prototypes --------------------------
+void uhf_track_init(uint32_t, uhf_pass_handler_t);
+void uhf_track_add(const uhf_tag_t*, uint8_t, uint64_t);
+void uhf_track_tick(uint64_t);
+const char* uhf_track_dir_str(uint8_t);
+
+#endif //__UHF_TRACK_H
@@ -0,0 +1,57 @@
+/** ------------------------------------------------------------*-
+ * UHF inventory auto-tuner - header file
+ * CheckinGate Project.
+ * (c) Minh-An Dao 2020
+ * version 1.00 - 19/10/2020
+ *--------------------------------------------------------------
+ * Choose session, target and round length of every inventory round
+ * from the tag statistics of the previous rounds, to read as many
+ * different tags per second as possible.
+ *
+ -------------------------------------------------------------- */
+#ifndef __UHF_TUNE_H
+#define __UHF_TUNE_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <uhf.h>
+#include <tag_key.h>
+// ------ Public constants ------------------------------------
+#define UHF_TUNE_MAX_TAGS     64 // different tags counted per round
+#define UHF_TUNE_EVAL_ROUNDS  4  // rounds averaged before a setting is judged
+#define UHF_TUNE_DENSE_TAGS   8  // tags/round above which S1 dual-target is used
+#define UHF_TUNE_SPARSE_TAGS  4  // tags/round below which S0 is used again
+#define UHF_TUNE_ROUND_TIMEOUT 1000 // ms before a round without end packet is given up
+// ------ Public types ----------------------------------------
+typedef struct {
+    uint8_t id; // reader source id, for the log
+    pthread_mutex_t lock;
+
+    // current setting
+    uint8_t session;
+    uint8_t target;
+    uint8_t repeat;
+
+    // round in flight
+    uint8_t in_flight;
+    uint64_t round_start;
+    tag_key_t round_keys[UHF_TUNE_MAX_TAGS]; // different tags read
+    uint8_t round_unique;
+
+    // statistics
+    uint32_t population_x16; // tags/round, EWMA fixed point (x16)
+    uint32_t eval_sum;       // sum of tags/s over the evaluated rounds
+    uint8_t eval_rounds;
+    uint32_t best_score;     // tags/s of the best repeat value
+    uint8_t best_repeat;
+    int8_t step;             // +1: next try doubles repeat, -1: halves it
+    uint32_t rounds;
+    uint32_t failed_rounds;
+} uhf_tune_t;
+// ------ Public function prototypes --------------------------
+void uhf_tune_init(uhf_tune_t*, uint8_t);
+uint8_t uhf_tune_command(uhf_tune_t*, uint64_t, uint8_t*, uint8_t*, uint8_t*);
+void uhf_tune_tag(uhf_tune_t*, const uhf_tag_t*);
+void uhf_tune_round_end(uhf_tune_t*, const uhf_round_t*, uint64_t);
+
+#endif //__UHF_TUNE_H
@@ -79,6 +79,7 @@ struct amqp_ssl_socket_t {
   SSL_CTX *ctx;
   int sockfd;
   SSL *ssl;
+  SSL_SESSION *session;
   amqp_boolean_t verify_peer;
   amqp_boolean_t verify_hostname;
   int internal_error;
@@ -187,6 +188,10 @@ static int amqp_ssl_socket_open(void *base, const char *host, int port,
     status = AMQP_STATUS_SSL_ERROR;
     goto exit;
   }
+  if (self->session) {
+    /* a session the server does not resume costs a full handshake, no more */
+    SSL_set_session(self->ssl, self->session);
+  }
 
   status = amqp_time_from_now(&deadline, timeout);
   if (AMQP_STATUS_OK != status) {
@@ -321,6 +326,7 @@ static void amqp_ssl_socket_delete(void *base) {
   if (self) {
     amqp_ssl_socket_close(self, AMQP_SC_NONE);
 
+    SSL_SESSION_free(self->session);
     SSL_CTX_free(self->ctx);
     free(self);
   }
@@ -337,6 +343,11 @@ static const struct amqp_socket_class_t amqp_ssl_socket_class = {
 };
 
 amqp_socket_t *amqp_ssl_socket_new(amqp_connection_state_t state) {
+  return amqp_ssl_socket_new_with_context(state, NULL);
+}
+
+amqp_socket_t *amqp_ssl_socket_new_with_context(amqp_connection_state_t state,
+                                                void *ctx) {
   struct amqp_ssl_socket_t *self = calloc(1, sizeof(*self));
   int status;
   if (!self) {
@@ -353,6 +364,15 @@ amqp_socket_t *amqp_ssl_socket_new(amqp_connection_state_t state) {
     goto error;
   }
 
+  if (ctx) {
+    if (!SSL_CTX_up_ref((SSL_CTX *)ctx)) {
+      goto error;
+    }
+    self->ctx = (SSL_CTX *)ctx;
+    amqp_set_socket(state, (amqp_socket_t *)self);
+    return (amqp_socket_t *)self;
+  }
+
   self->ctx = SSL_CTX_new(SSLv23_client_method());
   if (!self->ctx) {
     goto error;
@@ -380,6 +400,29 @@ void *amqp_ssl_socket_get_context(amqp_socket_t *base) {
   return ((struct amqp_ssl_socket_t *)base)->ctx;
 }
 
+int amqp_ssl_socket_set_session(amqp_socket_t *base, void *session) {
+  struct amqp_ssl_socket_t *self;
+  if (base->klass != &amqp_ssl_socket_class) {
+    amqp_abort("<%p> is not of type amqp_ssl_socket_t", base);
+  }
+  self = (struct amqp_ssl_socket_t *)base;
+  if (session && !SSL_SESSION_up_ref((SSL_SESSION *)session)) {
+    return AMQP_STATUS_SSL_ERROR;
+  }
+  SSL_SESSION_free(self->session);
+  self->session = (SSL_SESSION *)session;
+  return AMQP_STATUS_OK;
+}
+
+amqp_boolean_t amqp_ssl_socket_session_reused(amqp_socket_t *base) {
+  struct amqp_ssl_socket_t *self;
+  if (base->klass != &amqp_ssl_socket_class) {
+    amqp_abort("<%p> is not of type amqp_ssl_socket_t", base);
+  }
+  self = (struct amqp_ssl_socket_t *)base;
+  return self->ssl != NULL && SSL_session_reused(self->ssl);
+}
+
 int amqp_ssl_socket_set_cacert(amqp_socket_t *base, const char *cacert) {
   int status;
   struct amqp_ssl_socket_t *self;
@@ -753,7 +796,7 @@ int amqp_uninitialize_ssl_library(void) {
   ERR_remove_state(0);
 #endif
 
-#ifndef LIBRESSL_VERSION_NUMBER
+#if !defined(LIBRESSL_VERSION_NUMBER) && OPENSSL_VERSION_NUMBER < 0x30000000L
   FIPS_mode_set(0);
 #endif
 
@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2012, iSEC Partners.
+ * Copyright (C) 2015 Alan Antonuk.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Originally from the ssl-conservatory. The SAN and Common Name walk, the
+ * wildcard rules and the NUL checks are the ones X509_check_host() and
+ * X509_check_ip_asc() of OpenSSL >= 1.0.2 implement, which this uses.
+ */
+
+#include "amqp_openssl_hostname_validation.h"
+
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+
+amqp_hostname_validation_result amqp_ssl_validate_hostname(
+    const char *hostname, const X509 *server_cert) {
+  X509 *cert = (X509 *)server_cert;
+  int res;
+
+  if (hostname == NULL || cert == NULL) {
+    return AMQP_HVR_ERROR;
+  }
+
+  /* an IP address is only matched against the IP SANs */
+  res = X509_check_ip_asc(cert, hostname, 0);
+  if (res == -2) {
+    res = X509_check_host(cert, hostname, 0,
+                          X509_CHECK_FLAG_NO_PARTIAL_WILDCARDS, NULL);
+  }
+
+  switch (res) {
+    case 1:
+      return AMQP_HVR_MATCH_FOUND;
+    case 0:
+      return AMQP_HVR_MATCH_NOT_FOUND;
+    case -2:
+      return AMQP_HVR_MALFORMED_CERTIFICATE;
+    default:
+      return AMQP_HVR_ERROR;
+  }
+}
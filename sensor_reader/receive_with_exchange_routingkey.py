@@ -1,6 +1,8 @@
 import pika
 import sys
 
+from event_decode import decode
+
 credentials = pika.PlainCredentials('admin', 'admin')
 connection = pika.BlockingConnection(
     pika.ConnectionParameters(host='localhost', port=5672, credentials=credentials))
@@ -18,7 +20,7 @@ print(' [*] Waiting for logs. To exit press CTRL+C')
 
 
 def callback(ch, method, properties, body):
-    print(" [x] %r" % (body))
+    print(" [x] %s %r" % (method.routing_key, decode(body, properties.content_type)))
 
 
 channel.basic_consume(
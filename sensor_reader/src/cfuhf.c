@@ -0,0 +1,520 @@
+/** ------------------------------------------------------------*-
+ * Chafon UHF USB reader - function file
+ * CheckinGate Project.
+ * (c) Minh-An Dao 2020
+ * version 1.00 - 19/10/2020
+ *--------------------------------------------------------------
+ * Three threads meet here:
+ *
+ * - The CFHid callback (library thread): tags are copied into a
+ *   tag_pool and nothing else; an unplug (msg 1) only marks the
+ *   device down and wakes the recovery thread, a plug (msg 0) only
+ *   wakes it. No CFHid call is made from inside the callback.
+ * - The tag thread, in one of two modes:
+ *   - CFUHF_CALLBACK: the reader streams every read (StartRead), the
+ *     thread takes them out of the pool.
+ *   - CFUHF_POLL: the thread runs InventoryG2 rounds, every
+ *     poll_interval ms or back to back for active_time ms after
+ *     cfuhf_trigger() (PIR). One round answers with every tag in the
+ *     field packed in one buffer, cfuhf_decode() walks it once. The
+ *     vendor header does not document the records: the library hands
+ *     the payload of the answer over as it is, taken here to be the
+ *     records of the callback reports (CFUHF_REC_HDR_LEN). An answer
+ *     which does not frame that way is counted and logged once in hex.
+ *   Either way every report goes to the tag handler (decode, filter,
+ *   publish) as a tag_slot_t, so the rest of the pipeline is the same.
+ *   tools/cfuhf_bench compares the two modes on a reader.
+ * - The recovery thread: while the device is down it closes and
+ *   reopens it, sets the callback and starts reading again, waiting
+ *   CFUHF_BACKOFF_MIN ms after a failure, doubled up to
+ *   CFUHF_BACKOFF_MAX. A plug event cuts the wait short. With
+ *   CFUHF_PROBE_INTERVAL it also asks the device for its info while
+ *   connected, for firmware that stops without an unplug event.
+ *
+ * Readers are told apart by serial number: the devsn of every callback
+ * report, and the device info of the one we open. The serials given
+ * to cfuhf_add_device() take the source ids from source_id up, in
+ * order, others the next free ids as they show up, so the ids do not
+ * move when a reader is added to a gate. Each one keeps its own
+ * counters (tags, opens, drops, last report).
+ *
+ * The vendor library holds a single handle (no device argument,
+ * address 0xFF): CFHid_OpenDevice() picks one reader and the recovery
+ * thread reopens whichever comes back. Reports of other readers still
+ * come through the callback with their devsn and are kept apart, but
+ * there is no way to start, poll or reopen a given reader on its own.
+ *
+ * The blind time of every drop (unplug to reading again) is kept in
+ * the stats and given to the state handler on every change, so it can
+ * be logged and published. The process no longer waits for the
+ * reload_sensor_reader.service restart to see again.
+ *
+ -------------------------------------------------------------- */
+#ifndef __CFUHF_C
+#define __CFUHF_C
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+#include <CFHidApi.h>
+#include <cfuhf.h>
+
+// ------ Private constants -----------------------------------
+#define DEV_ADDR       0xFF // every CFHid call, the only device
+#define IDLE_WAIT      1000 // ms, recovery thread while connected without probes
+#define INFO_LEN       9    // device info: soft version, hard version, serial number
+#define INFO_SN        2
+
+// ------ Private variables -----------------------------------
+static tag_pool_t pool;
+static cfuhf_opts_t opts = CFUHF_DEFAULT_OPTS;
+static uint8_t source;
+static cfuhf_tag_handler_t tag_handler;
+static cfuhf_state_handler_t state_handler;
+
+static atomic_int connected = 0;
+static _Atomic uint64_t down_since = 0; // ms, monotonic
+static sem_t wake;                      // posted by the callback on plug/unplug
+static sem_t trigger;                   // posted by cfuhf_trigger()
+static _Atomic uint64_t active_until = 0; // ms, monotonic: poll rounds back to back until then
+static cfuhf_stats_t stats;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t tag_thread_id, recovery_thread_id;
+
+// Known readers, only ever appended to: the callback reads them without a lock
+static struct {
+    uint8_t sn[CFUHF_SN_LEN];
+    atomic_uint tags;
+    _Atomic uint64_t last_seen;
+    uint32_t opens;       // under stats_lock
+    uint32_t disconnects; // under stats_lock
+} devices[CFUHF_DEVICE_MAX];
+static atomic_int device_cnt = 0;
+static atomic_int current = -1;  // device the library has open
+static atomic_int last_hit = 0;  // reports come in runs from the same reader
+static pthread_mutex_t device_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//--------------------------------------------------------------
+// FUNCTION DEFINITIONS
+//--------------------------------------------------------------
+static uint64_t __now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ *  @brief Wall clock time of the events, like get_current_time()
+ */
+static uint64_t __wall_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ *  @brief Sleep on a semaphore
+ *  @return 1 if posted, 0 on timeout
+ */
+static uint8_t __sem_wait(sem_t* sem, int timeout_ms)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += timeout_ms / 1000;
+    ts.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+    while (sem_timedwait(sem, &ts) < 0)
+        if (errno != EINTR) return 0;
+    return 1;
+}
+
+static uint8_t __wait(int timeout_ms)
+{
+    return __sem_wait(&wake, timeout_ms);
+}
+
+/**
+ *  @brief Mark the device down, from any thread. Only the first call of a drop counts
+ */
+static void __mark_down(void)
+{
+    int was = 1;
+    if (!atomic_compare_exchange_strong(&connected, &was, 0)) return;
+    atomic_store(&down_since, __now_ms());
+    sem_post(&wake);
+}
+
+static int __hex_value(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+/**
+ *  @brief Index of a serial number in the device table, added if new
+ *  @return the index, -1 if the table is full
+ */
+static int __device(const uint8_t* sn)
+{
+    int i = atomic_load(&last_hit);
+    int cnt = atomic_load(&device_cnt);
+    if (i < cnt && !memcmp(devices[i].sn, sn, CFUHF_SN_LEN)) return i;
+    for (i = 0; i < cnt; i++)
+        if (!memcmp(devices[i].sn, sn, CFUHF_SN_LEN)) break;
+
+    if (i == cnt) {
+        pthread_mutex_lock(&device_lock);
+        cnt = atomic_load(&device_cnt); // added by another thread meanwhile?
+        for (i = 0; i < cnt; i++)
+            if (!memcmp(devices[i].sn, sn, CFUHF_SN_LEN)) break;
+        if (i == cnt && cnt < CFUHF_DEVICE_MAX) {
+            memcpy(devices[i].sn, sn, CFUHF_SN_LEN);
+            atomic_store(&device_cnt, cnt + 1); // published once filled
+        }
+        pthread_mutex_unlock(&device_lock);
+        if (i == CFUHF_DEVICE_MAX) return -1;
+    }
+    atomic_store(&last_hit, i);
+    return i;
+}
+
+static void __callback(int msg, int tag_num, unsigned char* tag_data, int tag_data_len, unsigned char* devsn)
+{
+    if (msg == 0) sem_post(&wake);     // plugged in, try now
+    else if (msg == 1) __mark_down();
+    else {
+        uint64_t now = __wall_ms();
+        int dev = devsn != NULL ? __device(devsn) : atomic_load(&current);
+        if (dev >= 0) {
+            atomic_fetch_add_explicit(&devices[dev].tags, 1, memory_order_relaxed);
+            atomic_store_explicit(&devices[dev].last_seen, now, memory_order_relaxed);
+        }
+        tag_pool_put(&pool, dev >= 0 ? source + dev : source, tag_num, tag_data, tag_data_len, now);
+    }
+}
+
+static void __report(void)
+{
+    cfuhf_stats_t s;
+    cfuhf_stats(&s);
+    if (state_handler != NULL) state_handler(&s);
+}
+
+/**
+ *  @brief Open the device and start reading
+ *  @note: the device counts as connected during the open, so an unplug in the middle is not missed
+ *  @return 1 if reading, 0 otherwise
+ */
+static uint8_t __open(void)
+{
+    uint64_t since = atomic_load(&down_since);
+
+    atomic_store(&connected, 1);
+    atomic_store(&current, -1);
+    CFHid_CloseDevice(); // drop what is left of the previous handle
+    if (CFHid_OpenDevice()) {
+        unsigned char info[INFO_LEN];
+        if (CFHid_GetDeviceSystemInfo(DEV_ADDR, info)) atomic_store(&current, __device(info + INFO_SN));
+        CFHid_SetCallback(__callback); // plug/unplug events in both modes
+        if ((opts.mode == CFUHF_POLL || CFHid_StartRead(DEV_ADDR)) && atomic_load(&connected)) return 1;
+    }
+    atomic_store(&connected, 0);
+    atomic_store(&down_since, since); // the drop is still the one being recovered
+    return 0;
+}
+
+static void* __recovery_thread(void* arg)
+{
+    int backoff = CFUHF_BACKOFF_MIN;
+    uint8_t first = 1;        // the open at start up is not a recovery
+    uint8_t reported = 0;     // state last given to the state handler
+
+    while (1) {
+        if (atomic_load(&connected)) {
+            __wait(CFUHF_PROBE_INTERVAL ? CFUHF_PROBE_INTERVAL : IDLE_WAIT);
+            #if CFUHF_PROBE_INTERVAL
+            unsigned char info[9];
+            if (atomic_load(&connected) && !CFHid_GetDeviceSystemInfo(DEV_ADDR, info)) __mark_down();
+            #endif
+            if (!atomic_load(&connected) && reported) {
+                int dev = atomic_load(&current);
+                pthread_mutex_lock(&stats_lock);
+                stats.disconnects++;
+                if (dev >= 0) devices[dev].disconnects++;
+                pthread_mutex_unlock(&stats_lock);
+                reported = 0;
+                printf("UHF USB: device disconnected, reopening\n");
+                __report();
+            }
+            continue;
+        }
+
+        if (__open()) {
+            uint64_t blind = __now_ms() - atomic_load(&down_since);
+            int dev = atomic_load(&current);
+            pthread_mutex_lock(&stats_lock);
+            if (dev >= 0) {
+                devices[dev].opens++;
+                memcpy(stats.sn, devices[dev].sn, CFUHF_SN_LEN);
+            } else {
+                memset(stats.sn, 0, CFUHF_SN_LEN);
+            }
+            stats.source = dev >= 0 ? source + dev : source;
+            if (!first) {
+                stats.recoveries++;
+                stats.blind_last = blind;
+                stats.blind_total += blind;
+                if (blind > stats.blind_max) stats.blind_max = blind;
+            }
+            pthread_mutex_unlock(&stats_lock);
+            if (first) printf("UHF USB: reading, source %u\n", stats.source);
+            else printf("UHF USB: reading again after %llu ms, source %u\n", (unsigned long long)blind, stats.source);
+            fflush(stdout);
+            first = 0;
+            reported = 1;
+            backoff = CFUHF_BACKOFF_MIN;
+            __report();
+            continue;
+        }
+
+        pthread_mutex_lock(&stats_lock);
+        stats.open_failures++;
+        pthread_mutex_unlock(&stats_lock);
+        __wait(backoff); // a plug event cuts it short
+        backoff = backoff * 2 > CFUHF_BACKOFF_MAX ? CFUHF_BACKOFF_MAX : backoff * 2;
+    }
+    return NULL;
+}
+
+static void __count_tags(uint32_t n)
+{
+    pthread_mutex_lock(&stats_lock);
+    stats.tags += n;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+static void* __tag_thread(void* arg)
+{
+    tag_slot_t slot;
+    uint32_t dropped, oversize, reported = 0;
+
+    while (1) {
+        if (!tag_pool_wait(&pool, 1000)) continue;
+        uint32_t n = 0;
+        for (; tag_pool_get(&pool, &slot); n++) tag_handler(&slot);
+        __count_tags(n);
+
+        tag_pool_stats(&pool, NULL, &dropped, &oversize, NULL);
+        if (dropped + oversize != reported) {
+            reported = dropped + oversize;
+            printf("UHF USB pool: %u dropped (full), %u oversize\n", dropped, oversize);
+        }
+        fflush(stdout);
+    }
+    return NULL;
+}
+
+/**
+ *  @brief Give every tag of an InventoryG2 answer to a tag handler, in one pass
+ *  @param buf the answer: cnt records [len, x, x, EPC], see CFUHF_REC_HDR_LEN
+ *  @param len bytes in buf
+ *  @param cnt records in buf
+ *  @param source_id source id of the tags
+ *  @param time ms, when the round ended
+ *  @param handler called for every tag
+ *  @param used set to the bytes the records took: the answer is in the format above only if
+ *  they are len and every record was given to the handler
+ *  @return number of tags given to the handler, it stops at a record which does not fit
+ */
+uint16_t cfuhf_decode(const uint8_t* buf, uint16_t len, uint16_t cnt, uint8_t source_id, uint64_t time,
+                      cfuhf_tag_handler_t handler, uint16_t* used)
+{
+    tag_slot_t slot;
+    slot.source = source_id;
+    slot.tag_cnt = 1;
+    slot.time = time;
+
+    uint16_t n = 0;
+    uint32_t p = 0;
+    for (; n < cnt && p < len; n++) {
+        uint8_t rec_len = buf[p];
+        if (rec_len <= CFUHF_REC_HDR_LEN || p + rec_len > len || rec_len > TAG_POOL_DATA_LEN) break;
+        memcpy(slot.data, buf + p, rec_len);
+        slot.len = rec_len;
+        handler(&slot);
+        p += rec_len;
+    }
+    *used = p;
+    return n;
+}
+
+/**
+ *  @brief Log an answer which does not frame, once: it tells the record format of the firmware
+ */
+static void __dump_answer(const uint8_t* buf, uint16_t len, uint16_t cnt)
+{
+    static atomic_int dumped = 0;
+    if (atomic_exchange(&dumped, 1)) return;
+    printf("UHF USB: InventoryG2 answer of %u bytes is not %u records [len, x, x, EPC]:", len, cnt);
+    for (uint16_t i = 0; i < len && i < 128; i++) printf(" %02X", buf[i]);
+    printf("\n");
+    fflush(stdout);
+}
+
+/**
+ *  @brief Wait for cfuhf_trigger(), the triggers posted meanwhile count as one
+ */
+static void __wait_trigger(int timeout_ms)
+{
+    if (__sem_wait(&trigger, timeout_ms))
+        while (sem_trywait(&trigger) == 0) ;
+}
+
+/**
+ *  @brief Source id of the open device, for the InventoryG2 answers which carry no serial number
+ */
+static uint8_t __source(void)
+{
+    int dev = atomic_load(&current);
+    return dev >= 0 ? source + dev : source;
+}
+
+static void* __poll_thread(void* arg)
+{
+    static uint8_t buf[CFUHF_POLL_BUF_LEN];
+    uint16_t len, cnt, used;
+
+    while (1) {
+        uint64_t start = __now_ms();
+        if (!atomic_load(&connected) || (opts.poll_interval == 0 && start >= atomic_load(&active_until))) {
+            __wait_trigger(IDLE_WAIT);
+            continue;
+        }
+
+        len = sizeof(buf);
+        cnt = 0;
+        uint8_t ok = CFHid_InventoryG2(DEV_ADDR, buf, &len, &cnt);
+        if (len > sizeof(buf)) len = 0;
+        uint16_t n = ok ? cfuhf_decode(buf, len, cnt, __source(), __wall_ms(), tag_handler, &used) : 0;
+        uint8_t bad = ok && (n != cnt || used != len);
+        if (bad) __dump_answer(buf, len, cnt);
+
+        pthread_mutex_lock(&stats_lock);
+        stats.rounds++;
+        if (!ok) stats.round_errors++;
+        if (bad) stats.round_bad++;
+        stats.tags += n;
+        pthread_mutex_unlock(&stats_lock);
+
+        if (!ok) { // device busy or going away, do not hammer it until the unplug is seen
+            usleep(CFUHF_BACKOFF_MIN * 1000);
+            continue;
+        }
+        // cadence from the start of the round, back to back while triggered
+        uint64_t now = __now_ms();
+        if (opts.poll_interval && now < atomic_load(&active_until)) continue;
+        if (opts.poll_interval && now - start < opts.poll_interval)
+            __wait_trigger(opts.poll_interval - (now - start));
+    }
+    return NULL;
+}
+
+/**
+ *  @brief Give a reader the next source id, before cfuhf_init()
+ *  @param sn serial number in hex, as in the device info (14 digits)
+ *  @return its index: the reader reports as source_id + index, -1 if invalid or the table is full
+ */
+int cfuhf_add_device(const char* sn)
+{
+    uint8_t bin[CFUHF_SN_LEN];
+    for (int i = 0; i < CFUHF_SN_LEN; i++) {
+        int hi = __hex_value(sn[2 * i]);
+        int lo = hi < 0 ? -1 : __hex_value(sn[2 * i + 1]);
+        if (lo < 0) return -1;
+        bin[i] = hi << 4 | lo;
+    }
+    if (sn[2 * CFUHF_SN_LEN] != '\0') return -1;
+    return __device(bin);
+}
+
+/**
+ *  @brief Start reading the USB reader, reopened whenever it drops
+ *  @param source_id source id of the first reader, the next ones count up from it
+ *  @param options reading mode, NULL for CFUHF_DEFAULT_OPTS
+ *  @param on_tag called from our own thread for every tag report
+ *  @param on_state called on connect/disconnect with the stats, NULL if not needed
+ */
+void cfuhf_init(uint8_t source_id, const cfuhf_opts_t* options, cfuhf_tag_handler_t on_tag, cfuhf_state_handler_t on_state)
+{
+    if (options != NULL) opts = *options;
+    source = source_id;
+    tag_handler = on_tag;
+    state_handler = on_state;
+    tag_pool_init(&pool);
+    sem_init(&wake, 0, 0);
+    sem_init(&trigger, 0, 0);
+    atomic_store(&down_since, __now_ms());
+
+    pthread_create(&tag_thread_id, NULL, opts.mode == CFUHF_POLL ? __poll_thread : __tag_thread, NULL);
+    pthread_create(&recovery_thread_id, NULL, __recovery_thread, NULL);
+}
+
+/**
+ *  @brief Run InventoryG2 rounds back to back for active_time ms, e.g. on a PIR trigger
+ *  @note: does nothing in CFUHF_CALLBACK mode, the reader is always streaming
+ */
+void cfuhf_trigger(void)
+{
+    if (opts.mode != CFUHF_POLL) return;
+    atomic_store(&active_until, __now_ms() + opts.active_time);
+    sem_post(&trigger);
+}
+
+void cfuhf_stats(cfuhf_stats_t* out)
+{
+    pthread_mutex_lock(&stats_lock);
+    *out = stats;
+    pthread_mutex_unlock(&stats_lock);
+    out->connected = atomic_load(&connected);
+}
+
+/**
+ *  @brief Counters of every reader seen so far
+ *  @param out room for max readers
+ *  @return readers copied to out
+ */
+uint8_t cfuhf_devices(cfuhf_device_t* out, uint8_t max)
+{
+    int cnt = atomic_load(&device_cnt);
+    int dev = atomic_load(&current);
+    if (cnt > max) cnt = max;
+
+    pthread_mutex_lock(&stats_lock);
+    for (int i = 0; i < cnt; i++) {
+        memcpy(out[i].sn, devices[i].sn, CFUHF_SN_LEN);
+        out[i].source = source + i;
+        out[i].open = i == dev && atomic_load(&connected);
+        out[i].opens = devices[i].opens;
+        out[i].disconnects = devices[i].disconnects;
+        out[i].tags = atomic_load_explicit(&devices[i].tags, memory_order_relaxed);
+        out[i].last_seen = atomic_load_explicit(&devices[i].last_seen, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&stats_lock);
+    return cnt;
+}
+
+//--------------------------------------------------------------
+#endif //__CFUHF_C
@@ -0,0 +1,303 @@
+/** ------------------------------------------------------------*-
+ * Encoding kernels - function file
+ * CheckinGate Project.
+ * (c) Minh-An Dao 2020
+ * version 1.00 - 19/10/2020
+ *--------------------------------------------------------------
+ * Every event goes through hex (EPC), decimal (timestamp) and JSON
+ * encoding. sprintf() parses its format string on every call, so
+ * these kernels are used instead:
+ *
+ * - Hex: 16 bytes at a time with SSSE3 (x86) or 8 bytes at a time
+ *   with NEON (ARM) when the compiler targets them, a 256 entry pair
+ *   table otherwise and for the tail. Raspbian's default armv6 target
+ *   has no NEON, build with -mfpu=neon on a Pi 2/3 to get it.
+ * - Decimal: two digits per division with a 00-99 pair table.
+ * - encode_buf_t: appends into a caller buffer of fixed capacity. A
+ *   piece that does not fit is left out whole and the overflow flag
+ *   is set, the buffer stays NUL terminated.
+ * - JSON: object members with escaped strings, commas are handled by
+ *   the writer.
+ * - CBOR (RFC 8949): every head in its shortest form, which is what
+ *   makes it smaller than JSON: a 13 digit timestamp takes 9 bytes,
+ *   a small id 1 byte, a key or a string header 1 byte.
+ *
+ * tools/encode_bench compares them with the printf based code.
+ *
+ -------------------------------------------------------------- */
+#ifndef __ENCODE_C
+#define __ENCODE_C
+
+#include <string.h>
+
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+#include <encode.h>
+
+// ------ Private constants -----------------------------------
+static const char hex_digits[] = "0123456789ABCDEF";
+
+// "00" "01" ... "FF", the two digits of every byte
+#define HEX_ROW(h) h "0" h "1" h "2" h "3" h "4" h "5" h "6" h "7" \
+                   h "8" h "9" h "A" h "B" h "C" h "D" h "E" h "F"
+static const char hex_pairs[] =
+    HEX_ROW("0") HEX_ROW("1") HEX_ROW("2") HEX_ROW("3") HEX_ROW("4") HEX_ROW("5") HEX_ROW("6") HEX_ROW("7")
+    HEX_ROW("8") HEX_ROW("9") HEX_ROW("A") HEX_ROW("B") HEX_ROW("C") HEX_ROW("D") HEX_ROW("E") HEX_ROW("F");
+
+static const char dec_pairs[] =
+    "00010203040506070809" "10111213141516171819" "20212223242526272829"
+    "30313233343536373839" "40414243444546474849" "50515253545556575859"
+    "60616263646566676869" "70717273747576777879" "80818283848586878889"
+    "90919293949596979899";
+
+//--------------------------------------------------------------
+// FUNCTION DEFINITIONS
+//--------------------------------------------------------------
+/**
+ *  @brief Upper case hex of a byte array, not NUL terminated
+ *  @param out at least 2*n bytes
+ *  @param in the bytes
+ *  @param n number of bytes
+ *  @return end of the written string
+ */
+char* encode_hex_raw(char* out, const uint8_t* in, size_t n)
+{
+#if defined(__SSSE3__)
+    const __m128i lut = _mm_loadu_si128((const __m128i*)hex_digits);
+    const __m128i mask = _mm_set1_epi8(0x0F);
+    for (; n >= 16; n -= 16, in += 16, out += 32) {
+        __m128i x = _mm_loadu_si128((const __m128i*)in);
+        __m128i hi = _mm_shuffle_epi8(lut, _mm_and_si128(_mm_srli_epi16(x, 4), mask));
+        __m128i lo = _mm_shuffle_epi8(lut, _mm_and_si128(x, mask));
+        _mm_storeu_si128((__m128i*)out, _mm_unpacklo_epi8(hi, lo));
+        _mm_storeu_si128((__m128i*)(out + 16), _mm_unpackhi_epi8(hi, lo));
+    }
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    const uint8x8x2_t lut = {{vld1_u8((const uint8_t*)hex_digits), vld1_u8((const uint8_t*)hex_digits + 8)}};
+    for (; n >= 8; n -= 8, in += 8, out += 16) {
+        uint8x8_t x = vld1_u8(in);
+        uint8x8x2_t pairs = {{vtbl2_u8(lut, vshr_n_u8(x, 4)), vtbl2_u8(lut, vand_u8(x, vdup_n_u8(0x0F)))}};
+        vst2_u8((uint8_t*)out, pairs); // interleaved: high digit, low digit
+    }
+#endif
+    for (; n > 0; n--, out += 2) memcpy(out, hex_pairs + *in++ * 2, 2);
+    return out;
+}
+
+/**
+ *  @brief Decimal digits of an unsigned integer, not NUL terminated
+ *  @param out at least ENCODE_U64_MAX_LEN bytes
+ *  @param v the value
+ *  @return end of the written string
+ */
+char* encode_u64_raw(char* out, uint64_t v)
+{
+    char tmp[ENCODE_U64_MAX_LEN];
+    char* p = tmp + sizeof(tmp);
+
+    while (v >= 100) {
+        uint32_t pair = (uint32_t)(v % 100) * 2;
+        v /= 100;
+        p -= 2;
+        memcpy(p, dec_pairs + pair, 2);
+    }
+    if (v >= 10) {
+        p -= 2;
+        memcpy(p, dec_pairs + v * 2, 2);
+    } else {
+        *--p = '0' + (char)v;
+    }
+
+    size_t len = tmp + sizeof(tmp) - p;
+    memcpy(out, p, len);
+    return out + len;
+}
+
+/**
+ *  @brief Make room for n more bytes and the NUL
+ *  @return where to write, NULL if it does not fit
+ */
+static char* __reserve(encode_buf_t* b, size_t n)
+{
+    if (b->len + n + 1 > b->cap) {
+        b->overflow = 1;
+        return NULL;
+    }
+    return b->buf + b->len;
+}
+
+static void __commit(encode_buf_t* b, char* end)
+{
+    b->len = end - b->buf;
+    *end = '\0';
+}
+
+/**
+ *  @brief Start writing into a caller buffer
+ *  @param b the writer
+ *  @param buf the buffer
+ *  @param cap size of buf, at least 1
+ */
+void encode_init(encode_buf_t* b, char* buf, size_t cap)
+{
+    b->buf = buf;
+    b->cap = cap;
+    b->len = 0;
+    b->overflow = 0;
+    b->fields = 0;
+    if (cap > 0) buf[0] = '\0';
+}
+
+void encode_mem(encode_buf_t* b, const char* s, size_t n)
+{
+    char* p = __reserve(b, n);
+    if (p == NULL) return;
+    memcpy(p, s, n);
+    __commit(b, p + n);
+}
+
+void encode_str(encode_buf_t* b, const char* s)
+{
+    encode_mem(b, s, strlen(s));
+}
+
+void encode_char(encode_buf_t* b, char c)
+{
+    char* p = __reserve(b, 1);
+    if (p == NULL) return;
+    *p = c;
+    __commit(b, p + 1);
+}
+
+void encode_hex(encode_buf_t* b, const uint8_t* in, size_t n)
+{
+    char* p = __reserve(b, n * 2);
+    if (p == NULL) return;
+    __commit(b, encode_hex_raw(p, in, n));
+}
+
+void encode_u64(encode_buf_t* b, uint64_t v)
+{
+    char digits[ENCODE_U64_MAX_LEN];
+    encode_mem(b, digits, encode_u64_raw(digits, v) - digits);
+}
+
+void encode_i64(encode_buf_t* b, int64_t v)
+{
+    char digits[ENCODE_U64_MAX_LEN + 1];
+    char* p = digits;
+    if (v < 0) *p++ = '-';
+    p = encode_u64_raw(p, v < 0 ? (uint64_t)0 - (uint64_t)v : (uint64_t)v);
+    encode_mem(b, digits, p - digits);
+}
+
+//--------------------------------------------------------------
+void encode_json_begin(encode_buf_t* b)
+{
+    encode_char(b, '{');
+    b->fields = 0;
+}
+
+void encode_json_end(encode_buf_t* b)
+{
+    encode_char(b, '}');
+}
+
+/**
+ *  @brief Quoted and escaped JSON string
+ */
+void encode_json_string(encode_buf_t* b, const char* s)
+{
+    encode_char(b, '"');
+    while (*s) {
+        const char* run = s; // longest run without anything to escape
+        while (*s && *s != '"' && *s != '\\' && (uint8_t)*s >= 0x20) s++;
+        encode_mem(b, run, s - run);
+        if (!*s) break;
+
+        char esc[6] = {'\\', *s, 0, 0, 0, 0};
+        size_t len = 2;
+        if ((uint8_t)*s < 0x20) {
+            esc[1] = 'u'; esc[2] = '0'; esc[3] = '0';
+            esc[4] = hex_digits[(uint8_t)*s >> 4];
+            esc[5] = hex_digits[*s & 0x0F];
+            len = 6;
+        }
+        encode_mem(b, esc, len);
+        s++;
+    }
+    encode_char(b, '"');
+}
+
+/**
+ *  @brief Member name, with the comma before it if needed
+ */
+void encode_json_key(encode_buf_t* b, const char* key)
+{
+    if (b->fields++) encode_char(b, ',');
+    encode_json_string(b, key);
+    encode_char(b, ':');
+}
+
+void encode_json_str(encode_buf_t* b, const char* key, const char* value)
+{
+    encode_json_key(b, key);
+    encode_json_string(b, value);
+}
+
+void encode_json_u64(encode_buf_t* b, const char* key, uint64_t value)
+{
+    encode_json_key(b, key);
+    encode_u64(b, value);
+}
+
+//--------------------------------------------------------------
+/**
+ *  @brief Head of a CBOR item: major type and argument, in the shortest form
+ */
+static void __cbor_head(encode_buf_t* b, uint8_t major, uint64_t v)
+{
+    char head[9];
+    size_t n = 1;
+    major <<= 5;
+    if (v < 24) {
+        head[0] = major | v;
+    } else {
+        uint8_t bytes = v <= 0xFF ? 1 : v <= 0xFFFF ? 2 : v <= 0xFFFFFFFFull ? 4 : 8;
+        head[0] = major | (bytes == 1 ? 24 : bytes == 2 ? 25 : bytes == 4 ? 26 : 27);
+        for (int i = bytes - 1; i >= 0; i--) head[n++] = v >> (8 * i); // big endian
+    }
+    encode_mem(b, head, n);
+}
+
+void encode_cbor_u64(encode_buf_t* b, uint64_t v)
+{
+    __cbor_head(b, 0, v);
+}
+
+void encode_cbor_text(encode_buf_t* b, const char* s)
+{
+    size_t n = strlen(s);
+    __cbor_head(b, 3, n);
+    encode_mem(b, s, n);
+}
+
+/**
+ *  @brief Map of pairs key/value items, written next
+ */
+void encode_cbor_map(encode_buf_t* b, size_t pairs)
+{
+    __cbor_head(b, 5, pairs);
+}
+
+void encode_cbor_tag(encode_buf_t* b, uint64_t tag)
+{
+    __cbor_head(b, 6, tag);
+}
+
+//--------------------------------------------------------------
+#endif //__ENCODE_C
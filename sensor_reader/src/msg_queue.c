@@ -0,0 +1,217 @@
+/** ------------------------------------------------------------*-
+ * Message queue - function file
+ * CheckinGate Project.
+ * (c) Minh-An Dao 2020
+ * version 1.00 - 19/10/2020
+ *--------------------------------------------------------------
+ * rabbitmq-c connections are not thread-safe, and every sensor
+ * thread (PIR, Wiegand timeout, UHF readers, USB tag thread) used to
+ * publish on the same one, interleaving frames and waiting on the
+ * network. They now put their message here and return; one thread
+ * owns the connection and takes them out in order.
+ *
+ * Same ring as tag_pool.c (D. Vyukov's bounded queue): a producer
+ * claims a slot with one compare-and-swap and copies the message in,
+ * a full queue drops the message and counts it, never waits. The
+ * consumer sleeps on a semaphore.
+ *
+ * There is one ring per lane (RABBITMQ_LANE_...), so that a burst of
+ * PIR states neither fills the ring of the tags nor makes them wait
+ * behind it. The lane stays with the message in the spool, where the
+ * publisher picks the lane to send from, see __spool_next() in
+ * rabbitmq.c. The lanes share the semaphore.
+ *
+ -------------------------------------------------------------- */
+#ifndef __MSG_QUEUE_C
+#define __MSG_QUEUE_C
+
+#define _GNU_SOURCE // sem_clockwait()
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+
+#include <msg_queue.h>
+
+// ------ Private constants -----------------------------------
+#define MASK (MSG_QUEUE_SIZE - 1)
+
+//--------------------------------------------------------------
+// FUNCTION DEFINITIONS
+//--------------------------------------------------------------
+void msg_queue_init(msg_queue_t* q)
+{
+    memset(q, 0, sizeof(*q));
+    for (uint8_t l = 0; l < MSG_QUEUE_LANES; l++)
+        for (unsigned int i = 0; i < MSG_QUEUE_SIZE; i++) atomic_init(&q->lanes[l].cells[i].seq, i);
+    sem_init(&q->ready, 0, 0);
+}
+
+/**
+ *  @brief Copy one message into a free slot of its lane, never blocks
+ *  @param q the queue
+ *  @param lane its priority, 0 first
+ *  @param exchange exchange name
+ *  @param routing_key routing key
+ *  @param body message, JSON or CBOR
+ *  @param body_len its length
+ *  @param queued us, monotonic, for the latency
+ *  @return MSG_QUEUE_OK if kept, MSG_QUEUE_FULL or MSG_QUEUE_OVERSIZE if dropped
+ */
+uint8_t msg_queue_put(msg_queue_t* q, uint8_t lane, const char* exchange, const char* routing_key, const char* body, size_t body_len, uint64_t queued)
+{
+    size_t exchange_len = strlen(exchange), key_len = strlen(routing_key);
+    if (lane >= MSG_QUEUE_LANES || body_len >= MSG_QUEUE_BODY_LEN || exchange_len >= MSG_QUEUE_EXCHANGE_LEN || key_len >= MSG_QUEUE_KEY_LEN) {
+        atomic_fetch_add_explicit(&q->oversize, 1, memory_order_relaxed);
+        return MSG_QUEUE_OVERSIZE;
+    }
+
+    msg_lane_t* l = &q->lanes[lane];
+    unsigned int pos = atomic_load_explicit(&l->tail, memory_order_relaxed);
+    for (;;) {
+        unsigned int seq = atomic_load_explicit(&l->cells[pos & MASK].seq, memory_order_acquire);
+        int dif = (int)(seq - pos);
+        if (dif == 0) { // free for this turn, claim it
+            if (atomic_compare_exchange_weak_explicit(&l->tail, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) break;
+        } else if (dif < 0) { // still holds a message of the previous turn
+            atomic_fetch_add_explicit(&l->dropped, 1, memory_order_relaxed);
+            return MSG_QUEUE_FULL;
+        } else { // another producer took it
+            pos = atomic_load_explicit(&l->tail, memory_order_relaxed);
+        }
+    }
+
+    msg_t* msg = &l->cells[pos & MASK].msg;
+    memcpy(msg->body, body, body_len);
+    msg->body[body_len] = 0;
+    msg->body_len = body_len;
+    memcpy(msg->exchange, exchange, exchange_len + 1);
+    memcpy(msg->routing_key, routing_key, key_len + 1);
+    msg->queued = queued;
+    msg->lane = lane;
+    atomic_store_explicit(&l->cells[pos & MASK].seq, pos + 1, memory_order_release);
+
+    atomic_fetch_add_explicit(&l->put, 1, memory_order_relaxed);
+    sem_post(&q->ready);
+    return MSG_QUEUE_OK;
+}
+
+/**
+ *  @brief Take the oldest message of a lane, from the consumer thread only
+ *  @return 1 if a message was taken, 0 if the lane is empty
+ */
+uint8_t msg_queue_get(msg_queue_t* q, uint8_t lane, msg_t* msg)
+{
+    msg_lane_t* l = &q->lanes[lane];
+    unsigned int pos = l->head;
+    unsigned int seq = atomic_load_explicit(&l->cells[pos & MASK].seq, memory_order_acquire);
+
+    if (seq != pos + 1) return 0;
+
+    unsigned int used = atomic_load_explicit(&l->tail, memory_order_relaxed) - pos;
+    if (used > l->high_water) l->high_water = used;
+
+    msg_t* src = &l->cells[pos & MASK].msg;
+    memcpy(msg->body, src->body, src->body_len + 1); // the body only, not the whole slot
+    msg->body_len = src->body_len;
+    strcpy(msg->exchange, src->exchange);
+    strcpy(msg->routing_key, src->routing_key);
+    msg->queued = src->queued;
+    msg->lane = lane;
+    atomic_store_explicit(&l->cells[pos & MASK].seq, pos + MSG_QUEUE_SIZE, memory_order_release);
+    l->head = pos + 1;
+    return 1;
+}
+
+/**
+ *  @brief Sleep until a message is put, msg_queue_wake() is called or the timeout expires
+ *  The posts left by the other messages of a burst are taken as well, the caller
+ *  empties every lane after the wake: it is one wake per burst. A message put after
+ *  that leaves its own post, so it is never missed.
+ *  @param q the queue
+ *  @param timeout_ms maximum wait, on the monotonic clock when the C library has sem_clockwait()
+ *  @return 1 if a message may be waiting, 0 on timeout
+ */
+uint8_t msg_queue_wait(msg_queue_t* q, int timeout_ms)
+{
+    struct timespec ts;
+#if __GLIBC_PREREQ(2, 30)
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#else
+    clock_gettime(CLOCK_REALTIME, &ts); // a clock step moves the timeout
+#endif
+    ts.tv_sec += timeout_ms / 1000;
+    ts.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+
+#if __GLIBC_PREREQ(2, 30)
+    while (sem_clockwait(&q->ready, CLOCK_MONOTONIC, &ts) < 0)
+#else
+    while (sem_timedwait(&q->ready, &ts) < 0)
+#endif
+        if (errno != EINTR) return 0;
+    while (sem_trywait(&q->ready) == 0) ;
+    return 1;
+}
+
+/**
+ *  @brief Wake the consumer up from msg_queue_wait() without a message, from any thread
+ */
+void msg_queue_wake(msg_queue_t* q)
+{
+    sem_post(&q->ready);
+}
+
+/**
+ *  @brief Messages waiting in a lane, claimed slots not yet filled included, from the consumer thread
+ */
+unsigned int msg_queue_lane_depth(msg_queue_t* q, uint8_t lane)
+{
+    return atomic_load_explicit(&q->lanes[lane].tail, memory_order_relaxed) - q->lanes[lane].head;
+}
+
+/**
+ *  @brief Messages waiting in every lane, from the consumer thread
+ */
+unsigned int msg_queue_depth(msg_queue_t* q)
+{
+    unsigned int depth = 0;
+    for (uint8_t l = 0; l < MSG_QUEUE_LANES; l++) depth += msg_queue_lane_depth(q, l);
+    return depth;
+}
+
+/**
+ *  @brief Counters of a lane, any pointer can be NULL
+ */
+void msg_queue_lane_stats(msg_queue_t* q, uint8_t lane, uint32_t* put, uint32_t* dropped, uint32_t* high_water)
+{
+    if (put) *put = atomic_load_explicit(&q->lanes[lane].put, memory_order_relaxed);
+    if (dropped) *dropped = atomic_load_explicit(&q->lanes[lane].dropped, memory_order_relaxed);
+    if (high_water) *high_water = q->lanes[lane].high_water;
+}
+
+/**
+ *  @brief Counters of the whole queue, every lane, any pointer can be NULL
+ *  @param high_water of the fullest lane
+ */
+void msg_queue_stats(msg_queue_t* q, uint32_t* put, uint32_t* dropped, uint32_t* oversize, uint32_t* high_water)
+{
+    uint32_t sum_put = 0, sum_dropped = 0, max_used = 0;
+    for (uint8_t l = 0; l < MSG_QUEUE_LANES; l++) {
+        uint32_t p, d, h;
+        msg_queue_lane_stats(q, l, &p, &d, &h);
+        sum_put += p;
+        sum_dropped += d;
+        if (h > max_used) max_used = h;
+    }
+    if (put) *put = sum_put;
+    if (dropped) *dropped = sum_dropped;
+    if (oversize) *oversize = atomic_load_explicit(&q->oversize, memory_order_relaxed);
+    if (high_water) *high_water = max_used;
+}
+
+//--------------------------------------------------------------
+#endif //__MSG_QUEUE_C
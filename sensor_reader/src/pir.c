@@ -6,6 +6,7 @@
 #include <wiringPi.h>
 
 #include <rabbitmq.h>
+#include <encode.h>
 #include <uhf.h>
 #include <sensor_reader.h>
 
@@ -25,7 +26,7 @@ uint64_t now[PIR_CNT+1];
 
 void* pir_send_thread(void* arg) {
     #if en_uhf_rs23
-		// uhf_realtime_inventory();
+		// uhf_inventory_all();
 	#endif
 
 	uint8_t id = (arg != NULL ? *(uint8_t*)arg : PIR_STATE_ID);
@@ -45,14 +46,18 @@ void* pir_send_thread(void* arg) {
 
 	#if en_rabbitmq
 		char pir_src[10];
-		snprintf(pir_src, 10, "pir.%d", id);
+		format_source(pir_src, sizeof(pir_src), "pir", id);
 		char routing_key[30];
-		snprintf(routing_key, 20, "%s.%s", ROUTING_KEY_PREFIX, pir_src);
+		format_routing_key(routing_key, sizeof(routing_key), pir_src);
 		char data[20];
-		snprintf(data, 10, "pir_id:%d", id);
-
-		send_message(format_message(now[id], "pir", pir_src, data, id),
-				 	 EXCHANGE_NAME, routing_key);
+		encode_buf_t b;
+		encode_init(&b, data, sizeof(data));
+		encode_str(&b, "pir_id:");
+		encode_u64(&b, id);
+
+		char message[MESSAGE_MAX_LEN];
+		size_t len = format_message(message, sizeof(message), now[id], "pir", pir_src, data, id);
+		send_message(message, len, EXCHANGE_NAME, routing_key, id == PIR_STATE_ID ? RABBITMQ_LANE_STATE : RABBITMQ_LANE_EVENT);
 	#endif
 
 	// Remove these lines if threads are used
@@ -101,8 +106,8 @@ void pir_2_isr() {
 void* pir_3_reader(void* arg) {
 	while (1) {
         if (!digitalRead(PIR_3_PIN)) {
-			#if en_uhf_rs232
-				uhf_realtime_inventory();
+			#if en_uhf_rs232 || en_uhf_usb
+				uhf_inventory_all();
 			#endif
 			
             printf("PIR: %d\n", PIR_STATE_ID);
@@ -2,25 +2,102 @@
 #include <stdio.h>
 #include <sys/timeb.h>
 #include <sys/time.h>
+#include <stdlib.h>
 #include <malloc.h>
 #include <string.h>
 
 #include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
 #include <amqp_tcp_socket.h>
+#include <amqp_private.h>
 
 #include <rabbitmq.h>
+#include <msg_queue.h>
+#include <spool.h>
+#include <encode.h>
+#include <tls.h>
 #include <sensor_reader.h>
 
-#define CONNECTION_COUNT 1
+#define CONNECTION_COUNT RABBITMQ_BROKER_MAX // one per broker, only the active one is open
+#define HEALTH_FAILS     2 // health checks failed in a row before a broker is down
 
+// State of the link to the broker, see __publisher_thread()
+#define LINK_UP          0 // publishing on conn[current_connection]
+#define LINK_DOWN        1 // waiting for the backoff
+#define LINK_CONNECTING  2 // the connector thread is on it
+#define LINK_READY       3 // connected by the connector thread, for the publisher to take
+#define LINK_FAILED      4 // the connector thread gave up
+#define CONFIRM_POLL     5 // ms waiting on the socket for confirms, the queue waits meanwhile
+
+// State of a message in the confirm window
+#define PENDING 0
+#define ACKED   1
+#define NACKED  2
+
+/** @brief A message on the socket, waiting for its confirm */
+typedef struct {
+	uint64_t seq;   // in the spool
+	uint64_t sent;  // us
+	uint8_t state;
+} inflight_t;
+
+// Only the publisher thread touches the connection: rabbitmq-c is not thread-safe. The connector
+// thread opens it while the link is down, and hands it over through link_state.
+// send_message() puts the message in the lane of the queue it is given and returns, from any thread.
+// The publisher thread journals every message in the spool before it goes on the socket, and
+// takes the lanes of the spool by PUBLISH_SCHEDULE so that a tag does not wait behind PIR states.
+// The brokers of the pool are checked by their own thread (TCP connect time), the publisher
+// leaves the active one as soon as it fails, or fails its checks while another one passes them.
 amqp_connection_state_t conn[CONNECTION_COUNT];
-amqp_basic_properties_t props;
+amqp_basic_properties_t props, props_cbor; // content_type of JSON messages, of CBOR messages
+
+char *username = NULL, *password = NULL;
+int current_connection = 0;  // the active broker
+static rabbitmq_broker_t brokers[RABBITMQ_BROKER_MAX]; // under stats_lock
+static uint8_t fails_in_row[RABBITMQ_BROKER_MAX];
+static uint8_t broker_cnt = 0;
+static rabbitmq_switch_handler_t switch_handler = NULL;
+static rabbitmq_stats_handler_t stats_handler = NULL;
+static pthread_t health_thread_id;
+static pthread_t connector_thread_id;
+static sem_t connect_request;
+static int connect_id;         // broker the connector thread is asked for
+static atomic_int link_state = LINK_DOWN;
 
-char message[300];
-char *hostname = NULL, *username = NULL, *password = NULL;
-int port;
-int current_connection = 0;
+static msg_queue_t queue;
+static spool_t spool; // only the publisher thread, once started
+static pthread_t publisher_thread_id;
+static rabbitmq_stats_t stats;
+// Delivery tag t is in window[t % RABBITMQ_CONFIRM_WINDOW]; tags restart at 1 with every channel.
+// Tags below first_tag were settled or given up by a rewind, their confirms are ignored.
+static inflight_t window[RABBITMQ_CONFIRM_WINDOW];
+static uint64_t first_tag = 1, next_tag = 1;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+// Frames of the publishes of a batch, written with one send()
+static uint8_t batch[RABBITMQ_BATCH_BYTES];
+static size_t batch_len = 0;
+static uint64_t batch_tag = 1;  // delivery tag of its first publish
+static uint64_t hold_since = 0; // us, when publishes started to be held back for a batch, 0 if none
+static uint64_t hold_sum = 0, hold_max = 0;
+static uint32_t hold_cnt = 0;
+static int heartbeat = 0;         // s, negotiated with the active broker, 0 for none
+static uint64_t heartbeat_at = 0; // us, next time the socket is read while nothing is in flight
+static uint8_t use_tls = 0, tls_verify = 1;
+static char* tls_cacert = NULL;
+static tls_t tls[RABBITMQ_BROKER_MAX]; // one context per broker, for the whole run
+static const char* lane_names[RABBITMQ_LANES] = {"tag", "event", "state"};
+
+static uint64_t __now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
 /**
  *  @brief Get current system time
@@ -35,85 +112,876 @@ uint64_t get_current_time(void)
 
 
 /**
- *  @brief Format recieved message to established standard to send to RabbitMQ
+ *  @brief Format recieved message to established standard to send to RabbitMQ, in JSON or in
+ *  CBOR (MESSAGE_ENCODING, see rabbitmq.h). CBOR starts with the self-describe tag 55799, so
+ *  that a spooled message keeps its content_type whatever the build publishing it
+ *  @param out buffer for the message, every thread uses its own (MESSAGE_MAX_LEN bytes)
+ *  @param out_len size of out
  *  @param sensor type of sensor
  *  @param src source of trigger
  *  @param data data to send
- *  @return formatted string
+ *  @param sensor_id id of the sensor, in CBOR only
+ *  @return length of the message, 0 if it does not fit in out
+ */
+size_t format_message(char* out, size_t out_len, uint64_t timestamp, const char* sensor, const char* src, const char* data, uint8_t sensor_id)
+{
+	encode_buf_t b;
+	encode_init(&b, out, out_len);
+#if MESSAGE_ENCODING == RABBITMQ_CBOR
+	encode_cbor_tag(&b, 55799);
+	encode_cbor_map(&b, 6);
+	encode_cbor_u64(&b, 0);
+	encode_cbor_u64(&b, RABBITMQ_CBOR_VERSION);
+	encode_cbor_u64(&b, 1);
+	encode_cbor_u64(&b, timestamp);
+	encode_cbor_u64(&b, 2);
+	encode_cbor_text(&b, sensor);
+	encode_cbor_u64(&b, 3);
+	encode_cbor_text(&b, src);
+	encode_cbor_u64(&b, 4);
+	encode_cbor_text(&b, data);
+	encode_cbor_u64(&b, 5);
+	encode_cbor_u64(&b, sensor_id);
+#else
+	encode_json_begin(&b);
+	encode_json_u64(&b, "timestamp", timestamp);
+	encode_json_str(&b, "event_type", sensor);
+	encode_json_str(&b, "source", src);
+	encode_json_str(&b, "data", data);
+	encode_json_end(&b);
+#endif
+	return b.overflow ? 0 : b.len;
+}
+
+/**
+ *  @brief Tell a CBOR message from a JSON one, see format_message()
+ */
+static uint8_t __is_cbor(const char* body, uint16_t len)
+{
+	return len >= 3 && !memcmp(body, "\xD9\xD9\xF7", 3);
+}
+
+/**
+ *  @brief Source name of a sensor, e.g. rfid.3
  */
-char* format_message(uint64_t timestamp, char* sensor, char* src, char* data, uint8_t sensor_id)
+char* format_source(char* out, size_t out_len, const char* sensor, uint8_t id)
 {
-	snprintf(message, 300,
-		"{"
-			"\"timestamp\":%llu,"
-			"\"event_type\":\"%s\","
-			"\"source\":\"%s\","
-			"\"data\":\"%s\""
-		"}",
-		timestamp, sensor, src, data
-	);
-	//printf("%s\n", message);
-	return message;
+	encode_buf_t b;
+	encode_init(&b, out, out_len);
+	encode_str(&b, sensor);
+	encode_char(&b, '.');
+	encode_u64(&b, id);
+	return out;
 }
 
+/**
+ *  @brief Routing key of a source, e.g. event.rfid.3
+ */
+char* format_routing_key(char* out, size_t out_len, const char* src)
+{
+	encode_buf_t b;
+	encode_init(&b, out, out_len);
+	encode_str(&b, ROUTING_KEY_PREFIX);
+	encode_char(&b, '.');
+	encode_str(&b, src);
+	return out;
+}
+
+/**
+ *  @brief Add a broker to the pool, before rabbitmq_init()
+ *  @param host "host" or "host:port"
+ *  @param default_port port if host has none
+ *  @return its index, the first ones are preferred, -1 if the pool is full or host too long
+ */
+int rabbitmq_add_broker(const char* host, int default_port)
+{
+	if (broker_cnt == RABBITMQ_BROKER_MAX) return -1;
+	rabbitmq_broker_t* b = &brokers[broker_cnt];
+	const char* colon = strchr(host, ':');
+	size_t len = colon ? (size_t)(colon - host) : strlen(host);
+	if (len == 0 || len >= sizeof(b->host)) return -1;
+
+	memset(b, 0, sizeof(*b));
+	memcpy(b->host, host, len);
+	b->port = colon ? atoi(colon + 1) : default_port;
+	b->healthy = 1; // until checked
+	return broker_cnt++;
+}
+
+/**
+ *  @brief Credentials of every broker; the host is added to the pool if it is still empty
+ */
 void rabbitmq_set_connection_params(const char* hostname_, const char* username_, const char* password_, int port_) {
-	hostname = (char*)malloc(sizeof(char)*strlen(hostname_)+1);
-	strcpy(hostname, hostname_);
+	if (broker_cnt == 0) rabbitmq_add_broker(hostname_, port_);
 
 	username = (char*)malloc(sizeof(char)*strlen(username_)+1);
 	strcpy(username, username_);
 
 	password = (char*)malloc(sizeof(char)*strlen(password_)+1);
 	strcpy(password, password_);
+}
 
-	port = port_;
+/**
+ *  @brief Connect to every broker over TLS, before rabbitmq_init(). The TLS sessions are resumed
+ *  on reconnect, see tls.c
+ *  @param cacert CA certificates (PEM) of the brokers, NULL for the system ones
+ *  @param verify 0 to accept any certificate (tests only)
+ */
+void rabbitmq_set_tls(const char* cacert, uint8_t verify)
+{
+	use_tls = 1;
+	tls_verify = verify;
+	tls_cacert = cacert ? strdup(cacert) : NULL;
+}
+
+/**
+ *  @brief Called on every switch of the active broker, from the publisher thread
+ */
+void rabbitmq_on_switch(rabbitmq_switch_handler_t handler)
+{
+	switch_handler = handler;
 }
 
-void rabbitmq_init_with_id(int id) {
+/**
+ *  @brief Called after the queue/latency log, every RABBITMQ_STATS_INTERVAL, from the publisher thread:
+ *  the counters of the other modules go with it
+ */
+void rabbitmq_on_stats(rabbitmq_stats_handler_t handler)
+{
+	stats_handler = handler;
+}
+
+/**
+ *  @brief TCP keepalive on the socket of a broker, for a broker gone without a FIN while the
+ *  heartbeats are off, or while a write waits: the socket fails after
+ *  RABBITMQ_KEEPALIVE_IDLE + RABBITMQ_KEEPALIVE_INTVL * RABBITMQ_KEEPALIVE_CNT s
+ */
+static void __keepalive(int fd)
+{
+	int on = 1, idle = RABBITMQ_KEEPALIVE_IDLE, intvl = RABBITMQ_KEEPALIVE_INTVL, cnt = RABBITMQ_KEEPALIVE_CNT;
+	setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+#ifdef TCP_KEEPIDLE
+	setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+	setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &intvl, sizeof(intvl));
+	setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &cnt, sizeof(cnt));
+#endif
+#ifdef TCP_USER_TIMEOUT
+	unsigned int unacked = (idle + intvl * cnt) * 1000; // ms, else data not acknowledged is sent again for ~15 min
+	setsockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &unacked, sizeof(unacked));
+#endif
+}
+
+/**
+ *  @brief (Re)open the connection to a broker, the one it replaces is destroyed. Every step
+ *  is bounded: RABBITMQ_CONNECT_TIMEOUT for the TCP connect, RABBITMQ_LOGIN_TIMEOUT for
+ *  each of the login, channel.open and confirm.select, the TLS handshake included in the connect.
+ *  Heartbeats of RABBITMQ_HEARTBEAT s are asked for
+ *  @param id index of the broker
+ *  @return 0 if logged in and the channel is open
+ */
+int rabbitmq_init_with_id(int id) {
 	int status;
+	struct timeval connect_timeout = {RABBITMQ_CONNECT_TIMEOUT / 1000, (RABBITMQ_CONNECT_TIMEOUT % 1000) * 1000};
+	struct timeval login_timeout = {RABBITMQ_LOGIN_TIMEOUT / 1000, (RABBITMQ_LOGIN_TIMEOUT % 1000) * 1000};
 
+	if (conn[id] != NULL) amqp_destroy_connection(conn[id]);
 	conn[id] = amqp_new_connection();
+	amqp_set_handshake_timeout(conn[id], &login_timeout);
+	amqp_set_rpc_timeout(conn[id], &login_timeout);
 
 	amqp_socket_t *socket = NULL;
-	socket = amqp_tcp_socket_new(conn[id]);
+	socket = use_tls ? tls_socket(&tls[id], conn[id]) : amqp_tcp_socket_new(conn[id]);
 	if (!socket) {
-		printf("Problem creating TCP socket\n");
-		//return 1;
+		printf("Problem creating %s socket\n", use_tls ? "TLS" : "TCP");
+		return -1;
 	}
 
-	status = amqp_socket_open(socket, hostname, port);
+	uint64_t start = __now_us();
+	status = amqp_socket_open_noblock(socket, brokers[id].host, brokers[id].port, &connect_timeout);
 	if (status) {
-		printf("Problem opening TCP socket\n");
+		printf("Problem opening %s socket to %s:%d: %s\n", use_tls ? "TLS" : "TCP", brokers[id].host, brokers[id].port, amqp_error_string2(status));
+		if (use_tls) tls_forget(&tls[id]);
+		return -1;
 	}
+	if (use_tls) tls_opened(&tls[id], socket, __now_us() - start);
+	__keepalive(amqp_socket_get_sockfd(socket));
 
-	amqp_login(conn[id], "/", 0, 131072, 0, AMQP_SASL_METHOD_PLAIN, username, password);
+	if (amqp_login(conn[id], "/", 0, 131072, RABBITMQ_HEARTBEAT, AMQP_SASL_METHOD_PLAIN, username, password).reply_type != AMQP_RESPONSE_NORMAL) {
+		printf("Problem logging in to %s:%d\n", brokers[id].host, brokers[id].port);
+		return -1;
+	}
 	amqp_channel_open(conn[id], 1);
-	amqp_get_rpc_reply(conn[id]);
+	if (amqp_get_rpc_reply(conn[id]).reply_type != AMQP_RESPONSE_NORMAL)
+		return -1;
+	if (amqp_confirm_select(conn[id], 1) == NULL) // an ack or a nack for every publish from now on
+		return -1;
+	return 0;
+}
+
+/**
+ *  @brief Connect the brokers the publisher thread asks for, so that it keeps taking the
+ *  messages out of the queue meanwhile. The answer is in link_state, the publisher is woken up
+ */
+static void* __connector_thread(void* arg)
+{
+	while (1) {
+		while (sem_wait(&connect_request) < 0);
+		int ok = rabbitmq_init_with_id(connect_id) == 0;
+		atomic_store(&link_state, ok ? LINK_READY : LINK_FAILED);
+		msg_queue_wake(&queue);
+	}
+	return NULL;
+}
+
+/**
+ *  @brief Journal every message waiting in the lanes, tags first
+ */
+static void __spool_queue(void)
+{
+	static msg_t msg; // a slot is too big for the stack of a thread
+
+	for (uint8_t l = 0; l < RABBITMQ_LANES; l++)
+		while (msg_queue_get(&queue, l, &msg)) spool_append(&spool, &msg);
+}
+
+/**
+ *  @brief Next spooled record to publish, taking the lanes by PUBLISH_SCHEDULE
+ *  @return 1 if there is one, 0 if everything was given out
+ */
+static uint8_t __spool_next(spool_rec_t* rec)
+{
+#if PUBLISH_SCHEDULE == RABBITMQ_WEIGHTED
+	static const uint32_t weights[RABBITMQ_LANES] = RABBITMQ_LANE_WEIGHTS;
+	static uint8_t turn = 0;  // lane taking its turn, kept from one call to the next
+	static uint32_t left = 0; // records it may still take in this turn
+	for (uint8_t empty = 0; empty < RABBITMQ_LANES; ) {
+		if (!left) left = weights[turn];
+		if (spool_next(&spool, turn, rec)) {
+			if (!--left) turn = (turn + 1) % RABBITMQ_LANES;
+			return 1;
+		}
+		left = 0; // an empty lane gives its turn away
+		empty++;
+		turn = (turn + 1) % RABBITMQ_LANES;
+	}
+	return 0;
+#else
+	for (uint8_t l = 0; l < RABBITMQ_LANES; l++)
+		if (spool_next(&spool, l, rec)) return 1;
+	return 0;
+#endif
+}
+
+/**
+ *  @brief Frame header and end around a payload already in place
+ *  @return where the next frame goes
+ */
+static uint8_t* __frame(uint8_t* p, uint8_t type, uint32_t len)
+{
+	amqp_e8(type, p);
+	amqp_e16(1, p + 1); // channel
+	amqp_e32(len, p + 3);
+	amqp_e8(AMQP_FRAME_END, p + HEADER_SIZE + len);
+	return p + HEADER_SIZE + len + FOOTER_SIZE;
+}
+
+/**
+ *  @brief Add the frames amqp_basic_publish() would send for a record (method, header, body) to the batch
+ *  @return 0 if there is no room left, the batch is unchanged
+ */
+static uint8_t __batch_add(const spool_rec_t* rec)
+{
+	uint8_t *p = batch + batch_len, *end = batch + sizeof(batch);
+	amqp_basic_publish_t m = {.exchange = amqp_cstring_bytes(rec->exchange), .routing_key = amqp_cstring_bytes(rec->routing_key)};
+	amqp_bytes_t out;
+	int len;
+
+	if (end - p < HEADER_SIZE + 12 + FOOTER_SIZE) return 0;
+	out.bytes = p + HEADER_SIZE + 4;
+	out.len = end - p - (HEADER_SIZE + 4 + FOOTER_SIZE);
+	if ((len = amqp_encode_method(AMQP_BASIC_PUBLISH_METHOD, &m, out)) < 0) return 0;
+	amqp_e32(AMQP_BASIC_PUBLISH_METHOD, p + HEADER_SIZE);
+	p = __frame(p, AMQP_FRAME_METHOD, len + 4);
+
+	if (end - p < HEADER_SIZE + 12 + FOOTER_SIZE) return 0;
+	out.bytes = p + HEADER_SIZE + 12;
+	out.len = end - p - (HEADER_SIZE + 12 + FOOTER_SIZE);
+	if ((len = amqp_encode_properties(AMQP_BASIC_CLASS, __is_cbor(rec->body, rec->body_len) ? &props_cbor : &props, out)) < 0) return 0;
+	amqp_e16(AMQP_BASIC_CLASS, p + HEADER_SIZE);
+	amqp_e16(0, p + HEADER_SIZE + 2); // weight
+	amqp_e64(rec->body_len, p + HEADER_SIZE + 4);
+	p = __frame(p, AMQP_FRAME_HEADER, len + 12);
+
+	if (rec->body_len) { // a body fits in one frame, frame_max is 128 kB
+		if (end - p < HEADER_SIZE + rec->body_len + FOOTER_SIZE) return 0;
+		memcpy(p + HEADER_SIZE, rec->body, rec->body_len);
+		p = __frame(p, AMQP_FRAME_BODY, rec->body_len);
+	}
+	batch_len = p - batch;
+	return 1;
+}
+
+/**
+ *  @brief Write the batch to the socket at once
+ *  @return 0 if the connection is lost
+ */
+static uint8_t __batch_flush(void)
+{
+	if (!batch_len) return 1;
+	struct timeval timeout = {RABBITMQ_SEND_TIMEOUT / 1000, (RABBITMQ_SEND_TIMEOUT % 1000) * 1000};
+	amqp_time_t deadline;
+	amqp_time_from_now(&deadline, &timeout); // a broker which stopped reading must not hold the thread
+	ssize_t sent = amqp_try_send(conn[current_connection], batch, batch_len, deadline, AMQP_SF_NONE);
+	uint8_t ok = sent == (ssize_t)batch_len;
+	batch_len = 0;
+	if (!ok) return 0;
+	amqp_time_s_from_now(&conn[current_connection]->next_send_heartbeat, heartbeat); // the batch tells the broker we are alive
+
+	uint64_t now = __now_us();
+	for (uint64_t t = batch_tag; t < next_tag; t++) window[t % RABBITMQ_CONFIRM_WINDOW].sent = now;
+	batch_tag = next_tag;
+	pthread_mutex_lock(&stats_lock);
+	stats.writes++;
+	pthread_mutex_unlock(&stats_lock);
+	return 1;
+}
+
+/**
+ *  @brief Tell if the records not sent yet should go now. Like Nagle: at once if nothing is
+ *  waiting for a confirm, else once there are RABBITMQ_BATCH_MIN of them or after RABBITMQ_BATCH_DELAY
+ */
+static uint8_t __batch_due(void)
+{
+	uint32_t unsent = spool_unsent(&spool);
+	if (!unsent) return 0;
+	if (next_tag != first_tag && unsent < RABBITMQ_BATCH_MIN) {
+		uint64_t now = __now_us();
+		if (!hold_since) hold_since = now;
+		if (now - hold_since < RABBITMQ_BATCH_DELAY * 1000ull) return 0;
+	}
+	if (hold_since) {
+		uint64_t held = __now_us() - hold_since;
+		hold_sum += held;
+		hold_cnt++;
+		if (held > hold_max) hold_max = held;
+		hold_since = 0;
+	}
+	return 1;
+}
+
+/**
+ *  @brief Publish the spooled records in order until the spool is empty, the confirm window is
+ *  full or the broker goes away. The publishes are coalesced in batches of RABBITMQ_BATCH_BYTES
+ *  @param latency_sum, latency_max, latency_cnt latency of each lane, RABBITMQ_LANES of each
+ *  @return 0 if the connection is lost
+ */
+static uint8_t __publish_spool(uint64_t* latency_sum, uint64_t* latency_max, uint32_t* latency_cnt)
+{
+	spool_rec_t rec;
+	uint32_t sent = 0;
+
+	if (!__batch_due()) return 1;
+	batch_tag = next_tag;
+	while (next_tag - first_tag < RABBITMQ_CONFIRM_WINDOW && __spool_next(&rec)) {
+		if (!__batch_add(&rec) && (!__batch_flush() || !__batch_add(&rec))) return 0; // a record always fits an empty batch
+
+		uint64_t now = __now_us();
+		inflight_t* f = &window[next_tag++ % RABBITMQ_CONFIRM_WINDOW];
+		f->seq = rec.seq; // stays in the spool until the broker confirms it
+		f->state = PENDING;
+
+		if (rec.queued <= now && rec.lane < RABBITMQ_LANES) { // queued before a restart: another clock
+			uint64_t latency = now - rec.queued;
+			latency_sum[rec.lane] += latency;
+			latency_cnt[rec.lane]++;
+			if (latency > latency_max[rec.lane]) latency_max[rec.lane] = latency;
+		}
+		uint32_t depth = msg_queue_depth(&queue) + spool_pending(&spool);
+		pthread_mutex_lock(&stats_lock);
+		stats.published++;
+		stats.depth = depth;
+		if (depth > stats.depth_max) stats.depth_max = depth;
+		pthread_mutex_unlock(&stats_lock);
+
+		if (++sent % 64 == 0) __spool_queue(); // a long replay must not fill the lanes, and a new tag goes next
+	}
+	return __batch_flush();
+}
+
+/**
+ *  @brief Mark the messages an ack or a nack is about
+ *  @param tag delivery tag
+ *  @param multiple every message up to tag
+ *  @param state ACKED or NACKED
+ */
+static void __confirm(uint64_t tag, uint8_t multiple, uint8_t state)
+{
+	if (tag >= next_tag) return; // not published on this channel
+	for (uint64_t t = multiple ? first_tag : tag; t <= tag; t++)
+		if (t >= first_tag && window[t % RABBITMQ_CONFIRM_WINDOW].state == PENDING) // a multiple ack covers the ones not confirmed yet
+			window[t % RABBITMQ_CONFIRM_WINDOW].state = state;
+}
+
+/**
+ *  @brief Histogram bucket of a confirm latency, see RABBITMQ_CONFIRM_BUCKETS
+ */
+static uint8_t __bucket(uint64_t us)
+{
+	uint8_t b = 0;
+	for (uint64_t ms = us / 1000; ms && b < RABBITMQ_CONFIRM_BUCKETS - 1; ms >>= 1) b++;
+	return b;
+}
+
+/**
+ *  @brief Trim the spool up to the oldest message not confirmed yet. A nack sends
+ *  everything from the nacked message again: the broker may see a few twice
+ */
+static void __settle(void)
+{
+	uint64_t now = __now_us();
+	uint32_t acked = 0, nacked = 0;
+	uint32_t lat[RABBITMQ_CONFIRM_BUCKETS] = {0};
+
+	while (first_tag < next_tag) {
+		inflight_t* f = &window[first_tag % RABBITMQ_CONFIRM_WINDOW];
+		if (f->state == PENDING) break;
+		if (f->state == NACKED) {
+			nacked++;
+			spool_rewind(&spool);
+			first_tag = next_tag; // the confirms still to come are for messages sent again
+			break;
+		}
+		spool_ack(&spool, f->seq);
+		lat[__bucket(now - f->sent)]++;
+		acked++;
+		first_tag++;
+	}
+	if (!acked && !nacked) return;
+
+	pthread_mutex_lock(&stats_lock);
+	stats.confirmed += acked;
+	stats.nacked += nacked;
+	for (uint8_t b = 0; b < RABBITMQ_CONFIRM_BUCKETS; b++) stats.confirm_hist[b] += lat[b];
+	pthread_mutex_unlock(&stats_lock);
+}
+
+/**
+ *  @brief Take the acks and nacks of the broker off the socket
+ *  @param timeout_ms how long to wait for the first frame, 0 for the ones already there
+ *  @return 0 if the connection is lost
+ */
+static uint8_t __read_confirms(int timeout_ms)
+{
+	struct timeval tv = {timeout_ms / 1000, (timeout_ms % 1000) * 1000};
+	amqp_frame_t frame;
+	int status;
+
+	while ((status = amqp_simple_wait_frame_noblock(conn[current_connection], &frame, &tv)) == AMQP_STATUS_OK) {
+		tv.tv_sec = tv.tv_usec = 0; // then only what is already there
+		if (frame.frame_type != AMQP_FRAME_METHOD) continue;
+		switch (frame.payload.method.id) {
+			case AMQP_BASIC_ACK_METHOD: {
+				amqp_basic_ack_t* ack = (amqp_basic_ack_t*)frame.payload.method.decoded;
+				__confirm(ack->delivery_tag, ack->multiple, ACKED);
+				break;
+			}
+			case AMQP_BASIC_NACK_METHOD: {
+				amqp_basic_nack_t* nack = (amqp_basic_nack_t*)frame.payload.method.decoded;
+				__confirm(nack->delivery_tag, nack->multiple, NACKED);
+				break;
+			}
+			case AMQP_CHANNEL_CLOSE_METHOD:
+			case AMQP_CONNECTION_CLOSE_METHOD:
+				printf("AMQP: closed by the broker\n");
+				return 0;
+		}
+	}
+	if (status == AMQP_STATUS_HEARTBEAT_TIMEOUT) {
+		printf("AMQP: nothing from the broker for %d s, it is gone\n", 2 * heartbeat);
+		pthread_mutex_lock(&stats_lock);
+		stats.heartbeat_timeouts++;
+		pthread_mutex_unlock(&stats_lock);
+		return 0;
+	}
+	amqp_maybe_release_buffers(conn[current_connection]);
+	__settle();
+	return status == AMQP_STATUS_TIMEOUT;
+}
+
+/**
+ *  @brief Timer of the heartbeats while nothing is in flight. rabbitmq-c sends and checks them
+ *  only while it waits for a frame, so the socket is read every quarter of the heartbeat: ours
+ *  goes when due, a broker silent for two heartbeats (half-open connection) is noticed
+ *  @return 0 if the connection is lost
+ */
+static uint8_t __heartbeat(void)
+{
+	uint64_t now = __now_us();
+	if (!heartbeat || now < heartbeat_at) return 1;
+	heartbeat_at = now + heartbeat * 250000ull;
+	return __read_confirms(0);
+}
+
+/**
+ *  @brief Publish what the window takes, then wait a little for the confirms
+ *  @return 0 if the connection is lost, or a confirm is overdue
+ */
+static uint8_t __exchange(uint64_t* latency_sum, uint64_t* latency_max, uint32_t* latency_cnt)
+{
+	if (!__publish_spool(latency_sum, latency_max, latency_cnt)) return 0;
+	if (next_tag == first_tag) return __heartbeat();
+	if (!__read_confirms(CONFIRM_POLL)) return 0;
+	if (next_tag != first_tag &&
+		__now_us() - window[first_tag % RABBITMQ_CONFIRM_WINDOW].sent > RABBITMQ_CONFIRM_TIMEOUT * 1000ull) {
+		printf("AMQP: no confirm for %u ms\n", RABBITMQ_CONFIRM_TIMEOUT);
+		return 0;
+	}
+	return 1;
+}
+
+/**
+ *  @brief Whether a broker passes its health checks, the health thread writes it
+ */
+static uint8_t __healthy(int id)
+{
+	pthread_mutex_lock(&stats_lock);
+	uint8_t healthy = brokers[id].healthy;
+	pthread_mutex_unlock(&stats_lock);
+	return healthy;
+}
+
+/**
+ *  @brief Healthy broker with the best score (lowest connect time), the first one on a tie
+ *  @return its index, -1 if none
+ */
+static int __best(void)
+{
+	int best = -1;
+	pthread_mutex_lock(&stats_lock);
+	for (int i = 0; i < broker_cnt; i++)
+		if (brokers[i].healthy && (best < 0 || brokers[i].rtt < brokers[best].rtt)) best = i;
+	pthread_mutex_unlock(&stats_lock);
+	return best;
+}
+
+/**
+ *  @brief Check every broker in turn with a TCP connect, its time is the score
+ */
+static void* __health_thread(void* arg)
+{
+	while (1) {
+		for (int i = 0; i < broker_cnt; i++) {
+			struct timeval tv = {RABBITMQ_HEALTH_TIMEOUT / 1000, (RABBITMQ_HEALTH_TIMEOUT % 1000) * 1000};
+			uint64_t start = __now_us();
+			int fd = amqp_open_socket_noblock(brokers[i].host, brokers[i].port, &tv);
+			uint32_t rtt = __now_us() - start;
+			if (fd >= 0) amqp_os_socket_close(fd);
+
+			pthread_mutex_lock(&stats_lock);
+			rabbitmq_broker_t* b = &brokers[i];
+			b->checks++;
+			if (fd >= 0) {
+				fails_in_row[i] = 0;
+				b->rtt = b->rtt ? (3 * b->rtt + rtt) / 4 : rtt;
+				b->healthy = 1;
+			} else {
+				b->check_failures++;
+				if (++fails_in_row[i] >= HEALTH_FAILS) b->healthy = 0;
+			}
+			pthread_mutex_unlock(&stats_lock);
+		}
+		usleep(RABBITMQ_HEALTH_INTERVAL * 1000);
+	}
+	return NULL;
+}
+
+/**
+ *  @brief Make a broker the active one, tell the switch handler
+ *  @param id the broker, connected
+ *  @param down_since us, when the previous one was left
+ */
+static void __activate(int id, uint64_t down_since)
+{
+	int from = current_connection;
+	rabbitmq_broker_t b_from, b_to;
+
+	current_connection = id;
+	pthread_mutex_lock(&stats_lock);
+	brokers[from].active = 0;
+	brokers[id].active = 1;
+	if (id != from) {
+		brokers[id].activations++;
+		stats.switches++;
+		stats.switch_time = (__now_us() - down_since) / 1000;
+	}
+	b_from = brokers[from];
+	b_to = brokers[id];
+	uint32_t took = stats.switch_time;
+	pthread_mutex_unlock(&stats_lock);
+	if (id == from) return;
+
+	printf("AMQP: switched from %s:%d to %s:%d in %u ms\n", b_from.host, b_from.port, b_to.host, b_to.port, took);
+	fflush(stdout);
+	if (switch_handler != NULL) switch_handler(&b_from, &b_to);
+}
+
+/**
+ *  @brief Owner of the connection: journals the messages of the queue in the spool, then
+ *  publishes them in order. While the broker is away they wait in the spool, not in the queue
+ */
+static void* __publisher_thread(void* arg)
+{
+	uint64_t latency_sum[RABBITMQ_LANES] = {0}, latency_max[RABBITMQ_LANES] = {0};
+	uint64_t log_time = __now_us(), retry_at = 0, down_since = __now_us();
+	uint32_t latency_cnt[RABBITMQ_LANES] = {0}, dropped, backoff = RABBITMQ_BACKOFF_MIN, connect_start = 0;
+	uint8_t tries = 0;
+	unsigned int seed = (unsigned int)down_since ^ (unsigned int)getpid();
+	int next = current_connection;
+
+	while (1) {
+		uint64_t now = __now_us();
+		int state = atomic_load(&link_state);
+		uint32_t wait = 1000;
+		if (state == LINK_DOWN) wait = retry_at > now ? (retry_at - now + 999) / 1000 : 0;
+		else if (state == LINK_UP && next_tag != first_tag) wait = 0; // waiting for confirms on the socket instead, or a batch
+		else if (state == LINK_UP && heartbeat && heartbeat_at < now + 1000000) // the heartbeat timer is due first
+			wait = heartbeat_at > now ? (heartbeat_at - now + 999) / 1000 : 0;
+		else if (state == LINK_READY || state == LINK_FAILED) wait = 0;
+		if (msg_queue_wait(&queue, wait)) __spool_queue(); // the connector thread wakes us up too
+		spool_commit(&spool);
 
+		now = __now_us();
+		state = atomic_load(&link_state);
+		switch (state) {
+			case LINK_UP:
+				if (!__healthy(current_connection) && __best() >= 0) {
+					printf("AMQP: %s fails its health checks, leaving it\n", brokers[current_connection].host);
+				} else if (!__exchange(latency_sum, latency_max, latency_cnt)) {
+					pthread_mutex_lock(&stats_lock);
+					stats.reconnects++;
+					brokers[current_connection].failures++;
+					pthread_mutex_unlock(&stats_lock);
+				} else {
+					break;
+				}
+				amqp_destroy_connection(conn[current_connection]);
+				conn[current_connection] = NULL;
+				atomic_store(&link_state, LINK_DOWN);
+				down_since = retry_at = now; // first try at once
+				tries = 0;
+				backoff = RABBITMQ_BACKOFF_MIN;
+				break;
+
+			case LINK_DOWN: {
+				if (now < retry_at) break;
+				int best = __best();
+				if (best >= 0) next = best;
+				connect_id = next;
+				connect_start = now / 1000;
+				atomic_store(&link_state, LINK_CONNECTING);
+				sem_post(&connect_request);
+				break;
+			}
+
+			case LINK_CONNECTING:
+				break;
+
+			case LINK_READY:
+				first_tag = next_tag = 1; // new channel
+				batch_tag = 1;
+				hold_since = 0;
+				heartbeat = amqp_get_heartbeat(conn[next]);
+				heartbeat_at = now;
+				pthread_mutex_lock(&stats_lock);
+				stats.heartbeat = heartbeat;
+				brokers[next].healthy = 1; // the connect is a check passed, with one broker there is no health thread
+				pthread_mutex_unlock(&stats_lock);
+				spool_rewind(&spool); // everything not confirmed goes again
+				__activate(next, down_since);
+				atomic_store(&link_state, LINK_UP);
+				printf("CONNECTION RECOVERED! %u messages spooled, connected in %llu ms\n", spool_pending(&spool),
+					   (unsigned long long)(now / 1000 - connect_start));
+				fflush(stdout);
+				break;
+
+			case LINK_FAILED:
+				pthread_mutex_lock(&stats_lock);
+				brokers[next].healthy = 0; // until its next check passes, or it connects
+				stats.connect_failures++;
+				pthread_mutex_unlock(&stats_lock);
+				next = (next + 1) % broker_cnt; // if none is healthy: every one in turn
+				retry_at = now;
+				if (++tries % broker_cnt == 0) { // the whole pool failed: back off, jittered so gates do not all come back at once
+					retry_at += (backoff / 2 + rand_r(&seed) % (backoff / 2 + 1)) * 1000ull;
+					backoff = backoff * 2 > RABBITMQ_BACKOFF_MAX ? RABBITMQ_BACKOFF_MAX : backoff * 2;
+				}
+				atomic_store(&link_state, LINK_DOWN);
+				break;
+		}
+		spool_commit(&spool);
+
+		pthread_mutex_lock(&stats_lock);
+		stats.spooled = spool_pending(&spool);
+		stats.spool_dropped = spool.dropped;
+		stats.in_flight = next_tag - first_tag;
+		pthread_mutex_unlock(&stats_lock);
+
+		now = __now_us();
+		if (now - log_time < RABBITMQ_STATS_INTERVAL * 1000ull) continue;
+		uint64_t sum = 0, max = 0;
+		uint32_t cnt = 0;
+		for (uint8_t l = 0; l < RABBITMQ_LANES; l++) {
+			sum += latency_sum[l];
+			cnt += latency_cnt[l];
+			if (latency_max[l] > max) max = latency_max[l];
+		}
+		if (!cnt) continue;
+		msg_queue_stats(&queue, NULL, &dropped, NULL, NULL);
+		pthread_mutex_lock(&stats_lock);
+		stats.latency_avg = sum / cnt;
+		stats.latency_max = max;
+		for (uint8_t l = 0; l < RABBITMQ_LANES; l++) {
+			stats.lane_latency_avg[l] = latency_cnt[l] ? latency_sum[l] / latency_cnt[l] : 0;
+			stats.lane_latency_max[l] = latency_max[l];
+		}
+		stats.hold_avg = hold_cnt ? hold_sum / hold_cnt : 0;
+		stats.hold_max = hold_max;
+		printf("AMQP: %u published, depth max %u, %u dropped, %u spooled, %u lost from the spool, latency avg %llu us, max %llu us\n",
+			   stats.published, stats.depth_max, dropped, stats.spooled, stats.spool_dropped,
+			   (unsigned long long)stats.latency_avg, (unsigned long long)stats.latency_max);
+		for (uint8_t l = 0; l < RABBITMQ_LANES; l++) {
+			uint32_t lane_dropped;
+			msg_queue_lane_stats(&queue, l, NULL, &lane_dropped, NULL);
+			printf("AMQP: lane %s, %u dropped, latency avg %llu us, max %llu us over %u messages\n", lane_names[l],
+				   lane_dropped, (unsigned long long)stats.lane_latency_avg[l], (unsigned long long)stats.lane_latency_max[l], latency_cnt[l]);
+		}
+		printf("AMQP: %u writes, %.1f messages/write, held back for a batch avg %llu us, max %llu us\n",
+			   stats.writes, stats.writes ? (double)stats.published / stats.writes : 0.0,
+			   (unsigned long long)stats.hold_avg, (unsigned long long)stats.hold_max);
+		printf("AMQP: heartbeat %u s, %u brokers gone silent, %u reconnects\n",
+			   stats.heartbeat, stats.heartbeat_timeouts, stats.reconnects);
+		for (int i = 0; use_tls && i < broker_cnt; i++) {
+			uint32_t handshakes, resumed;
+			uint64_t full_avg, resumed_avg;
+			tls_stats(&tls[i], &handshakes, &resumed, &full_avg, &resumed_avg);
+			printf("AMQP: TLS to %s:%d, %u handshakes, %u resumed, connect avg %llu us full, %llu us resumed\n",
+				   brokers[i].host, brokers[i].port, handshakes, resumed,
+				   (unsigned long long)full_avg, (unsigned long long)resumed_avg);
+		}
+		for (int i = 0; i < broker_cnt; i++)
+			printf("AMQP: broker %s:%d %s%s, connect %u us, %u/%u checks failed, %u activations, %u failures\n",
+				   brokers[i].host, brokers[i].port, brokers[i].healthy ? "up" : "down", brokers[i].active ? ", active" : "",
+				   brokers[i].rtt, brokers[i].check_failures, brokers[i].checks, brokers[i].activations, brokers[i].failures);
+		printf("AMQP: %u confirmed, %u nacked, confirm latency (ms)", stats.confirmed, stats.nacked);
+		for (uint8_t b = 0; b < RABBITMQ_CONFIRM_BUCKETS; b++)
+			printf(" %s%u:%u", b == RABBITMQ_CONFIRM_BUCKETS - 1 ? ">=" : "<", b == RABBITMQ_CONFIRM_BUCKETS - 1 ? 1u << (b - 1) : 1u << b, stats.confirm_hist[b]);
+		printf("\n");
+		pthread_mutex_unlock(&stats_lock);
+		if (stats_handler != NULL) stats_handler();
+		fflush(stdout);
+		memset(latency_sum, 0, sizeof(latency_sum));
+		memset(latency_max, 0, sizeof(latency_max));
+		memset(latency_cnt, 0, sizeof(latency_cnt));
+		hold_sum = hold_max = 0;
+		hold_cnt = 0;
+		log_time = now;
+	}
+	return NULL;
+}
+
+int rabbitmq_init() {
 	props._flags = AMQP_BASIC_CONTENT_TYPE_FLAG | AMQP_BASIC_DELIVERY_MODE_FLAG;
 	props.content_type = amqp_cstring_bytes("text/plain");
 	props.delivery_mode = 2; /* persistent delivery mode */
-}
+	props_cbor = props;
+	props_cbor.content_type = amqp_cstring_bytes("application/cbor");
 
-int rabbitmq_init() {
-	for (int i = 0; i < CONNECTION_COUNT; ++i) {
-		rabbitmq_init_with_id(i);
+	msg_queue_init(&queue);
+	sem_init(&connect_request, 0, 0);
+	for (int i = 0; use_tls && i < broker_cnt; i++)
+		if (tls_init(&tls[i], tls_cacert, tls_verify))
+			printf("AMQP: no TLS context for %s, check %s\n", brokers[i].host, tls_cacert ? tls_cacert : "the system CA certificates");
+	int spooled = spool_open(&spool, SPOOL_PATH, SPOOL_SIZE);
+	if (spooled == -2) {
+		printf("AMQP: no spool, nothing is published\n");
+		fflush(stdout);
+		return -1;
 	}
+	if (spooled)
+		printf("AMQP: cannot open %s, messages are spooled in memory only\n", SPOOL_PATH);
+	else if (spool_pending(&spool))
+		printf("AMQP: %u messages left in %s, publishing them first\n", spool_pending(&spool), SPOOL_PATH);
+	pthread_create(&connector_thread_id, NULL, __connector_thread, NULL);
+	pthread_create(&publisher_thread_id, NULL, __publisher_thread, NULL); // connects the preferred broker first, never blocks the caller
+	if (broker_cnt > 1) pthread_create(&health_thread_id, NULL, __health_thread, NULL); // nowhere to switch to with one
 
 	return 0;
 }
 
-void send_message(char* message, char* exchange, char* routingkey) {
-	int status = amqp_basic_publish(conn[current_connection], 1, amqp_cstring_bytes(exchange),
-							  amqp_cstring_bytes(routingkey), 0, 0,
-							  &props, amqp_cstring_bytes(message));
+/**
+ *  @brief Queue a message for the publisher thread, from any thread. Never waits on the network
+ *  @param message formatted message
+ *  @param len its length, 0 is ignored (did not fit, see format_message())
+ *  @param exchange exchange name
+ *  @param routingkey routing key
+ *  @param lane RABBITMQ_LANE_TAG, RABBITMQ_LANE_EVENT or RABBITMQ_LANE_STATE
+ */
+void send_message(const char* message, size_t len, char* exchange, char* routingkey, uint8_t lane) {
+	if (len == 0) return;
+	uint32_t dropped, oversize;
+	switch (msg_queue_put(&queue, lane, exchange, routingkey, message, len, __now_us())) {
+		case MSG_QUEUE_FULL:
+			msg_queue_lane_stats(&queue, lane, NULL, &dropped, NULL);
+			if (dropped && (dropped & (dropped - 1)) == 0) printf("AMQP: lane %s full, %u messages dropped\n", lane_names[lane], dropped); // 1, 2, 4, 8...
+			break;
+		case MSG_QUEUE_OVERSIZE:
+			msg_queue_stats(&queue, NULL, NULL, &oversize, NULL);
+			if (oversize && (oversize & (oversize - 1)) == 0) printf("AMQP: message too long or no lane %u (%s), %u dropped\n", lane, routingkey, oversize);
+			break;
+	}
+}
+
+/**
+ *  @brief Publisher counters, see rabbitmq_stats_t
+ */
+void rabbitmq_stats(rabbitmq_stats_t* out)
+{
+	uint32_t put, dropped, oversize;
+	msg_queue_stats(&queue, &put, &dropped, &oversize, NULL);
+	pthread_mutex_lock(&stats_lock);
+	*out = stats;
+	pthread_mutex_unlock(&stats_lock);
+	out->queued = put;
+	out->dropped = dropped + oversize;
+	for (uint8_t l = 0; l < RABBITMQ_LANES; l++) msg_queue_lane_stats(&queue, l, NULL, &out->lane_dropped[l], NULL);
 
-	if (status != AMQP_STATUS_OK) {
-		rabbitmq_init_with_id(current_connection);
-		current_connection = (current_connection + 1)%CONNECTION_COUNT;
-		send_message(message, exchange, routingkey);
-		printf("CONNECTION RECOVERED!\n");
+	uint64_t full_sum = 0, resumed_sum = 0;
+	out->tls_handshakes = out->tls_resumed = 0;
+	for (int i = 0; use_tls && i < broker_cnt; i++) {
+		uint32_t handshakes, resumed;
+		uint64_t full_avg, resumed_avg;
+		tls_stats(&tls[i], &handshakes, &resumed, &full_avg, &resumed_avg);
+		out->tls_handshakes += handshakes;
+		out->tls_resumed += resumed;
+		full_sum += full_avg * (handshakes - resumed);
+		resumed_sum += resumed_avg * resumed;
 	}
+	uint32_t full = out->tls_handshakes - out->tls_resumed;
+	out->tls_full_avg = full ? full_sum / full : 0;
+	out->tls_resumed_avg = out->tls_resumed ? resumed_sum / out->tls_resumed : 0;
+}
+
+/**
+ *  @brief State and counters of every broker of the pool
+ *  @return brokers copied to out
+ */
+uint8_t rabbitmq_brokers(rabbitmq_broker_t* out, uint8_t max)
+{
+	uint8_t cnt = broker_cnt < max ? broker_cnt : max;
+	pthread_mutex_lock(&stats_lock);
+	memcpy(out, brokers, cnt * sizeof(*out));
+	pthread_mutex_unlock(&stats_lock);
+	return cnt;
 }
 
 void close_connection() {
@@ -9,6 +9,8 @@
 #include <wiringPi.h>
 
 #include <rabbitmq.h>
+#include <encode.h>
+#include <tag.h>
 #include <sensor_reader.h>
 
 #define max(a,b) (a>b ? a : b)
@@ -51,21 +53,10 @@ void* timeout_handler(void *id_ptr) {
     uint8_t id = (uint8_t)(*(uint8_t*)id_ptr);
 
 	if (check_parity(id) && wds[id].bit_cnt == WIEGAND_VALID_BIT_CNT) {
-		printf("RFID %d: 0x%06X\n", id, wds[id].tag_id);
-        fflush(stdout);
-
-        char rfid_src[10];
-        snprintf(rfid_src, 10, "rfid.%d", id);
-        char routing_key[20];
-        snprintf(routing_key, 20, "%s.%s", ROUTING_KEY_PREFIX, rfid_src);
-        char data[20];
-        snprintf(data, 20, "tag_id:0x%06X", wds[id].tag_id);
-
-        #if en_rabbitmq
-            char* formatted_message = format_message(get_current_time(), "rfid", rfid_src, data, OTHER_SENSOR_ID);
-            send_message(formatted_message, EXCHANGE_NAME, routing_key);
-            if (formatted_message != NULL) free(formatted_message);
-        #endif
+        uint8_t tag_id[3] = {wds[id].tag_id >> 16, wds[id].tag_id >> 8, wds[id].tag_id}; // 24 bits
+        tag_event_t ev;
+        tag_event_init(&ev, TAG_WIEGAND, id, tag_id, sizeof(tag_id), get_current_time());
+        tag_submit(&ev);
 	} else {
         printf("RFID %d: CHECKSUM FAILED (%X, %d bits)\n", id, wds[id].tag_id, wds[id].bit_cnt);
     }
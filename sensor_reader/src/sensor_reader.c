@@ -23,9 +23,16 @@
 #include <wiringPi.h>
 
 #include <rabbitmq.h>
+#include <encode.h>
 #include <pir.h>
 #include <rfid.h>
 #include <uhf.h>
+#include <uhf_track.h>
+#include <uhf_tune.h>
+#include <uhf_mem.h>
+#include <uhf_filter.h>
+#include <cfuhf.h>
+#include <tag.h>
 #include <sensor_reader.h>
 #include <CFHidApi.h>
 
@@ -34,15 +41,32 @@ pthread_t camera_thread_id;
 // --- PIR
 
 // --- UHF
-pthread_t uhf_thread_id;
+typedef struct {
+	uhf_reader_t* reader;
+	uint8_t id;
+	uhf_tune_t tune;
+	uhf_filter_t filter;
+	volatile uint64_t active_until; //rounds run back to back until then
+} uhf_lane_t;
+
+pthread_t uhf_thread_id[UHF_READER_CNT];
+uhf_lane_t uhf_lanes[UHF_READER_CNT];
+uhf_filter_t cfuhf_filter;
 // --- Keep track of time
 uint64_t now;
 
 // ------ Private function prototypes -------------------------
 void* img_erase_thread(void*);
 void* uhf_thread(void*);
+void uhf_next_round(uhf_lane_t*);
+void uhf_mem_service(uhf_lane_t*);
 void camera_init(void);
-void uhf_read_handler(char*);
+void cfuhf_tag_handler(const tag_slot_t*);
+void cfuhf_state_handler(const cfuhf_stats_t*);
+void uhf_tag_handler(uint8_t, const uhf_tag_t*, uint64_t);
+void uhf_pass_handler(const uhf_pass_t*);
+void tag_enrich(tag_event_t*);
+void uhf_filter_setup(uhf_filter_t*);
 //--------------------------------------------------------------
 // FUNCTION DEFINITIONS
 //--------------------------------------------------------------
@@ -60,28 +84,51 @@ void* img_erase_thread(void* arg)
 }
 
 /**
- *  @brief UHF always-on thread to catch RS232 signal
+ *  @brief UHF always-on thread to catch RS232 signal, one thread per reader
  *  @note: This function will be replaced when wiegand26 protocol is applied for UHF reader
- *  @param arg void argument for the thread to be created
+ *  @param arg the uhf_lane_t of the reader
  *  @return void*
  */
 void* uhf_thread(void* arg) {
-	while(1) {
-		char* data = uhf_read_rt_inventory();
+	uhf_lane_t* lane = (uhf_lane_t*)arg;
 
-		usleep(UHF_DELAY);
+	#if en_uhf_track
+	uhf_tag_t tag;
 
-		if (data == NULL) continue;
-		
-		if (!(data[0] == 'E' && data[1] == 'R' &&
-			data[2] == 'R' && data[3] == '\0')) {
-			uhf_read_handler(data);
+	while(1) {
+		if (!uhf_read_rt_inventory_tag(lane->reader, &tag)) {
+			uhf_track_add(&tag, lane->id, get_current_time());
+			#if en_uhf_tune
+			uhf_tune_tag(&lane->tune, &tag);
+			#endif
+			#if en_uhf_mem
+			uhf_mem_touch(tag.epc, tag.epc_len, lane->id, get_current_time());
+			#endif
 		}
+		#if en_uhf_mem
+		uhf_read_t read;
+		if (uhf_get_read(lane->reader, &read)) uhf_mem_complete(lane->id, &read);
+		#endif
+		uhf_track_tick(get_current_time());
+		#if en_uhf_tune
+		uhf_next_round(lane);
+		#endif
+	}
+	#else
+	uhf_tag_t tag;
+
+	while(1) {
+		if (!uhf_read_rt_inventory_tag(lane->reader, &tag))
+			uhf_tag_handler(lane->id, &tag, get_current_time());
+		#if en_uhf_tune
+		uhf_next_round(lane);
+		#endif
 	}
-	// uhf_read_tag();
+	#endif
+	// char data[UHF_EPC_MAX_LEN*2 + 1];
 	// while(1) {
-	// 	char* data = uhf_read_tag();
-	// 	uhf_read_handler(data);
+	// 	if (!uhf_read_tag(lane->reader, data, sizeof(data)))
+	// 		uhf_read_handler(lane->id, data, get_current_time());
 	// }
 }
 
@@ -100,64 +147,275 @@ void camera_init(void)
 }
 
 /**
- *  @brief ISR handler for UHF RFID reader - RS232
- *  @param read_data data that the reader return
+ *  @brief Every read of a RS232 reader, when the tracker is off
+ *  @param id source index of the reader
+ *  @param tag the tag report
+ *  @param read_time ms, when the tag was read
  */
-void uhf_read_handler(char* read_data)
+void uhf_tag_handler(uint8_t id, const uhf_tag_t* tag, uint64_t read_time)
 {
-	char* uhf_src = "rfid.3";
-	char routing_key[20];
-	snprintf(routing_key, 20, "%s.%s", ROUTING_KEY_PREFIX, uhf_src);
-	char data[150];
-	snprintf(data, 150, "tag_id:0x%s", read_data);
+	tag_event_t ev;
+	tag_event_init(&ev, TAG_UHF_RS232, id, tag->epc, tag->epc_len, read_time);
+	tag_submit(&ev);
+}
 
-	// if (read_data != NULL) free(read_data);
+/**
+ *  @brief Pass handler for the UHF tracker, one event per tag passing the gate
+ *  @param pass the tag which has just left the field
+ */
+void uhf_pass_handler(const uhf_pass_t* pass)
+{
+	tag_event_t ev;
+	tag_event_init(&ev, TAG_UHF_RS232, pass->source, pass->epc, pass->epc_len, pass->peak_time);
+	ev.flags = TAG_HAS_PASS | TAG_HAS_RSSI;
+	ev.dir = uhf_track_dir_str(pass->direction);
+	ev.rssi = UHF_RSSI_TO_DBM(pass->peak_rssi);
+	ev.ant = pass->peak_ant;
+	ev.reads = pass->reads;
+	ev.dwell = pass->last_seen - pass->first_seen;
+	tag_submit(&ev);
+}
 
-	#if en_rabbitmq
-		now = get_current_time();
-		char* formatted_message = format_message(get_current_time(), "rfid", uhf_src, data, OTHER_SENSOR_ID);
-		send_message(formatted_message, EXCHANGE_NAME, routing_key);
-		// if (formatted_message != NULL) free(formatted_message);
+/**
+ *  @brief Add what is known of a UHF tag to its event: the membank data cached by uhf_mem.c
+ *  @param ev the event, about to be published
+ */
+void tag_enrich(tag_event_t* ev)
+{
+	#if en_uhf_mem
+	if (ev->kind == TAG_WIEGAND) return;
+	if (!uhf_mem_get(&ev->key, ev->mem, &ev->mem_len)) ev->flags |= TAG_HAS_MEM;
 	#endif
 }
 
+/**
+ *  @brief Feed the end of the last round to the tuner and start the next one while active
+ *  @param lane the reader, called from its own thread
+ */
+void uhf_next_round(uhf_lane_t* lane)
+{
+	uhf_round_t round;
+	uint8_t session, target, repeat;
+	uint64_t t = get_current_time();
+
+	if (uhf_get_round(lane->reader, &round))
+		uhf_tune_round_end(&lane->tune, &round, t);
+	if (t < lane->active_until && uhf_tune_command(&lane->tune, t, &session, &target, &repeat)) {
+		uhf_mem_service(lane);
+		uhf_session_inventory(lane->reader, session, target, repeat);
+	}
+}
+
+/**
+ *  @brief Send the next pending membank read of a reader, ahead of its next inventory round
+ *  @param lane the reader
+ */
+void uhf_mem_service(uhf_lane_t* lane)
+{
+	#if en_uhf_mem
+	uint8_t epc[UHF_EPC_MAX_LEN], epc_len;
+	if (uhf_mem_next(lane->id, get_current_time(), epc, &epc_len))
+		uhf_request_read(lane->reader, epc, epc_len);
+	#endif
+}
+
+/**
+ *  @brief Start a real-time inventory round on every RS232 reader, and on the USB reader in poll mode
+ *  @note: with en_uhf_tune the readers keep running tuned rounds for UHF_TUNE_ACTIVE_TIME
+ */
+void uhf_inventory_all(void)
+{
+	#if en_uhf_usb
+	cfuhf_trigger();
+	#endif
+
+	for (int i = 0; i < UHF_READER_CNT; ++i) {
+		if (uhf_lanes[i].reader == NULL) continue;
+		#if en_uhf_tune
+		uhf_lanes[i].active_until = get_current_time() + UHF_TUNE_ACTIVE_TIME;
+		#else
+		uhf_mem_service(&uhf_lanes[i]);
+		uhf_realtime_inventory(uhf_lanes[i].reader);
+		#endif
+	}
+}
+
+/**
+ *  @brief Load the EPC rules of UHF_EPC_FILTERS into a filter
+ */
+void uhf_filter_setup(uhf_filter_t* filter)
+{
+	#if UHF_EPC_FILTER_CNT
+	const char* rules[UHF_EPC_FILTER_CNT] = UHF_EPC_FILTERS;
+	#endif
+
+	uhf_filter_init(filter);
+	for (int i = 0; i < UHF_EPC_FILTER_CNT; ++i)
+		if (uhf_filter_add(filter, rules[i]) < 0) printf("UHF filter: invalid rule %s\n", rules[i]);
+}
+
 void setup_old_uhf()
 {
-	uhf_set_param(EPC_MEMBANK, 0x01, 7);
-	uhf_init(UHF_PORT, UHF_BAUDRATE, OE_PIN);
-	pthread_create(&uhf_thread_id, NULL, uhf_thread, NULL);
+	const char* ports[UHF_READER_CNT] = UHF_PORTS;
+	const serial_opts_t opts = UHF_SERIAL_OPTS;
+
+	#if en_uhf_track
+		uhf_track_init(UHF_TRACK_LEAVE_TIMEOUT, uhf_pass_handler);
+	#endif
+	#if en_uhf_mem
+		uhf_mem_init();
+	#endif
+	for (int i = 0; i < UHF_READER_CNT; ++i) {
+		uhf_lanes[i].id = MAIN_UHF + i;
+		uhf_lanes[i].reader = uhf_open(ports[i], UHF_BAUDRATE, OE_PIN, &opts);
+		if (uhf_lanes[i].reader == NULL) {
+			printf("UHF reader %s not available\n", ports[i]);
+			continue;
+		}
+		uhf_set_rx_timeout(uhf_lanes[i].reader, UHF_RX_TIMEOUT);
+		uhf_set_param(uhf_lanes[i].reader, UHF_MEM_BANK, UHF_MEM_WORD_ADD, UHF_MEM_WORD_CNT);
+		uhf_tune_init(&uhf_lanes[i].tune, uhf_lanes[i].id);
+		uhf_filter_setup(&uhf_lanes[i].filter);
+		uhf_set_filter(uhf_lanes[i].reader, &uhf_lanes[i].filter);
+		pthread_create(&uhf_thread_id[i], NULL, uhf_thread, &uhf_lanes[i]);
+	}
+}
+
+/**
+ *  @brief Decode and publish one tag of the USB reader
+ *  @param slot the raw report: [len, x, x, EPC]
+ */
+void cfuhf_tag_handler(const tag_slot_t* slot)
+{
+	int useless_data = 3;
+	int epc_len = slot->data[0] - useless_data;
+	if (epc_len < 0 || epc_len > UHF_EPC_MAX_LEN || useless_data + epc_len > slot->len) return;
+	if (!uhf_filter_match(&cfuhf_filter, slot->data + useless_data, epc_len)) return; // foreign tag
+
+	tag_event_t ev;
+	tag_event_init(&ev, TAG_UHF_USB, slot->source, slot->data + useless_data, epc_len, slot->time);
+	tag_submit(&ev);
+}
+
+/**
+ *  @brief Log and publish the state of the USB reader, with its blind time
+ *  @param stats connection statistics, see cfuhf.h
+ */
+void cfuhf_state_handler(const cfuhf_stats_t* stats)
+{
+	char uhf_src[10];
+	format_source(uhf_src, sizeof(uhf_src), "rfid", stats->source);
+	char routing_key[20];
+	encode_buf_t k;
+	encode_init(&k, routing_key, sizeof(routing_key));
+	encode_str(&k, STATUS_ROUTING_KEY_PREFIX);
+	encode_char(&k, '.');
+	encode_str(&k, uhf_src);
+	char data[150];
+	encode_buf_t b;
+	encode_init(&b, data, sizeof(data));
+	encode_str(&b, "reader:usb,sn:");
+	encode_hex(&b, stats->sn, CFUHF_SN_LEN);
+	encode_str(&b, ",state:");
+	encode_str(&b, stats->connected ? "up" : "down");
+	encode_str(&b, ",recoveries:");
+	encode_u64(&b, stats->recoveries);
+	encode_str(&b, ",blind_ms:");
+	encode_u64(&b, stats->blind_last);
+	encode_str(&b, ",blind_max_ms:");
+	encode_u64(&b, stats->blind_max);
+	encode_str(&b, ",open_failures:");
+	encode_u64(&b, stats->open_failures);
+
+	printf("UHF USB status: %s\n", data);
+	fflush(stdout);
+
+	#if en_rabbitmq
+		char message[MESSAGE_MAX_LEN];
+		size_t len = format_message(message, sizeof(message), get_current_time(), "status", uhf_src, data, OTHER_SENSOR_ID);
+		send_message(message, len, EXCHANGE_NAME, routing_key, RABBITMQ_LANE_EVENT);
+	#endif
 }
 
-void cfuhf_callback(int msg, int tag_num, unsigned char *tag_data, int tag_data_len,unsigned char *devsn)
+#if en_rabbitmq
+/**
+ *  @brief Log and publish a switch of broker, on the new one
+ *  @param from broker left
+ *  @param to broker publishing from now on
+ */
+void rabbitmq_switch_handler(const rabbitmq_broker_t* from, const rabbitmq_broker_t* to)
 {
-	if (msg == 0) printf("New device inserted\n");
-	else if (msg == 1) printf("Device disconnected\n");
-	else
-	{
-		int useless_data = 3;
-		int epc_len = tag_data[0];
-		char* tag = (char*)malloc(sizeof(char) * (epc_len*2 + 1));
-		int i = 0;
-		for (; i < tag_data[0]-useless_data; ++i)
-			sprintf(tag+i*2, "%02X", tag_data[i+useless_data]);
-		tag[i*2] = '\0';
+	rabbitmq_stats_t stats;
+	rabbitmq_stats(&stats);
+	char routing_key[20];
+	encode_buf_t k;
+	encode_init(&k, routing_key, sizeof(routing_key));
+	encode_str(&k, STATUS_ROUTING_KEY_PREFIX);
+	encode_str(&k, ".amqp");
+	char data[200];
+	encode_buf_t b;
+	encode_init(&b, data, sizeof(data));
+	encode_str(&b, "broker:");
+	encode_str(&b, to->host);
+	encode_str(&b, ",from:");
+	encode_str(&b, from->host);
+	encode_str(&b, ",switch_ms:");
+	encode_u64(&b, stats.switch_time);
+	encode_str(&b, ",switches:");
+	encode_u64(&b, stats.switches);
+	encode_str(&b, ",connect_us:");
+	encode_u64(&b, to->rtt);
+
+	printf("AMQP status: %s\n", data);
+	fflush(stdout);
+
+	char message[MESSAGE_MAX_LEN];
+	size_t len = format_message(message, sizeof(message), get_current_time(), "status", "amqp", data, OTHER_SENSOR_ID);
+	send_message(message, len, EXCHANGE_NAME, routing_key, RABBITMQ_LANE_EVENT);
+}
 
-		printf("UHF EPC: %s\n", tag);
-		uhf_read_handler(tag);
+/**
+ *  @brief Log the counters of the sensor modules with the periodic AMQP log
+ */
+void rabbitmq_stats_handler(void)
+{
+	#if en_uhf_rs232 || en_uhf_usb
+	uint32_t accepted, rejected;
+	#endif
+	#if en_uhf_rs232
+	for (int i = 0; i < UHF_READER_CNT; ++i) {
+		if (uhf_lanes[i].reader == NULL) continue;
+		uhf_filter_stats(&uhf_lanes[i].filter, &accepted, &rejected);
+		printf("UHF %d filter: %u kept, %u dropped\n", uhf_lanes[i].id, accepted, rejected);
 	}
+	#elif en_uhf_usb
+	uhf_filter_stats(&cfuhf_filter, &accepted, &rejected);
+	printf("UHF USB filter: %u kept, %u dropped\n", accepted, rejected);
+	#endif
+	#if en_uhf_mem
+	uint32_t mem_hits, mem_misses;
+	uhf_mem_stats(&mem_hits, &mem_misses);
+	printf("UHF mem: %u hits, %u misses\n", mem_hits, mem_misses);
+	#endif
 }
+#endif
 
 #if en_uhf_usb
-void cfuhf_init()
+void cfuhf_setup()
 {
-	CFHid_OpenDevice();
-	CFHid_SetCallback(cfuhf_callback);
-	CFHid_StartRead(0xFF);
+	const cfuhf_opts_t opts = CFUHF_OPTS;
+	#if CFUHF_SERIAL_CNT
+	const char* serials[CFUHF_SERIAL_CNT] = CFUHF_SERIALS;
+	for (int i = 0; i < CFUHF_SERIAL_CNT; ++i)
+		if (cfuhf_add_device(serials[i]) != i) printf("UHF USB: invalid serial number %s\n", serials[i]);
+	#endif
+	uhf_filter_setup(&cfuhf_filter);
+	cfuhf_init(MAIN_UHF, &opts, cfuhf_tag_handler, cfuhf_state_handler);
 }
 
 void setup_new_uhf()
 {
-	cfuhf_init();
+	cfuhf_setup();
 }
 #endif
 
@@ -191,9 +449,18 @@ int main(int argc, char** argv) {
 
 	#if en_rabbitmq
 		printf("Init RabbitMQ...\n");
+		const char* brokers[HOST_CNT] = HOSTS;
+		for (int i = 0; i < HOST_CNT; ++i)
+			if (rabbitmq_add_broker(brokers[i], PORT) != i) printf("AMQP: invalid broker %s\n", brokers[i]);
 		rabbitmq_set_connection_params(HOST, USERNAME, PASSWORD, PORT);
+		#if AMQP_TLS
+			rabbitmq_set_tls(AMQP_CACERT, 1);
+		#endif
+		rabbitmq_on_switch(rabbitmq_switch_handler);
+		rabbitmq_on_stats(rabbitmq_stats_handler);
 		rabbitmq_init();
 	#endif
+	tag_init(TAG_DEDUP_WINDOW, tag_enrich);
 
 	#if en_pir
 		printf("Init PIRs...\n");
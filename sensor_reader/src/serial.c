@@ -0,0 +1,222 @@
+/** ------------------------------------------------------------*-
+ * Raw serial port - function file
+ * CheckinGate Project.
+ * (c) Minh-An Dao 2020
+ * version 1.00 - 19/10/2020
+ *--------------------------------------------------------------
+ * wiringSerial sends commands with serialPrintf(), which treats the
+ * binary command as a format string and stops at the first 0x00.
+ * Here everything goes through write()/read() on a raw port.
+ *
+ * - VMIN/VTIME: with VMIN > 1 and VTIME > 0 one read() collects a
+ *   whole burst of bytes instead of waking up for every byte.
+ * - ASYNC_LOW_LATENCY: the UART driver pushes received bytes to the
+ *   tty layer at once instead of on its flip timer. Ignored on ports
+ *   which do not support it (pseudo-terminals, some USB adapters).
+ *
+ * @ref https://man7.org/linux/man-pages/man3/termios.3.html
+ *      https://man7.org/linux/man-pages/man2/ioctl_tty.2.html
+ *
+ -------------------------------------------------------------- */
+#ifndef __SERIAL_C
+#define __SERIAL_C
+
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <linux/serial.h>
+
+#include <serial.h>
+
+// ------ Private types ---------------------------------------
+typedef struct {
+    uint32_t baudrate;
+    speed_t speed;
+} baud_t;
+
+// ------ Private variables -----------------------------------
+static const baud_t bauds[] = {
+    {9600, B9600}, {19200, B19200}, {38400, B38400}, {57600, B57600},
+    {115200, B115200}, {230400, B230400}, {460800, B460800}, {500000, B500000},
+    {576000, B576000}, {921600, B921600}, {1000000, B1000000}, {1152000, B1152000},
+    {1500000, B1500000}, {2000000, B2000000}, {2500000, B2500000},
+    {3000000, B3000000}, {3500000, B3500000}, {4000000, B4000000},
+};
+
+//--------------------------------------------------------------
+// FUNCTION DEFINITIONS
+//--------------------------------------------------------------
+/**
+ *  @brief Find the termios speed of a baud rate
+ *  @return the speed, B0 if the baud rate is not supported
+ */
+static speed_t __get_speed(uint32_t baudrate)
+{
+    for (size_t i = 0; i < sizeof(bauds)/sizeof(bauds[0]); i++)
+        if (bauds[i].baudrate == baudrate) return bauds[i].speed;
+    return B0;
+}
+
+/**
+ *  @brief Set or clear the low-latency flag of the UART driver
+ */
+static void __set_low_latency(int fd, uint8_t enable)
+{
+    struct serial_struct ss;
+
+    if (ioctl(fd, TIOCGSERIAL, &ss) < 0) return;
+    if (enable) ss.flags |= ASYNC_LOW_LATENCY;
+    else ss.flags &= ~ASYNC_LOW_LATENCY;
+    ioctl(fd, TIOCSSERIAL, &ss);
+}
+
+/**
+ *  @brief Configure an open port: raw 8N1, speed, VMIN/VTIME and low latency
+ *  @param fd the port
+ *  @param baudrate baudrate speed
+ *  @param opts tuning, NULL for SERIAL_DEFAULT_OPTS
+ *  @return 0 if succeed, -1 if failed
+ */
+int serial_set_opts(int fd, uint32_t baudrate, const serial_opts_t* opts)
+{
+    static const serial_opts_t default_opts = SERIAL_DEFAULT_OPTS;
+    struct termios options;
+    speed_t speed = __get_speed(baudrate);
+
+    if (opts == NULL) opts = &default_opts;
+    if (speed == B0) {
+        fprintf(stderr, "Unsupported baudrate: %u\n", baudrate);
+        errno = EINVAL;
+        return -1;
+    }
+    if (tcgetattr(fd, &options) < 0) return -1;
+
+    cfmakeraw(&options);
+    cfsetispeed(&options, speed);
+    cfsetospeed(&options, speed);
+    options.c_cflag |= (CLOCAL | CREAD);
+    options.c_cflag &= ~(PARENB | CSTOPB | CSIZE | CRTSCTS);
+    options.c_cflag |= CS8;
+    options.c_cc[VMIN] = opts->vmin;
+    options.c_cc[VTIME] = opts->vtime;
+
+    if (tcsetattr(fd, TCSANOW, &options) < 0) return -1;
+
+    __set_low_latency(fd, opts->low_latency);
+    return 0;
+}
+
+/**
+ *  @brief Open a serial port in raw mode
+ *  @param port device path, e.g. /dev/serial0
+ *  @param baudrate baudrate speed, 9600 up to 4000000
+ *  @param opts tuning, NULL for SERIAL_DEFAULT_OPTS
+ *  @return file descriptor, -1 if failed
+ */
+int serial_open(const char* port, uint32_t baudrate, const serial_opts_t* opts)
+{
+    int fd = open(port, O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (fd < 0) return -1;
+
+    if (serial_set_opts(fd, baudrate, opts) < 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    tcflush(fd, TCIOFLUSH);
+    return fd;
+}
+
+void serial_close(int fd)
+{
+    if (fd >= 0) close(fd);
+}
+
+/**
+ *  @brief Write the whole buffer, 0x00 bytes included
+ *  @return 0 if succeed, -1 if failed
+ */
+int serial_write(int fd, const void* buf, size_t len)
+{
+    const uint8_t* p = (const uint8_t*)buf;
+
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ *  @brief Wait until the port has data to read
+ *  @param timeout_ms maximum waiting time, -1 to wait forever
+ *  @return 1 if data is available, 0 on timeout, -1 if failed
+ */
+int serial_wait(int fd, int timeout_ms)
+{
+    struct pollfd pfd = {fd, POLLIN, 0};
+    int ret;
+
+    do ret = poll(&pfd, 1, timeout_ms);
+    while (ret < 0 && errno == EINTR);
+
+    if (ret > 0 && !(pfd.revents & POLLIN)) return -1; // hang up / error
+    return ret;
+}
+
+/**
+ *  @brief Read exactly len bytes unless the timeout expires first
+ *  @param timeout_ms maximum time waiting for the next chunk of data
+ *  @return number of bytes read, -1 if failed
+ */
+int serial_read(int fd, void* buf, size_t len, int timeout_ms)
+{
+    uint8_t* p = (uint8_t*)buf;
+    size_t got = 0;
+
+    while (got < len) {
+        int ret = serial_wait(fd, timeout_ms);
+        if (ret < 0) return -1;
+        if (ret == 0) break;
+
+        ssize_t n = read(fd, p + got, len - got);
+        if (n < 0) {
+            if (errno == EINTR || errno == EAGAIN) continue;
+            return -1;
+        }
+        if (n == 0) break;
+        got += n;
+    }
+    return (int)got;
+}
+
+/**
+ *  @brief Number of bytes waiting in the input queue
+ */
+int serial_available(int fd)
+{
+    int n;
+    if (ioctl(fd, FIONREAD, &n) < 0) return -1;
+    return n;
+}
+
+/**
+ *  @brief Drop everything not yet read or sent
+ */
+void serial_flush(int fd)
+{
+    tcflush(fd, TCIOFLUSH);
+}
+
+//--------------------------------------------------------------
+#endif //__SERIAL_C
@@ -0,0 +1,437 @@
+/** ------------------------------------------------------------*-
+ * Message spool - function file
+ * CheckinGate Project.
+ * (c) Minh-An Dao 2020
+ * version 1.00 - 19/10/2020
+ *--------------------------------------------------------------
+ * A broker outage used to either hang the publishing thread or lose
+ * the events. Every message now goes through this journal first:
+ *
+ * - Append: the record (sequence number, CRC32, exchange, routing key,
+ *   body) is copied into a ring in a memory-mapped file. When the ring
+ *   is full the oldest records are dropped and counted, the sensors
+ *   never wait for the broker. The header is moved past them and put
+ *   on disk before their bytes are overwritten: the file may be
+ *   written back at any time, and a header pointing to a torn record
+ *   would lose the whole backlog. To keep that to one msync() now and
+ *   then, DROP_SLACK more bytes are freed each time.
+ * - Commit: the records written since the last commit are flushed with
+ *   one msync() (group commit: one per batch taken from the queue, not
+ *   one per message), then the header.
+ * - Next/Ack: the publisher reads the records of each lane in order,
+ *   the lane it wants first, and acks them once the broker has them.
+ *   Acks may thus come out of order: they are kept in a bitmap, and
+ *   records are trimmed once every older one is acked too. Rewind
+ *   goes back to the oldest record not acked, to replay after a
+ *   reconnect; acked records are not given out again.
+ *
+ * The file starts with two copies of the header (oldest record,
+ * generation, CRC), written in turn so a crash in the middle of one
+ * leaves the other. The end of the journal is not stored: at start up
+ * the records are walked from the oldest one while their CRC is good
+ * and their sequence numbers follow, the first one which does not is
+ * the end. A record torn by a crash is thus dropped with the ones
+ * after it, everything committed before is replayed.
+ *
+ * If the file cannot be opened the ring lives in memory only: outages
+ * are still covered, restarts are not.
+ *
+ -------------------------------------------------------------- */
+#ifndef __SPOOL_C
+#define __SPOOL_C
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <spool.h>
+
+// ------ Private constants -----------------------------------
+#define MAGIC       0x53504F4Cu // "SPOL"
+#define WRAP        0xFFFFFFFFu // record len: the next record is at the start of the ring
+#define SLOT_LEN    512         // bytes per header copy
+#define PAGE        4096
+#define ALIGN(n)    (((n) + 7) & ~7u)
+#define DROP_SLACK(size) ((size) / 32) // bytes freed on top of a record which does not fit
+#define MIN_REC_LEN ALIGN(sizeof(rec_hdr_t) + 3) // bytes, a record with nothing in it
+
+// ------ Private types ---------------------------------------
+typedef struct {
+    uint32_t magic;
+    uint32_t size;
+    uint64_t gen;
+    uint64_t head_seq;
+    uint32_t head;
+    uint32_t crc;       // of the fields above
+} file_hdr_t;
+
+typedef struct {
+    uint32_t len;       // bytes of the record, header included, or WRAP
+    uint32_t crc;       // of everything after this field
+    uint64_t seq;
+    uint64_t queued;
+    uint16_t exchange_len, key_len, body_len, lane; // lane: 0 in the files of before the lanes
+} rec_hdr_t;            // then exchange, routing key and body, each NUL terminated
+
+// ------ Private variables -----------------------------------
+static uint32_t crc_table[256];
+static uint64_t gen = 0;
+
+//--------------------------------------------------------------
+// FUNCTION DEFINITIONS
+//--------------------------------------------------------------
+static void __crc_init(void)
+{
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        crc_table[i] = c;
+    }
+}
+
+static uint32_t __crc32(const uint8_t* p, size_t len)
+{
+    uint32_t c = 0xFFFFFFFFu;
+    while (len--) c = crc_table[(c ^ *p++) & 0xFF] ^ (c >> 8);
+    return c ^ 0xFFFFFFFFu;
+}
+
+static uint32_t __rec_crc(const rec_hdr_t* r)
+{
+    return __crc32((const uint8_t*)r + offsetof(rec_hdr_t, seq), r->len - offsetof(rec_hdr_t, seq));
+}
+
+/**
+ *  @brief Offset of the record at off, following a wrap of the ring
+ */
+static uint32_t __skip_wrap(const spool_t* sp, uint32_t off)
+{
+    if (off + sizeof(rec_hdr_t) > sp->size) return 0;
+    if (((const rec_hdr_t*)(sp->ring + off))->len == WRAP) return 0;
+    return off;
+}
+
+/**
+ *  @brief Tell if a complete, intact record with this sequence number is at off
+ */
+static uint8_t __valid(const spool_t* sp, uint32_t off, uint64_t seq)
+{
+    const rec_hdr_t* r = (const rec_hdr_t*)(sp->ring + off);
+    return r->len >= sizeof(rec_hdr_t) && r->len <= sp->size - off && r->seq == seq &&
+           sizeof(rec_hdr_t) + r->exchange_len + r->key_len + r->body_len + 3 <= r->len && __rec_crc(r) == r->crc;
+}
+
+static uint8_t __lane(const rec_hdr_t* r)
+{
+    return r->lane < SPOOL_LANES ? r->lane : 0;
+}
+
+static uint8_t __acked(const spool_t* sp, uint64_t seq)
+{
+    return sp->acked[(seq & sp->acked_mask) >> 3] >> (seq & 7) & 1;
+}
+
+static void __dirty(spool_t* sp, uint32_t lo, uint32_t hi)
+{
+    if (lo < sp->dirty_lo) sp->dirty_lo = lo;
+    if (hi > sp->dirty_hi) sp->dirty_hi = hi;
+}
+
+static void __advance_head(spool_t* sp)
+{
+    const rec_hdr_t* r = (const rec_hdr_t*)(sp->ring + sp->head);
+    spool_cursor_t* c = &sp->lanes[__lane(r)];
+    if (sp->head_seq >= c->seq && !__acked(sp, sp->head_seq)) c->unsent--; // dropped before it was given out
+    sp->acked[(sp->head_seq & sp->acked_mask) >> 3] &= ~(1 << (sp->head_seq & 7));
+
+    sp->head += r->len;
+    sp->head_seq++;
+    sp->head = sp->head_seq == sp->tail_seq ? sp->tail : __skip_wrap(sp, sp->head);
+    for (uint8_t l = 0; l < SPOOL_LANES; l++)
+        if (sp->lanes[l].seq < sp->head_seq) {
+            sp->lanes[l].seq = sp->head_seq;
+            sp->lanes[l].off = sp->head;
+        }
+    sp->header_dirty = 1;
+}
+
+static void __write_header(spool_t* sp)
+{
+    file_hdr_t h;
+    memset(&h, 0, sizeof(h));
+    h.magic = MAGIC;
+    h.size = sp->size;
+    h.gen = ++gen;
+    h.head_seq = sp->head_seq;
+    h.head = sp->head;
+    h.crc = __crc32((const uint8_t*)&h, offsetof(file_hdr_t, crc));
+    memcpy(sp->map + (gen & 1) * SLOT_LEN, &h, sizeof(h)); // the other copy stays good meanwhile
+}
+
+/**
+ *  @brief Walk the records from the oldest one to find the end of the journal
+ */
+static void __recover(spool_t* sp)
+{
+    uint32_t off = sp->head, walked = 0;
+    uint64_t seq = sp->head_seq;
+
+    while (walked < sp->size) {
+        uint32_t at = __skip_wrap(sp, off);
+        if (!__valid(sp, at, seq)) break;
+        walked += (at == off ? 0 : sp->size - off) + ((const rec_hdr_t*)(sp->ring + at))->len;
+        off = at + ((const rec_hdr_t*)(sp->ring + at))->len;
+        seq++;
+    }
+    sp->tail = off;
+    sp->tail_seq = seq;
+    if (seq == sp->head_seq) sp->head = sp->tail; // nothing to replay
+    else sp->head = __skip_wrap(sp, sp->head);
+}
+
+/**
+ *  @brief Open the journal, replaying what a previous run left
+ *  @param sp the spool
+ *  @param path file on local storage, created if needed
+ *  @param size bytes of the ring, a multiple of 4096
+ *  @return 0 if the journal is on file, -1 if it only lives in memory, -2 if there is no journal at all
+ */
+int spool_open(spool_t* sp, const char* path, uint32_t size)
+{
+    size_t map_len = SPOOL_HEADER_LEN + size;
+    struct stat st;
+
+    memset(sp, 0, sizeof(*sp));
+    __crc_init();
+    sp->size = size;
+    sp->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (sp->fd >= 0 && (fstat(sp->fd, &st) < 0 || (st.st_size != (off_t)map_len && ftruncate(sp->fd, map_len) < 0))) {
+        close(sp->fd);
+        sp->fd = -1;
+    }
+    if (sp->fd >= 0) {
+        sp->map = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, sp->fd, 0);
+        if (sp->map == MAP_FAILED) {
+            close(sp->fd);
+            sp->fd = -1;
+        }
+    }
+    if (sp->fd < 0) {
+        printf("Spool: cannot use %s, keeping the messages in memory only\n", path);
+        sp->map = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (sp->map == MAP_FAILED) {
+            printf("Spool: no memory for %u bytes\n", size);
+            fflush(stdout);
+            sp->map = sp->ring = NULL;
+            return -2;
+        }
+    }
+    sp->ring = sp->map + SPOOL_HEADER_LEN;
+    uint32_t bits = 8;
+    while (bits < size / MIN_REC_LEN + 1) bits <<= 1; // more than the ring can hold
+    sp->acked_mask = bits - 1;
+    if ((sp->acked = calloc(bits / 8, 1)) == NULL) {
+        printf("Spool: no memory for %u bytes\n", bits / 8);
+        fflush(stdout);
+        return -2;
+    }
+
+    // newest intact header copy
+    const file_hdr_t* best = NULL;
+    for (int i = 0; i < 2; i++) {
+        const file_hdr_t* h = (const file_hdr_t*)(sp->map + i * SLOT_LEN);
+        if (h->magic != MAGIC || h->size != size || h->head >= size ||
+            h->crc != __crc32((const uint8_t*)h, offsetof(file_hdr_t, crc))) continue;
+        if (best == NULL || h->gen > best->gen) best = h;
+    }
+    if (best != NULL) {
+        gen = best->gen;
+        sp->head = best->head;
+        sp->head_seq = best->head_seq;
+    } else { // new file, or not ours: start empty
+        sp->head_seq = 1;
+        memset(sp->ring, 0, sizeof(rec_hdr_t));
+    }
+    __recover(sp);
+    spool_rewind(sp);
+
+    sp->dirty_lo = size;
+    sp->dirty_hi = 0;
+    sp->header_dirty = 1;
+    spool_commit(sp);
+    if (sp->tail_seq > sp->head_seq) printf("Spool: %llu messages to replay\n", (unsigned long long)(sp->tail_seq - sp->head_seq));
+    fflush(stdout);
+    return sp->fd >= 0 ? 0 : -1;
+}
+
+/**
+ *  @brief Append a message, dropping the oldest records if the ring is full
+ *  @note: not on disk before spool_commit()
+ */
+void spool_append(spool_t* sp, const msg_t* msg)
+{
+    size_t exchange_len = strlen(msg->exchange), key_len = strlen(msg->routing_key);
+    uint32_t len = ALIGN(sizeof(rec_hdr_t) + exchange_len + key_len + msg->body_len + 3);
+    uint32_t at, room = len; // room looked for, more once records have to go
+    uint8_t dropped = 0;
+
+    if (len > sp->size / 4) return; // never, a message is at most a few hundred bytes
+    for (;;) {
+        if (sp->head_seq == sp->tail_seq && sp->tail) { // empty, start over
+            sp->head = sp->tail = 0;
+            for (uint8_t l = 0; l < SPOOL_LANES; l++) sp->lanes[l].off = 0;
+            sp->header_dirty = 1;
+        }
+        if (sp->tail >= sp->head) {
+            if (sp->tail + room <= sp->size) { at = sp->tail; break; }
+            if (room < sp->head) { at = 0; break; }
+        } else if (sp->tail + room < sp->head) {
+            at = sp->tail;
+            break;
+        }
+        room = len + DROP_SLACK(sp->size);
+        __advance_head(sp); // full: the oldest record goes
+        sp->dropped++;
+        dropped = 1;
+    }
+    if (dropped) spool_commit(sp); // the header leaves the dropped records before they are overwritten
+
+    if (at != sp->tail) { // wrap
+        if (sp->tail + sizeof(rec_hdr_t) <= sp->size) ((rec_hdr_t*)(sp->ring + sp->tail))->len = WRAP;
+        __dirty(sp, sp->tail, sp->size);
+    }
+    rec_hdr_t* r = (rec_hdr_t*)(sp->ring + at);
+    char* p = (char*)(r + 1);
+    r->len = len;
+    r->seq = sp->tail_seq;
+    r->queued = msg->queued;
+    r->exchange_len = exchange_len;
+    r->key_len = key_len;
+    r->body_len = msg->body_len;
+    r->lane = msg->lane;
+    memcpy(p, msg->exchange, exchange_len + 1);
+    p += exchange_len + 1;
+    memcpy(p, msg->routing_key, key_len + 1);
+    p += key_len + 1;
+    memcpy(p, msg->body, msg->body_len);
+    p[msg->body_len] = '\0';
+    memset(p + msg->body_len + 1, 0, (uint8_t*)r + len - (uint8_t*)(p + msg->body_len + 1));
+    r->crc = __rec_crc(r);
+    __dirty(sp, at, at + len);
+
+    sp->tail = at + len;
+    sp->tail_seq++;
+    sp->lanes[__lane(r)].unsent++;
+}
+
+/**
+ *  @brief Flush the records appended and the acks since the last commit
+ */
+void spool_commit(spool_t* sp)
+{
+    if (sp->fd >= 0 && sp->dirty_lo < sp->dirty_hi) {
+        uint32_t lo = (SPOOL_HEADER_LEN + sp->dirty_lo) & ~(PAGE - 1);
+        msync(sp->map + lo, SPOOL_HEADER_LEN + sp->dirty_hi - lo, MS_SYNC);
+    }
+    sp->dirty_lo = sp->size;
+    sp->dirty_hi = 0;
+    if (!sp->header_dirty) return;
+    __write_header(sp); // once the records it points to are on disk
+    if (sp->fd >= 0) msync(sp->map, SPOOL_HEADER_LEN, MS_SYNC);
+    sp->header_dirty = 0;
+}
+
+/**
+ *  @brief Next record of a lane to publish, skipping the other lanes and what is acked
+ *  @param sp the spool
+ *  @param lane of the queue the record came through
+ *  @param rec set to the record, it points into the ring
+ *  @return 1 if there is one, 0 if everything of the lane was given out
+ */
+uint8_t spool_next(spool_t* sp, uint8_t lane, spool_rec_t* rec)
+{
+    spool_cursor_t* c = &sp->lanes[lane];
+
+    while (c->unsent && c->seq < sp->tail_seq) {
+        uint32_t at = __skip_wrap(sp, c->off); // the record may have wrapped since the cursor caught up
+        const rec_hdr_t* r = (const rec_hdr_t*)(sp->ring + at);
+        uint64_t seq = c->seq++;
+        c->off = at + r->len;
+        if (__lane(r) != lane || __acked(sp, seq)) continue;
+
+        const char* p = (const char*)(r + 1);
+        rec->seq = r->seq;
+        rec->exchange = p;
+        rec->routing_key = p + r->exchange_len + 1;
+        rec->body = rec->routing_key + r->key_len + 1;
+        rec->body_len = r->body_len;
+        rec->queued = r->queued;
+        rec->lane = lane;
+        c->unsent--;
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ *  @brief The broker has a record, trim it with the ones before it once they are all acked
+ */
+void spool_ack(spool_t* sp, uint64_t seq)
+{
+    if (seq < sp->head_seq || seq >= sp->tail_seq) return; // dropped meanwhile
+    sp->acked[(seq & sp->acked_mask) >> 3] |= 1 << (seq & 7);
+    while (sp->head_seq < sp->tail_seq && __acked(sp, sp->head_seq)) __advance_head(sp);
+}
+
+/**
+ *  @brief Give out again every record not acked, e.g. after a reconnect
+ */
+void spool_rewind(spool_t* sp)
+{
+    for (uint8_t l = 0; l < SPOOL_LANES; l++) {
+        sp->lanes[l].seq = sp->head_seq;
+        sp->lanes[l].off = sp->head;
+        sp->lanes[l].unsent = 0;
+    }
+    uint32_t off = sp->head;
+    for (uint64_t seq = sp->head_seq; seq < sp->tail_seq; seq++) {
+        off = __skip_wrap(sp, off);
+        const rec_hdr_t* r = (const rec_hdr_t*)(sp->ring + off);
+        if (!__acked(sp, seq)) sp->lanes[__lane(r)].unsent++;
+        off += r->len;
+    }
+}
+
+/**
+ *  @brief Records not acked yet
+ */
+uint32_t spool_pending(const spool_t* sp)
+{
+    return sp->tail_seq - sp->head_seq;
+}
+
+/**
+ *  @brief Records not given out by spool_next() yet, of every lane
+ */
+uint32_t spool_unsent(const spool_t* sp)
+{
+    uint32_t unsent = 0;
+    for (uint8_t l = 0; l < SPOOL_LANES; l++) unsent += sp->lanes[l].unsent;
+    return unsent;
+}
+
+/**
+ *  @brief Records of a lane not given out by spool_next() yet
+ */
+uint32_t spool_lane_unsent(const spool_t* sp, uint8_t lane)
+{
+    return sp->lanes[lane].unsent;
+}
+
+//--------------------------------------------------------------
+#endif //__SPOOL_C
@@ -0,0 +1,202 @@
+/** ------------------------------------------------------------*-
+ * Tag pipeline - function file
+ * CheckinGate Project.
+ * (c) Minh-An Dao 2020
+ * version 1.00 - 19/10/2020
+ *--------------------------------------------------------------
+ * Every reader used to format and publish its tags on its own: the
+ * Wiegand timeout handler, the RS232 read and pass handlers and the
+ * USB tag handler each built its hex string, message and routing key.
+ * They now fill a tag_event_t (binary id, reader kind, source, time
+ * and the optional pass/RSSI/membank fields) and call tag_submit():
+ *
+ * - Dedup: a tag read again by the same reader within the window is
+ *   not published again; a tag held on the reader is published once
+ *   per window. Passes from the tracker are already one per tag and
+ *   go through untouched. The table is hashed on the tag key and
+ *   probed over DEDUP_PROBES slots; when they are all live the oldest
+ *   is replaced, so a tag may be published again early if more than
+ *   TAG_DEDUP_SIZE tags show up within a window.
+ * - Enrichment: the enricher given to tag_init() completes the event,
+ *   e.g. with the membank data cached by uhf_mem.c.
+ * - Publish: the id is turned into hex only here, as
+ *   "tag_id:0x...,dir:...,rssi:...", on event.rfid.<source>.
+ *
+ * tag_submit() is called from the threads of every reader at once,
+ * the dedup table is under a lock.
+ *
+ -------------------------------------------------------------- */
+#ifndef __TAG_C
+#define __TAG_C
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <rabbitmq.h>
+#include <encode.h>
+#include <sensor_reader.h>
+#include <tag.h>
+
+// ------ Private constants -----------------------------------
+#define DATA_MAX_LEN  300
+#define DEDUP_MASK    (TAG_DEDUP_SIZE - 1)
+#define DEDUP_PROBES  8
+
+// ------ Private types ---------------------------------------
+typedef struct {
+    tag_key_t key;
+    uint8_t source;
+    uint8_t used;
+    uint64_t time;   // ms, last time the tag was published
+} seen_t;
+
+// ------ Private variables -----------------------------------
+static seen_t seen[TAG_DEDUP_SIZE];
+static uint32_t window = 0;
+static tag_enricher_t enricher = NULL;
+static uint32_t submitted = 0, duplicates = 0, published = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+//--------------------------------------------------------------
+// FUNCTION DEFINITIONS
+//--------------------------------------------------------------
+/**
+ *  @brief Tell if the tag was published by the same reader within the window, remember it if not
+ *  @return 1 if it is a duplicate
+ */
+static uint8_t __duplicate(const tag_event_t* ev)
+{
+    uint32_t h = tag_key_hash(&ev->key) + ev->source;
+    seen_t* victim = NULL;
+
+    for (uint32_t p = 0; p < DEDUP_PROBES; p++) {
+        seen_t* s = &seen[(h + p) & DEDUP_MASK];
+        if (!s->used) {
+            if (victim == NULL || victim->used) victim = s;
+            continue;
+        }
+        if (s->source == ev->source && tag_key_equal(&s->key, &ev->key)) {
+            if (ev->time < s->time + window) return 1;
+            s->time = ev->time;
+            return 0;
+        }
+        if (ev->time >= s->time + window) s->used = 0; // expired, free for the taking
+        if (victim == NULL || (victim->used && (!s->used || s->time < victim->time))) victim = s;
+    }
+
+    victim->key = ev->key;
+    victim->source = ev->source;
+    victim->used = 1;
+    victim->time = ev->time;
+    return 0;
+}
+
+static void __publish(const tag_event_t* ev)
+{
+    char src[10];
+    format_source(src, sizeof(src), "rfid", ev->source);
+    char data[DATA_MAX_LEN];
+    encode_buf_t b;
+    encode_init(&b, data, sizeof(data));
+    encode_str(&b, "tag_id:0x");
+    encode_hex(&b, ev->id, ev->id_len);
+    if (ev->flags & TAG_HAS_PASS) {
+        encode_str(&b, ",dir:");
+        encode_str(&b, ev->dir);
+    }
+    if (ev->flags & TAG_HAS_RSSI) {
+        encode_str(&b, ",rssi:");
+        encode_i64(&b, ev->rssi);
+        encode_str(&b, ",ant:");
+        encode_u64(&b, ev->ant);
+    }
+    if (ev->flags & TAG_HAS_PASS) {
+        encode_str(&b, ",reads:");
+        encode_u64(&b, ev->reads);
+        encode_str(&b, ",dwell:");
+        encode_u64(&b, ev->dwell);
+    }
+    if (ev->flags & TAG_HAS_MEM) {
+        encode_str(&b, ",mem:0x");
+        encode_hex(&b, ev->mem, ev->mem_len);
+    }
+
+    printf("Tag %s: %s\n", src, data);
+    fflush(stdout);
+
+    #if en_rabbitmq
+        char routing_key[20];
+        format_routing_key(routing_key, sizeof(routing_key), src);
+        char message[MESSAGE_MAX_LEN];
+        size_t len = format_message(message, sizeof(message), ev->time, "rfid", src, data, OTHER_SENSOR_ID);
+        send_message(message, len, EXCHANGE_NAME, routing_key, RABBITMQ_LANE_TAG);
+    #endif
+}
+
+/**
+ *  @brief Set up the pipeline, before the readers start
+ *  @param dedup_window ms, a tag is published once per window and reader, 0 to publish every read
+ *  @param on_event completes an event before it is published, NULL if not needed
+ */
+void tag_init(uint32_t dedup_window, tag_enricher_t on_event)
+{
+    window = dedup_window;
+    enricher = on_event;
+}
+
+/**
+ *  @brief Fill the fields every event has, no optional field set
+ *  @param ev the event
+ *  @param kind TAG_WIEGAND, TAG_UHF_RS232 or TAG_UHF_USB
+ *  @param source source id of the reader
+ *  @param id binary id, cut to TAG_ID_MAX_LEN
+ *  @param id_len bytes of id
+ *  @param time ms, wall clock of the read
+ */
+void tag_event_init(tag_event_t* ev, uint8_t kind, uint8_t source, const uint8_t* id, uint8_t id_len, uint64_t time)
+{
+    if (id_len > TAG_ID_MAX_LEN) id_len = TAG_ID_MAX_LEN;
+    memcpy(ev->id, id, id_len);
+    ev->id_len = id_len;
+    tag_key_make(&ev->key, kind == TAG_WIEGAND ? TAG_KEY_WIEGAND : TAG_KEY_EPC, id, id_len);
+    ev->kind = kind;
+    ev->source = source;
+    ev->flags = 0;
+    ev->time = time;
+}
+
+/**
+ *  @brief Dedup, enrich and publish one event, from any thread
+ *  @param ev the event, completed by the enricher
+ *  @return 1 if published, 0 if dropped as a duplicate
+ */
+uint8_t tag_submit(tag_event_t* ev)
+{
+    pthread_mutex_lock(&lock);
+    submitted++;
+    uint8_t dup = window && !(ev->flags & TAG_HAS_PASS) && __duplicate(ev);
+    if (dup) duplicates++;
+    else published++;
+    pthread_mutex_unlock(&lock);
+    if (dup) return 0;
+
+    if (enricher != NULL) enricher(ev);
+    __publish(ev);
+    return 1;
+}
+
+/**
+ *  @brief Counters of the pipeline, any pointer can be NULL
+ */
+void tag_stats(uint32_t* _submitted, uint32_t* _duplicates, uint32_t* _published)
+{
+    pthread_mutex_lock(&lock);
+    if (_submitted) *_submitted = submitted;
+    if (_duplicates) *_duplicates = duplicates;
+    if (_published) *_published = published;
+    pthread_mutex_unlock(&lock);
+}
+
+//--------------------------------------------------------------
+#endif //__TAG_C
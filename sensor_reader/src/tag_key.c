@@ -0,0 +1,51 @@
+/** ------------------------------------------------------------*-
+ * Tag key - function file
+ * CheckinGate Project.
+ * (c) Minh-An Dao 2020
+ * version 1.00 - 19/10/2020
+ *--------------------------------------------------------------
+ * The key is built once per read, from the bytes of the reader. Our
+ * badges carry 96 bit EPCs, so any EPC up to 128 bits is kept as it
+ * is and two keys are equal exactly when the ids are. Longer EPCs
+ * (the reader allows up to 496 bits) keep their first 8 bytes and a
+ * 64 bit FNV-1a hash of the rest: a collision needs two such tags
+ * sharing the first 64 bits, which is left as a risk.
+ *
+ -------------------------------------------------------------- */
+#ifndef __TAG_KEY_C
+#define __TAG_KEY_C
+
+#include <string.h>
+
+#include <tag_key.h>
+
+//--------------------------------------------------------------
+// FUNCTION DEFINITIONS
+//--------------------------------------------------------------
+/**
+ *  @brief Build the key of a tag
+ *  @param key the key
+ *  @param type TAG_KEY_WIEGAND or TAG_KEY_EPC
+ *  @param id id bytes as read, big endian
+ *  @param len bytes of id
+ */
+void tag_key_make(tag_key_t* key, uint8_t type, const uint8_t* id, uint8_t len)
+{
+    uint8_t b[TAG_KEY_BYTES] = {0};
+
+    if (len <= TAG_KEY_BYTES) {
+        memcpy(b, id, len);
+    } else {
+        uint64_t h = 14695981039346656037ull; // FNV-1a
+        for (uint8_t i = 8; i < len; i++) h = (h ^ id[i]) * 1099511628211ull;
+        memcpy(b, id, 8);
+        memcpy(b + 8, &h, 8);
+    }
+    memcpy(&key->hi, b, 8);
+    memcpy(&key->lo, b + 8, 8);
+    key->type = type;
+    key->len = len;
+}
+
+//--------------------------------------------------------------
+#endif //__TAG_KEY_C
@@ -0,0 +1,143 @@
+/** ------------------------------------------------------------*-
+ * Tag pool - function file
+ * CheckinGate Project.
+ * (c) Minh-An Dao 2020
+ * version 1.00 - 19/10/2020
+ *--------------------------------------------------------------
+ * The CFHid library calls us on its USB thread for every tag. Anything
+ * slow there (printf, a broker round trip) stalls USB reading, so the
+ * callback only copies the report into a slot and returns.
+ *
+ * - Put: bounded ring of preallocated slots, every slot carries a
+ *   sequence number telling whose turn it is (D. Vyukov's bounded
+ *   queue). A producer claims a slot with one compare-and-swap, fills
+ *   it and publishes it; no lock, no allocation. When the ring is full
+ *   the report is dropped and counted, the callback never waits.
+ * - Get/Wait: one consumer thread takes the slots in order; it sleeps
+ *   on a semaphore, sem_post() is lock-free and safe from any thread.
+ * - Stats: reports put, dropped (full), oversize, and the most slots
+ *   ever in use, to size TAG_POOL_SIZE.
+ *
+ -------------------------------------------------------------- */
+#ifndef __TAG_POOL_C
+#define __TAG_POOL_C
+
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+
+#include <tag_pool.h>
+
+// ------ Private constants -----------------------------------
+#define MASK (TAG_POOL_SIZE - 1)
+
+//--------------------------------------------------------------
+// FUNCTION DEFINITIONS
+//--------------------------------------------------------------
+void tag_pool_init(tag_pool_t* pool)
+{
+    memset(pool, 0, sizeof(*pool));
+    for (unsigned int i = 0; i < TAG_POOL_SIZE; i++) atomic_init(&pool->cells[i].seq, i);
+    sem_init(&pool->ready, 0, 0);
+}
+
+/**
+ *  @brief Copy one report into a free slot, never blocks
+ *  @param pool the pool
+ *  @param source source id of the reader
+ *  @param tag_cnt tags in the report
+ *  @param data raw report
+ *  @param len length of data
+ *  @param time ms, when the report came in
+ *  @return 0 if kept, 1 if dropped (pool full or report too long)
+ */
+uint8_t tag_pool_put(tag_pool_t* pool, uint8_t source, uint16_t tag_cnt, const uint8_t* data, int len, uint64_t time)
+{
+    if (len < 0 || len > TAG_POOL_DATA_LEN) {
+        atomic_fetch_add_explicit(&pool->oversize, 1, memory_order_relaxed);
+        return 1;
+    }
+
+    unsigned int pos = atomic_load_explicit(&pool->tail, memory_order_relaxed);
+    for (;;) {
+        unsigned int seq = atomic_load_explicit(&pool->cells[pos & MASK].seq, memory_order_acquire);
+        int dif = (int)(seq - pos);
+        if (dif == 0) { // free for this turn, claim it
+            if (atomic_compare_exchange_weak_explicit(&pool->tail, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) break;
+        } else if (dif < 0) { // still holds a report of the previous turn
+            atomic_fetch_add_explicit(&pool->dropped, 1, memory_order_relaxed);
+            return 1;
+        } else { // another producer took it
+            pos = atomic_load_explicit(&pool->tail, memory_order_relaxed);
+        }
+    }
+
+    tag_slot_t* slot = &pool->cells[pos & MASK].slot;
+    memcpy(slot->data, data, len);
+    slot->len = len;
+    slot->source = source;
+    slot->tag_cnt = tag_cnt;
+    slot->time = time;
+    atomic_store_explicit(&pool->cells[pos & MASK].seq, pos + 1, memory_order_release);
+
+    atomic_fetch_add_explicit(&pool->put, 1, memory_order_relaxed);
+    sem_post(&pool->ready);
+    return 0;
+}
+
+/**
+ *  @brief Take the oldest report, from the consumer thread only
+ *  @return 1 if a report was taken, 0 if the pool is empty
+ */
+uint8_t tag_pool_get(tag_pool_t* pool, tag_slot_t* slot)
+{
+    unsigned int pos = pool->head;
+    unsigned int seq = atomic_load_explicit(&pool->cells[pos & MASK].seq, memory_order_acquire);
+
+    if (seq != pos + 1) return 0;
+
+    unsigned int used = atomic_load_explicit(&pool->tail, memory_order_relaxed) - pos;
+    if (used > pool->high_water) pool->high_water = used;
+
+    *slot = pool->cells[pos & MASK].slot;
+    atomic_store_explicit(&pool->cells[pos & MASK].seq, pos + TAG_POOL_SIZE, memory_order_release);
+    pool->head = pos + 1;
+    return 1;
+}
+
+/**
+ *  @brief Sleep until a report is put or the timeout expires
+ *  @param pool the pool
+ *  @param timeout_ms maximum wait
+ *  @return 1 if a report is waiting, 0 on timeout
+ */
+uint8_t tag_pool_wait(tag_pool_t* pool, int timeout_ms)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += timeout_ms / 1000;
+    ts.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+
+    while (sem_timedwait(&pool->ready, &ts) < 0)
+        if (errno != EINTR) return 0;
+    return 1;
+}
+
+/**
+ *  @brief Counters of the pool, any pointer can be NULL
+ */
+void tag_pool_stats(tag_pool_t* pool, uint32_t* put, uint32_t* dropped, uint32_t* oversize, uint32_t* high_water)
+{
+    if (put) *put = atomic_load_explicit(&pool->put, memory_order_relaxed);
+    if (dropped) *dropped = atomic_load_explicit(&pool->dropped, memory_order_relaxed);
+    if (oversize) *oversize = atomic_load_explicit(&pool->oversize, memory_order_relaxed);
+    if (high_water) *high_water = pool->high_water;
+}
+
+//--------------------------------------------------------------
+#endif //__TAG_POOL_C
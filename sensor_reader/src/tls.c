@@ -0,0 +1,143 @@
+/** ------------------------------------------------------------*-
+ * TLS to the brokers - function file
+ * CheckinGate Project.
+ * (c) Minh-An Dao 2020
+ * version 1.00 - 19/10/2020
+ *--------------------------------------------------------------
+ * The credentials and the badge data used to go to the broker in
+ * clear text. The connections can now be made over TLS, with the SSL
+ * socket of rabbitmq-c (lib/amqp_openssl.c). A full handshake costs
+ * the Pi tens of ms of CPU, on every reconnect, so:
+ *
+ * - Context: one SSL_CTX per broker, made once (CA certificates loaded
+ *   once), shared by every socket with amqp_ssl_socket_new_with_context().
+ * - Resumption: the client session cache of the context hands every
+ *   new session (TLS 1.2 session id or TLS 1.3 ticket, which comes
+ *   after the handshake) to a callback which keeps the last one. The
+ *   next socket offers it: if the broker takes it the handshake skips
+ *   the certificate exchange and the key agreement.
+ * - A connection which fails drops the session, the next one does a
+ *   full handshake.
+ *
+ * tools/tls_bench measures full against resumed handshakes.
+ *
+ -------------------------------------------------------------- */
+#ifndef __TLS_C
+#define __TLS_C
+
+#include <string.h>
+
+#include <amqp_ssl_socket.h>
+#include <tls.h>
+
+//--------------------------------------------------------------
+// FUNCTION DEFINITIONS
+//--------------------------------------------------------------
+/**
+ *  @brief Called by OpenSSL with every session the broker gives, on the thread reading the socket
+ *  @return 1: the reference is ours
+ */
+static int __new_session(SSL* ssl, SSL_SESSION* session)
+{
+    tls_t* t = SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+    pthread_mutex_lock(&t->lock);
+    if (t->session != NULL) SSL_SESSION_free(t->session);
+    t->session = session;
+    pthread_mutex_unlock(&t->lock);
+    return 1;
+}
+
+/**
+ *  @brief Make the context of a broker, once
+ *  @param t its TLS state
+ *  @param cacert CA certificates (PEM) the broker certificate is checked against, NULL for the system ones
+ *  @param verify 0 to accept any certificate (tests only)
+ *  @return 0 if done, -1 if OpenSSL or the CA file failed
+ */
+int tls_init(tls_t* t, const char* cacert, uint8_t verify)
+{
+    memset(t, 0, sizeof(*t));
+    pthread_mutex_init(&t->lock, NULL);
+    t->verify = verify;
+    if (amqp_initialize_ssl_library() != AMQP_STATUS_OK) return -1;
+    if ((t->ctx = SSL_CTX_new(TLS_client_method())) == NULL) return -1;
+
+    SSL_CTX_set_min_proto_version(t->ctx, TLS1_2_VERSION);
+    SSL_CTX_set_mode(t->ctx, SSL_MODE_ENABLE_PARTIAL_WRITE); // the modes amqp_ssl_socket_new() sets
+    SSL_CTX_clear_mode(t->ctx, SSL_MODE_AUTO_RETRY);
+    if (verify && (cacert ? SSL_CTX_load_verify_locations(t->ctx, cacert, NULL)
+                          : SSL_CTX_set_default_verify_paths(t->ctx)) != 1) {
+        SSL_CTX_free(t->ctx);
+        t->ctx = NULL;
+        return -1;
+    }
+    SSL_CTX_set_session_cache_mode(t->ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(t->ctx, __new_session);
+    SSL_CTX_set_app_data(t->ctx, t);
+    return 0;
+}
+
+/**
+ *  @brief SSL socket of a new connection, offering the last session
+ *  @return the socket, owned by conn, NULL if it could not be made
+ */
+amqp_socket_t* tls_socket(tls_t* t, amqp_connection_state_t conn)
+{
+    if (t->ctx == NULL) return NULL; // tls_init() failed
+    amqp_socket_t* socket = amqp_ssl_socket_new_with_context(conn, t->ctx);
+    if (socket == NULL) return NULL;
+    amqp_ssl_socket_set_verify_peer(socket, t->verify);
+    amqp_ssl_socket_set_verify_hostname(socket, t->verify);
+    pthread_mutex_lock(&t->lock);
+    amqp_ssl_socket_set_session(socket, t->session); // the socket holds its own reference
+    pthread_mutex_unlock(&t->lock);
+    return socket;
+}
+
+/**
+ *  @brief Count a socket opened
+ *  @param us time of the open, TCP connect and handshake
+ */
+void tls_opened(tls_t* t, amqp_socket_t* socket, uint64_t us)
+{
+    uint8_t resumed = amqp_ssl_socket_session_reused(socket);
+    pthread_mutex_lock(&t->lock);
+    t->handshakes++;
+    if (resumed) {
+        t->resumed++;
+        t->resumed_us += us;
+    } else {
+        t->full_us += us;
+    }
+    pthread_mutex_unlock(&t->lock);
+}
+
+/**
+ *  @brief Drop the session, after a failed connection
+ */
+void tls_forget(tls_t* t)
+{
+    pthread_mutex_lock(&t->lock);
+    if (t->session != NULL) SSL_SESSION_free(t->session);
+    t->session = NULL;
+    pthread_mutex_unlock(&t->lock);
+}
+
+/**
+ *  @brief Counters, any pointer can be NULL
+ *  @param full_avg us, average open time of a full handshake
+ *  @param resumed_avg us, of a resumed one
+ */
+void tls_stats(tls_t* t, uint32_t* handshakes, uint32_t* resumed, uint64_t* full_avg, uint64_t* resumed_avg)
+{
+    pthread_mutex_lock(&t->lock);
+    uint32_t full = t->handshakes - t->resumed;
+    if (handshakes) *handshakes = t->handshakes;
+    if (resumed) *resumed = t->resumed;
+    if (full_avg) *full_avg = full ? t->full_us / full : 0;
+    if (resumed_avg) *resumed_avg = t->resumed ? t->resumed_us / t->resumed : 0;
+    pthread_mutex_unlock(&t->lock);
+}
+
+//--------------------------------------------------------------
+#endif //__TLS_C
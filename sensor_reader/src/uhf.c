@@ -44,11 +44,14 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <wiringPi.h>
-#include <wiringSerial.h>
 #include <errno.h> //errno
 #include <string.h> //strerror
+#include <pthread.h>
 
+#include <serial.h>
+#include <encode.h>
 #include <uhf.h>
+#include <uhf_filter.h>
 
 // ------ Private constants -----------------------------------
 #define BAUDRATE         115200
@@ -59,7 +62,10 @@
 #define RESET_CMD          0x70
 #define READ_CMD           0x81
 #define WRITE_CMD          0x82
+#define ACCESS_MATCH_CMD   0x85 // Select the EPC that read/write/lock/kill talk to
+#define TAG_MASK_CMD       0x98 // Gen2 Select masks applied before every inventory
 #define RT_INVENTORY_CMD   0x89 // Real time inventory
+#define SESSION_INVENTORY_CMD 0x8B // Real time inventory with desired session and target
 #define GET_READER_ID_CMD  0x68 // Get reader identifier
 #define BUZZER_CMD         0x7A
 #define MODE_CMD           0xA0
@@ -79,6 +85,14 @@
 #define TID_MEMBANK       0x02
 #define USER_MEMBANK      0x03
 
+// Tag mask (Gen2 Select) parameters
+#define MASK_CLEAR_ALL    0x00
+#define MASK_TARGET_SL    0x04
+#define MASK_ACTION_SET   0x00 // matching: assert SL, others: deassert SL
+#define MASK_ACTION_OR    0x01 // matching: assert SL, others: unchanged
+#define MASK_BITS_MAX     255  // MaskBitLen is one byte
+#define EPC_BIT_OFFSET    0x20 // the EPC starts after CRC and PC in the EPC membank
+
 // Membank word limits, a word is 2 bytes (16 bit)
 #define EPC_MEMBANK_WORD_LIM   8
 #define TID_MEMBANK_WORD_LIM   12
@@ -93,6 +107,9 @@
 #define HEADER_INDEX       0
 #define MESSAGE_LEN_INDEX  1
 
+#define FRAME_TIMEOUT      50 // ms, maximum gap inside one packet
+#define READ_TIMEOUT       200 // ms, maximum time for the reader to answer cmd_read
+
 // Error codes
 #define COMMAND_SUCCESS       0x10
 #define COMMAND_FAIL          0x11
@@ -108,18 +125,34 @@
 #define MEMBANK_OUT_OF_RANGE  0x43
 #define LOCK_OUT_OF_RANGE     0x44 // Lock region out of range
 
+// ------ Private types ---------------------------------------
+/** @brief One RS232 reader. Everything a command or a response needs lives here */
+struct uhf_reader {
+    int fd;
+    int rx_timeout; // ms waiting for the next packet
+
+
+    uint8_t membank;
+    uint8_t word_address;
+    uint8_t word_cnt;
+
+    pthread_mutex_t tx_lock;  // commands may be sent from several threads
+    char formatted_cmd[100]; // guarded by tx_lock
+    char data[300];          // response packet, owned by the reading thread
+    uhf_round_t round;       // last inventory round, owned by the reading thread
+    uint8_t round_ready;
+    uhf_read_t read;         // last cmd_read answer, owned by the reading thread
+    uint8_t read_ready;
+    uhf_write_t write;       // last cmd_write answer, owned by the reading thread
+    uint8_t write_ready;
+    uhf_filter_t* filter;    // EPCs kept, NULL to keep every tag
+    uint8_t mask_clear;      // the next tag mask answer is for the clear-all of uhf_set_filter()
+};
+
 // ------ Private function prototypes -------------------------
 
 // ------ Private variables -----------------------------------
-static int fd;
-
-static int membank=TID_MEMBANK;
-static int word_address=0x00;
-static int word_cnt=0x01;
 
-char g_formatted_cmd[100];
-char g_data[300];
-char g_str[300];
 // ------ PUBLIC variable definitions -------------------------
 
 //--------------------------------------------------------------
@@ -141,125 +174,137 @@ char __get_checksum(char* uBuff, uint8_t uLength)
 
 /**
  *  @brief format command to byte array
+ *  @param out buffer for the formatted command, at least n + 4 bytes
  *  @param arr the command to be formatted
  *  @param n length of the command array
  */
-char* __format_command(char* arr, uint8_t n)
+char* __format_command(char* out, char* arr, uint8_t n)
 {
     n += 4;
     // [header, length, reader_address, command, checksum]
 
-    g_formatted_cmd[0] = HEADER;
-    g_formatted_cmd[1] = n - 2; // Message length count from third byte
-    g_formatted_cmd[2] = DEFAULT_READER_ADDRESS;
+    out[0] = HEADER;
+    out[1] = n - 2; // Message length count from third byte
+    out[2] = DEFAULT_READER_ADDRESS;
     uint8_t i = 3;
-    for (; i < n - 1; i++) g_formatted_cmd[i] = arr[i-3];
-    g_formatted_cmd[i] = __get_checksum(g_formatted_cmd, i);
+    for (; i < n - 1; i++) out[i] = arr[i-3];
+    out[i] = __get_checksum(out, i);
     //--- debug
-    // for (int j = 0; j < n; j++) printf("%02x ", g_formatted_cmd[j]); printf("\n"); fflush(stdout);
-    return g_formatted_cmd;
+    // for (int j = 0; j < n; j++) printf("%02x ", out[j]); printf("\n"); fflush(stdout);
+    return out;
+}
+
+/**
+ *  @brief Format a command and send it to the reader
+ *  @param reader the reader
+ *  @param arr the command to be sent
+ *  @param n length of the command array
+ */
+void __send_command(uhf_reader_t* reader, char* arr, uint8_t n)
+{
+    pthread_mutex_lock(&reader->tx_lock);
+    if (serial_write(reader->fd, __format_command(reader->formatted_cmd, arr, n), n + 4) < 0)
+        fprintf(stderr, "Unable to write to serial device: %s\n", strerror(errno));
+    pthread_mutex_unlock(&reader->tx_lock);
 }
 
 /**
  *  @brief Generate hex string from array
+ *  @param out buffer for the string, at least 2*(e-s)+1 bytes
  *  @param arr array of data
  *  @param s start index
  *  @param e end index
  *  @return formatted string
  */
-char* __get_hex_string(char* arr, uint8_t s, uint8_t e)
+char* __get_hex_string(char* out, char* arr, uint8_t s, uint8_t e)
 {
-    char* end_of_str = g_str;
-
-    for (uint8_t i = s; i < e; i++)
-        end_of_str += sprintf(end_of_str, "%02X", arr[i]);
-
-    *end_of_str = '\0';
-    return g_str;
+    *encode_hex_raw(out, (uint8_t*)arr + s, e > s ? e - s : 0) = '\0';
+    return out;
 }
 
 /**
  *  @brief Read the whole packet
- *  @return Read packet
+ *  @param reader the reader
+ *  @param packet_len set to the full packet length, 0 if nothing was read
+ *  @return Read packet, NULL if the data is not a valid packet
  */
-char* __read_response_packet(uint8_t* packet_len)
+char* __read_response_packet(uhf_reader_t* reader, uint8_t* packet_len)
 {
-    if (serialDataAvail(fd)) {
-        char header = serialGetchar(fd);
-        if (header != HEADER) {
-            printf("\nError (__read_response_packet): %02X is not packet header", header);
-            return NULL;
-        }
+    uint8_t header; // char is signed on x86, unsigned on ARM
+    uint8_t len;
 
-        *packet_len = serialGetchar(fd);
+    *packet_len = 0;
+    if (serial_wait(reader->fd, reader->rx_timeout) <= 0) return "";
+    if (serial_read(reader->fd, &header, 1, FRAME_TIMEOUT) != 1) return "";
 
-        g_data[0] = header;
-        g_data[1] = *packet_len;
-        for (uint8_t i = 0; i < *packet_len; i++)
-            g_data[i+2] = serialGetchar(fd);
-        
-        *packet_len += 2; // return the full package length including header and package len itself
+    if (header != HEADER) {
+        printf("\nError (__read_response_packet): %02X is not packet header", header);
+        return NULL;
+    }
+    if (serial_read(reader->fd, &len, 1, FRAME_TIMEOUT) != 1) return NULL;
 
-        return g_data;
+    reader->data[0] = header;
+    reader->data[1] = len;
+    if (serial_read(reader->fd, reader->data + 2, len, FRAME_TIMEOUT) != len) {
+        printf("\nError (__read_response_packet): packet truncated");
+        return NULL;
     }
-    *packet_len = 0;
-    return "";
+    
+    *packet_len = len + 2; // return the full package length including header and package len itself
+
+    return reader->data;
 }
 
 /**
  *  @brief reset the reader
  */
-void __reset_reader() 
+void __reset_reader(uhf_reader_t* reader) 
 {
-    // char reset_cmd[] = {RESET_CMD};
-    // uint8_t len = (uint8_t)sizeof(reset_cmd)/sizeof(reset_cmd[0]);
-    // serialPrintf(fd, __format_command(reset_cmd, len));
-    char cmd[] = {HEADER, 0x03, DEFAULT_READER_ADDRESS, RESET_CMD, 0xec};
-    serialPrintf(fd, cmd);
+    char cmd[] = {RESET_CMD};
+    uint8_t len = (uint8_t)sizeof(cmd)/sizeof(cmd[0]);
+    __send_command(reader, cmd, len);
 }
 
-void __setmode_standard() 
+void __setmode_standard(uhf_reader_t* reader) 
 {
-    // char reset_cmd[] = {RESET_CMD};
-    // uint8_t len = (uint8_t)sizeof(reset_cmd)/sizeof(reset_cmd[0]);
-    // serialPrintf(fd, __format_command(reset_cmd, len));
-    char cmd[] = {HEADER, 0x04, DEFAULT_READER_ADDRESS, MODE_CMD, STANDARD, 0xBD};
-    serialPrintf(fd, cmd);
+    char cmd[] = {MODE_CMD, STANDARD};
+    uint8_t len = (uint8_t)sizeof(cmd)/sizeof(cmd[0]);
+    __send_command(reader, cmd, len);
 }
 
-void __setmode_wiegand26() 
+void __setmode_wiegand26(uhf_reader_t* reader) 
 {
-    // char reset_cmd[] = {RESET_CMD};
-    // uint8_t len = (uint8_t)sizeof(reset_cmd)/sizeof(reset_cmd[0]);
-    // serialPrintf(fd, __format_command(reset_cmd, len));
-    char cmd[] = {HEADER, 0x04, DEFAULT_READER_ADDRESS, MODE_CMD, WIEGAND26, 0xB8};
-    serialPrintf(fd, cmd);
+    char cmd[] = {MODE_CMD, WIEGAND26};
+    uint8_t len = (uint8_t)sizeof(cmd)/sizeof(cmd[0]);
+    __send_command(reader, cmd, len);
 }
 
-void __setmode_wiegand34() 
+void __setmode_wiegand34(uhf_reader_t* reader) 
 {
-    // char reset_cmd[] = {RESET_CMD};
-    // uint8_t len = (uint8_t)sizeof(reset_cmd)/sizeof(reset_cmd[0]);
-    // serialPrintf(fd, __format_command(reset_cmd, len));
-    char cmd[] = {HEADER, 0x04, DEFAULT_READER_ADDRESS, MODE_CMD, WIEGAND34, 0x00};
-    serialPrintf(fd, cmd);
+    char cmd[] = {MODE_CMD, WIEGAND34};
+    uint8_t len = (uint8_t)sizeof(cmd)/sizeof(cmd[0]);
+    __send_command(reader, cmd, len);
 }
 
 /**
  * @brief Read tag
+ * @param reader the reader
+ * @param out buffer for the hex string of the read data
+ * @param out_len size of out
+ * @return 0 if succeed, 1 if failed
  */
-char* uhf_read_tag()
+uint8_t uhf_read_tag(uhf_reader_t* reader, char* out, size_t out_len)
 {
     // printf("\nRead tag: ");
-    char cmd[] = {READ_CMD, membank, word_address, word_cnt};
+    char cmd[] = {READ_CMD, reader->membank, reader->word_address, reader->word_cnt};
     uint8_t len = (uint8_t)sizeof(cmd)/sizeof(cmd[0]);
-    char* formatted_cmd = __format_command(cmd, len);
-    serialPrintf(fd, formatted_cmd);
+    __send_command(reader, cmd, len);
     
-    usleep(10000); // us
+    // wait for the answer instead of a fixed delay, it returns as soon as the reader starts answering
+    if (serial_wait(reader->fd, READ_TIMEOUT) <= 0) return 1;
 
     uint8_t res_len;
-    char* res = __read_response_packet(&res_len);
+    char* res = __read_response_packet(reader, &res_len);
     
     // ---debug 
     // printf("\n");
@@ -267,7 +312,7 @@ char* uhf_read_tag()
 
     if (res_len != 0)
     {
-        if (res_len == 6) return "ERR";//printf("Error: 0x%02X\n", res[4]);
+        if (res_len == 6) return 1;//printf("Error: 0x%02X\n", res[4]);
         else
         {
             if (__get_checksum(res, res_len-1) != res[res_len - 1]) printf("CHECKSUM FAILED");
@@ -275,105 +320,396 @@ char* uhf_read_tag()
                 uint8_t data_len = res[6];
                 uint8_t read_len = res[7 + data_len];
 
+                if ((size_t)read_len*2 + 1 > out_len) return 1;
+
                 // printf("Tag count: %d\n", res[4] + res[5]);
-                // printf("PC: %s\n", __get_hex_string(res, 7, 9));
-                // printf("EPC: %s\n", __get_hex_string(res, 9, 7 + data_len - read_len - 2));
-                // printf("CRC: %s\n", __get_hex_string(res, 7 + data_len - read_len - 2, 7 + data_len - read_len));
-                // printf("Full package: %s\n", __get_hex_string(res, 0, res_len));
+                // printf("PC: %s\n", __get_hex_string(out, res, 7, 9));
+                // printf("EPC: %s\n", __get_hex_string(out, res, 9, 7 + data_len - read_len - 2));
+                // printf("CRC: %s\n", __get_hex_string(out, res, 7 + data_len - read_len - 2, 7 + data_len - read_len));
+                // printf("Full package: %s\n", __get_hex_string(out, res, 0, res_len));
 
-                char* hex_str = __get_hex_string(res, 7 + data_len - read_len, 7 + data_len);
-                printf("UHF Read data: 0x%s\n", hex_str);
+                __get_hex_string(out, res, 7 + data_len - read_len, 7 + data_len);
+                printf("UHF Read data: 0x%s\n", out);
                 fflush(stdout);
 
-                return hex_str;
+                return 0;
             }
         }
     }
     fflush(stdout);
-    return "ERR";
+    return 1;
 }
 
-char* uhf_read_rt_inventory()
+/**
+ *  @brief Keep the answer of cmd_read for uhf_get_read()
+ *  @param reader the reader
+ *  @param res the packet: [TagCount(2), DataLen, PC(2) EPC CRC(2) Data, ReadLen, AntID, ReadCount]
+ *  @param res_len full packet length
+ */
+void __parse_read(uhf_reader_t* reader, char* res, uint8_t res_len)
 {
-    uint8_t res_len;
-    char* res = __read_response_packet(&res_len);
+    uhf_read_t* read = &reader->read;
+
+    memset(read, 0, sizeof(*read));
+    if (res_len == 6) read->error = res[4];
+    else if (__get_checksum(res, res_len-1) != res[res_len - 1]) read->error = COMMAND_FAIL;
+    else {
+        uint8_t data_len = res[6];
+        uint8_t read_len = res[7 + data_len];
+        if (res_len < 11 + data_len || data_len < read_len + 4 ||
+            data_len - read_len - 4 > UHF_EPC_MAX_LEN || read_len > UHF_READ_MAX_LEN) {
+            read->error = PARAM_INVALID;
+        } else {
+            read->epc_len = data_len - read_len - 4;
+            memcpy(read->epc, res + 9, read->epc_len);
+            read->data_len = read_len;
+            memcpy(read->data, res + 7 + data_len - read_len, read_len);
+            read->ant = res[8 + data_len];
+        }
+    }
+    reader->read_ready = 1;
+}
 
-    if (res_len != 0)
-    {
-        // printf("res_len: %d data:", res_len);
-        // for (int i = 0; i < res_len; i++) printf("%02X ", res[i]);
-        // printf("\n");
+/**
+ *  @brief Keep the answer of cmd_write for uhf_get_write()
+ *  @param reader the reader
+ *  @param res the packet: [TagCount(2), DataLen, PC(2) EPC CRC(2), ErrCode, AntID, WriteCount]
+ *  @param res_len full packet length
+ */
+void __parse_write(uhf_reader_t* reader, char* res, uint8_t res_len)
+{
+    uhf_write_t* write = &reader->write;
+
+    memset(write, 0, sizeof(*write));
+    if (res_len == 6) write->error = res[4];
+    else if (__get_checksum(res, res_len-1) != res[res_len - 1]) write->error = COMMAND_FAIL;
+    else {
+        uint8_t data_len = res[6];
+        if (res_len != 11 + data_len || data_len < 4 || data_len - 4 > UHF_EPC_MAX_LEN) {
+            write->error = PARAM_INVALID;
+        } else {
+            write->tag_cnt = ((uint8_t)res[4] << 8) | (uint8_t)res[5];
+            write->epc_len = data_len - 4;
+            memcpy(write->epc, res + 9, write->epc_len);
+            if ((uint8_t)res[7 + data_len] != COMMAND_SUCCESS) write->error = res[7 + data_len];
+            write->ant = res[8 + data_len];
+        }
+    }
+    reader->write_ready = 1;
+}
 
-        if (res_len == 6) return "ERR";//printf("Error: 0x%02X\n", res[4]);
-        else if (res_len == 12) return "ERR"; // Filter out some random 12 bytes response, don't know why, fix later (maybe?)
-        else
-        {
-            if (__get_checksum(res, res_len-1) != res[res_len - 1]) printf("CHECKSUM FAILED");
-            else {
-                // printf("\nPC: %s", __get_hex_string(res, 5, 7));
-                // printf("\nRSSI: %s", __get_hex_string(res, res_len - 2, res_len - 1));
-                // printf("\nEPC: %s", __get_hex_string(res, 7, res_len - 2));
+/**
+ *  @brief Read one tag report of the real-time inventory, keeping PC, RSSI and antenna
+ *  @param reader the reader
+ *  @param tag where the parsed report is stored
+ *  @return 0 if a tag was read, 1 otherwise (no data, error or round-end packet)
+ */
+uint8_t uhf_read_rt_inventory_tag(uhf_reader_t* reader, uhf_tag_t* tag)
+{
+    uint8_t res_len = 0;
+    char* res = __read_response_packet(reader, &res_len);
 
-                char* hex_str = __get_hex_string(res, 7, res_len - 2);
-                printf("UHF EPC: 0x%s\n", hex_str);
-                fflush(stdout);
-                
-                return hex_str;
-            }
+    if (res_len == 0) return 1;
+    uint8_t cmd = res[3];
+    uint8_t inventory = (cmd == RT_INVENTORY_CMD || cmd == SESSION_INVENTORY_CMD);
+
+    if (cmd == READ_CMD) { // answer of uhf_request_read()
+        __parse_read(reader, res, res_len);
+        return 1;
+    }
+    if (cmd == WRITE_CMD) { // answer of uhf_request_write()
+        __parse_write(reader, res, res_len);
+        return 1;
+    }
+    if (cmd == TAG_MASK_CMD && res_len == 6) {
+        uint8_t ok = (uint8_t)res[4] == COMMAND_SUCCESS;
+        if (reader->mask_clear) { // the answers come in the order of the commands
+            reader->mask_clear = 0;
+            printf("UHF tag mask: %s\n", ok ? "cleared on the reader" : "clear not supported");
+        } else {
+            printf("UHF tag mask: %s\n", ok ? "set on the reader" : "not supported, filtering on the host only");
+        }
+        fflush(stdout);
+        return 1;
+    }
+    if (res_len == 6) { // Error packet, the round ended without success
+        if (inventory) {
+            memset(&reader->round, 0, sizeof(reader->round));
+            reader->round.error = res[4];
+            reader->round_ready = 1;
         }
+        return 1;
     }
+    if (res_len == 12) { // End of inventory round: AntID, ReadRate, TotalRead
+        if (inventory && __get_checksum(res, res_len-1) == res[res_len - 1]) {
+            reader->round.ant = res[4];
+            reader->round.read_rate = ((uint8_t)res[5] << 8) | (uint8_t)res[6];
+            reader->round.total_read = ((uint32_t)(uint8_t)res[7] << 24) | ((uint32_t)(uint8_t)res[8] << 16) |
+                                       ((uint32_t)(uint8_t)res[9] << 8) | (uint8_t)res[10];
+            reader->round.error = 0;
+            reader->round_ready = 1;
+        }
+        return 1;
+    }
+
+    if (__get_checksum(res, res_len-1) != res[res_len - 1]) {
+        printf("CHECKSUM FAILED\n");
+        return 1;
+    }
+    // [header, len, address, cmd, freq_ant, pc(2), epc(n), rssi, checksum]
+    uint8_t epc_len = res_len - 9;
+    if (epc_len > UHF_EPC_MAX_LEN) return 1;
+
+    tag->freq = (uint8_t)res[4] >> 2;
+    tag->ant = res[4] & 0x03;
+    tag->pc = ((uint8_t)res[5] << 8) | (uint8_t)res[6];
+    memcpy(tag->epc, res + 7, epc_len);
+    tag->epc_len = epc_len;
+    tag->rssi = res[res_len - 2];
+
+    // fallback for what the reader let through, foreign tags stop here
+    if (reader->filter != NULL && !uhf_filter_match(reader->filter, tag->epc, tag->epc_len)) return 1;
+    return 0;
+}
+
+/**
+ *  @brief Read one EPC of the real-time inventory as a hex string
+ *  @param reader the reader
+ *  @param out buffer for the hex string, at least UHF_EPC_MAX_LEN*2+1 bytes
+ *  @return 0 if a tag was read, 1 otherwise
+ */
+uint8_t uhf_read_rt_inventory(uhf_reader_t* reader, char* out)
+{
+    uhf_tag_t tag;
+
+    if (uhf_read_rt_inventory_tag(reader, &tag)) {
+        fflush(stdout);
+        return 1;
+    }
+
+    __get_hex_string(out, (char*)tag.epc, 0, tag.epc_len);
+    printf("UHF EPC: 0x%s\n", out);
     fflush(stdout);
-    return "ERR";
+
+    return 0;
 }
 
-void uhf_realtime_inventory()
+void uhf_realtime_inventory(uhf_reader_t* reader)
 {
     char cmd[] = {RT_INVENTORY_CMD, 10};
     uint8_t len = (uint8_t)sizeof(cmd)/sizeof(cmd[0]);
-    char* formatted_cmd = __format_command(cmd, len);
-    serialPrintf(fd, formatted_cmd);
-    // if (formatted_cmd != NULL) free(formatted_cmd);
+    __send_command(reader, cmd, len);
+}
+
+/**
+ *  @brief Set how long a read waits for the next packet
+ *  @param reader the reader
+ *  @param timeout_ms 0 to return at once if no data is waiting
+ */
+void uhf_set_rx_timeout(uhf_reader_t* reader, int timeout_ms)
+{
+    reader->rx_timeout = timeout_ms;
+}
+
+/**
+ *  @brief Start a real-time inventory with the desired session and inventoried flag
+ *  @param reader the reader
+ *  @param session session S0-S3
+ *  @param target inventoried flag, 0 = A, 1 = B
+ *  @param repeat number of inventory repeats in the round
+ */
+void uhf_session_inventory(uhf_reader_t* reader, uint8_t session, uint8_t target, uint8_t repeat)
+{
+    char cmd[] = {SESSION_INVENTORY_CMD, session, target, repeat};
+    uint8_t len = (uint8_t)sizeof(cmd)/sizeof(cmd[0]);
+    __send_command(reader, cmd, len);
+}
+
+/**
+ *  @brief Get the result of the last inventory round, once
+ *  @param reader the reader, called from the thread reading it
+ *  @param round where the round result is stored
+ *  @return 1 if a round has ended since the last call, 0 otherwise
+ */
+uint8_t uhf_get_round(uhf_reader_t* reader, uhf_round_t* round)
+{
+    if (!reader->round_ready) return 0;
+    *round = reader->round;
+    reader->round_ready = 0;
+    return 1;
+}
+
+/**
+ *  @brief Ask for the membank set by uhf_set_param() of one tag, without waiting
+ *  @note: the answer comes back through uhf_get_read(), in the thread reading the reader.
+ *         The access EPC match is left set, it does not affect inventory rounds.
+ *  @param reader the reader
+ *  @param epc EPC of the tag to read
+ *  @param epc_len EPC length (bytes)
+ */
+void uhf_request_read(uhf_reader_t* reader, const uint8_t* epc, uint8_t epc_len)
+{
+    char match[3 + UHF_EPC_MAX_LEN] = {ACCESS_MATCH_CMD, 0x00, epc_len};
+    char cmd[] = {READ_CMD, reader->membank, reader->word_address, reader->word_cnt};
+
+    if (epc_len > UHF_EPC_MAX_LEN) return;
+    memcpy(match + 3, epc, epc_len);
+
+    // both commands in one go, so no other command gets in between
+    pthread_mutex_lock(&reader->tx_lock);
+    if (serial_write(reader->fd, __format_command(reader->formatted_cmd, match, 3 + epc_len), 3 + epc_len + 4) < 0 ||
+        serial_write(reader->fd, __format_command(reader->formatted_cmd, cmd, sizeof(cmd)), sizeof(cmd) + 4) < 0)
+        fprintf(stderr, "Unable to write to serial device: %s\n", strerror(errno));
+    pthread_mutex_unlock(&reader->tx_lock);
 }
 
-uint8_t uhf_set_param(uint8_t _membank, uint8_t _word_address, uint8_t _word_cnt)
+/**
+ *  @brief Get the last answer to uhf_request_read(), once
+ *  @param reader the reader, called from the thread reading it
+ *  @param read where the answer is stored
+ *  @return 1 if an answer has come since the last call, 0 otherwise
+ */
+uint8_t uhf_get_read(uhf_reader_t* reader, uhf_read_t* read)
+{
+    if (!reader->read_ready) return 0;
+    *read = reader->read;
+    reader->read_ready = 0;
+    return 1;
+}
+
+/**
+ *  @brief Write words into a membank of one tag, without waiting
+ *  @note: the answer comes back through uhf_get_write(), like uhf_request_read(). Several requests can be
+ *         sent back to back, the reader runs them in order and answers each of them once.
+ *  @param reader the reader
+ *  @param epc EPC of the tag to write
+ *  @param epc_len EPC length (bytes)
+ *  @param membank EPC_MEMBANK (the EPC starts at word 2) or USER_MEMBANK
+ *  @param word_add first word to write
+ *  @param data the words, 2*word_cnt bytes
+ *  @param word_cnt number of words
+ */
+void uhf_request_write(uhf_reader_t* reader, const uint8_t* epc, uint8_t epc_len,
+                       uint8_t membank, uint8_t word_add, const uint8_t* data, uint8_t word_cnt)
 {
-    membank = _membank;
-    word_address = _word_address;
-    word_cnt = _word_cnt;
+    char match[3 + UHF_EPC_MAX_LEN] = {ACCESS_MATCH_CMD, 0x00, epc_len};
+    // [cmd, PassWord(4), MemBank, WordAdd, WordCnt, Data]
+    char cmd[8 + 2*USER_MEMBANK_WORD_LIM] = {WRITE_CMD, 0x00, 0x00, 0x00, 0x00, membank, word_add, word_cnt};
+
+    if (epc_len > UHF_EPC_MAX_LEN || word_cnt > USER_MEMBANK_WORD_LIM) return;
+    memcpy(match + 3, epc, epc_len);
+    memcpy(cmd + 8, data, 2*word_cnt);
+
+    pthread_mutex_lock(&reader->tx_lock);
+    if (serial_write(reader->fd, __format_command(reader->formatted_cmd, match, 3 + epc_len), 3 + epc_len + 4) < 0 ||
+        serial_write(reader->fd, __format_command(reader->formatted_cmd, cmd, 8 + 2*word_cnt), 8 + 2*word_cnt + 4) < 0)
+        fprintf(stderr, "Unable to write to serial device: %s\n", strerror(errno));
+    pthread_mutex_unlock(&reader->tx_lock);
+}
 
-    if (((membank == TID_MEMBANK) && ((word_address + word_cnt) > TID_MEMBANK_WORD_LIM)) ||
-        ((membank == EPC_MEMBANK) && ((word_address + word_cnt) > EPC_MEMBANK_WORD_LIM)) ||
-        ((membank == USER_MEMBANK) && ((word_address + word_cnt) > USER_MEMBANK_WORD_LIM)))
+/**
+ *  @brief Get the last answer to uhf_request_write(), once
+ *  @param reader the reader, called from the thread reading it
+ *  @param write where the answer is stored
+ *  @return 1 if an answer has come since the last call, 0 otherwise
+ */
+uint8_t uhf_get_write(uhf_reader_t* reader, uhf_write_t* write)
+{
+    if (!reader->write_ready) return 0;
+    *write = reader->write;
+    reader->write_ready = 0;
+    return 1;
+}
+
+/**
+ *  @brief Keep only the tags matching a filter
+ *  @note: if every rule has a plain prefix mask, the rules are also set on the reader as tag
+ *         masks (Gen2 Select on the SL flag), so foreign tags are not even reported. Readers without tag mask
+ *         support answer with an error, the filter still runs on every report.
+ *  @param reader the reader
+ *  @param filter the filter, kept by the reader. NULL to keep every tag
+ *  @return number of rules set on the reader
+ */
+uint8_t uhf_set_filter(uhf_reader_t* reader, uhf_filter_t* filter)
+{
+    uint8_t pushed = 0;
+    char clear[] = {TAG_MASK_CMD, MASK_CLEAR_ALL};
+
+    reader->filter = filter;
+    reader->mask_clear = 1;
+    __send_command(reader, clear, sizeof(clear));
+    if (filter == NULL) return 0;
+    // the reader would hide the tags only a host rule keeps: all rules go down or none
+    for (uint8_t i = 0; i < filter->cnt; i++)
+        if (filter->rules[i].prefix_bits == 0) return 0;
+
+    for (uint8_t i = 0; i < filter->cnt; i++) {
+        const uhf_filter_rule_t* r = &filter->rules[i];
+
+        // a longer prefix is cut: the reader then reports a few more tags, the host rule drops them
+        uint8_t bits = r->prefix_bits > MASK_BITS_MAX ? MASK_BITS_MAX : r->prefix_bits;
+        uint8_t mask_len = (bits + 7) / 8;
+        // [MaskNo, Target, Action, Membank, StartAddress(bit), MaskBitLen, Mask, Truncate]
+        char cmd[8 + UHF_EPC_MAX_LEN] = {TAG_MASK_CMD, pushed + 1, MASK_TARGET_SL,
+            pushed ? MASK_ACTION_OR : MASK_ACTION_SET, EPC_MEMBANK, EPC_BIT_OFFSET, bits};
+        memcpy(cmd + 7, r->value, mask_len);
+        cmd[7 + mask_len] = 0x00; // no truncate
+        __send_command(reader, cmd, 8 + mask_len);
+        pushed++;
+    }
+    return pushed;
+}
+
+uint8_t uhf_set_param(uhf_reader_t* reader, uint8_t _membank, uint8_t _word_address, uint8_t _word_cnt)
+{
+    if (((_membank == TID_MEMBANK) && ((_word_address + _word_cnt) > TID_MEMBANK_WORD_LIM)) ||
+        ((_membank == EPC_MEMBANK) && ((_word_address + _word_cnt) > EPC_MEMBANK_WORD_LIM)) ||
+        ((_membank == USER_MEMBANK) && ((_word_address + _word_cnt) > USER_MEMBANK_WORD_LIM)))
         {
             printf("\nMembank word limit exceeded. (TID 12 words, EPC 8 words, USER 32 words)");
             return 1;
         }
+
+    reader->membank = _membank;
+    reader->word_address = _word_address;
+    reader->word_cnt = _word_cnt;
     return 0;
 }
 //--------------------------------------------------------------
 /**
- * @brief Initialize the whole uhf system including GPIOs, interrupts and handlers
- * @return 0 if succeed, 1 if failed
+ * @brief Open a reader including GPIOs. Every reader can be used from its own thread
+ * @return the reader, NULL if failed
  * @param port: port defines for rs232 connection
  * @param baudrate: baudrate speed
  * @param oepin: Enable pin for logic converter TXS0108E
  *               put -1 if used MOSFET converter
+ * @param opts: serial port tuning, NULL for the defaults
 */
-uint8_t uhf_init(const char* port, uint32_t baudrate, uint8_t oepin) 
+uhf_reader_t* uhf_open(const char* port, uint32_t baudrate, int8_t oepin, const serial_opts_t* opts) 
 {
     fflush(stdout);
+    uhf_reader_t* reader = (uhf_reader_t*)calloc(1, sizeof(uhf_reader_t));
+    if (reader == NULL) return NULL;
+
+    reader->membank = TID_MEMBANK;
+    reader->word_address = 0x00;
+    reader->word_cnt = 0x01;
+    pthread_mutex_init(&reader->tx_lock, NULL);
+
     //-------------- Open connection -------------
     /** @brief initialize serial */
-    if ((fd = serialOpen(port, baudrate)) < 0)
+    if ((reader->fd = serial_open(port, baudrate, opts)) < 0)
     {
         fprintf (stderr, "Unable to open serial device: %s\n", strerror (errno)) ;
-        return 1 ;
+        uhf_close(reader);
+        return NULL ;
     }
     /** @brief initialize wiringPi */
     if (wiringPiSetup() == -1)
     {
         fprintf (stdout, "Unable to start wiringPi: %s\n", strerror (errno)) ;
-        return 1 ;
+        uhf_close(reader);
+        return NULL ;
     }
     //---------------------- Setup Enable pin -----------------------
     if (oepin>0) {
@@ -382,11 +718,22 @@ uint8_t uhf_init(const char* port, uint32_t baudrate, uint8_t oepin)
         digitalWrite(oepin, HIGH); //set it low to high to make it works
     }
 
-    serialFlush(fd);
-    //__reset_reader();
+    serial_flush(reader->fd);
+    //__reset_reader(reader);
 
-    return 0;
-}//end uhf_init
+    return reader;
+}//end uhf_open
+
+/**
+ * @brief Close the serial port of a reader and free it
+*/
+void uhf_close(uhf_reader_t* reader)
+{
+    if (reader == NULL) return;
+    if (reader->fd >= 0) serial_close(reader->fd);
+    pthread_mutex_destroy(&reader->tx_lock);
+    free(reader);
+}//end uhf_close
 
 //--------------------------------------------------------------
 /**
@@ -0,0 +1,138 @@
+/** ------------------------------------------------------------*-
+ * UHF EPC filter - function file
+ * CheckinGate Project.
+ * (c) Minh-An Dao 2020
+ * version 1.00 - 19/10/2020
+ *--------------------------------------------------------------
+ * A rule is written as hex: "E200C0DE" keeps the EPCs starting with
+ * E2 00 C0 DE, "E200C0DE/FFFF00FF" only compares the bits set in the
+ * mask. A tag is kept if it matches any rule, or if there is none.
+ *
+ * When every rule has a plain prefix mask (leading 1 bits) the rules
+ * are also given to the reader as tag masks, see uhf_set_filter(). The
+ * check here stays on either way, it costs a few compares per tag and
+ * covers readers without tag mask support.
+ *
+ -------------------------------------------------------------- */
+#ifndef __UHF_FILTER_C
+#define __UHF_FILTER_C
+
+#include <string.h>
+
+#include <uhf_filter.h>
+
+//--------------------------------------------------------------
+// FUNCTION DEFINITIONS
+//--------------------------------------------------------------
+static int __hex_value(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+/**
+ *  @brief Parse hex digits up to '/' or the end of the string
+ *  @return number of bytes, -1 if invalid
+ */
+static int __parse_hex(const char** s, uint8_t* out)
+{
+    int n = 0;
+    while (**s && **s != '/') {
+        int hi = __hex_value((*s)[0]);
+        int lo = (*s)[1] ? __hex_value((*s)[1]) : -1;
+        if (hi < 0 || lo < 0 || n >= UHF_EPC_MAX_LEN) return -1;
+        out[n++] = (hi << 4) | lo;
+        *s += 2;
+    }
+    return n;
+}
+
+/**
+ *  @brief Length of the mask in bits if it is leading 1 bits only, 0 otherwise
+ */
+static uint16_t __prefix_bits(const uint8_t* mask, uint8_t len)
+{
+    uint16_t bits = 0;
+    uint8_t i = 0;
+
+    for (; i < len && mask[i] == 0xFF; i++) bits += 8;
+    if (i < len) {
+        uint8_t m = mask[i++];
+        while (m & 0x80) { bits++; m <<= 1; }
+        if (m) return 0; // hole in the mask
+    }
+    for (; i < len; i++) if (mask[i]) return 0;
+    return bits;
+}
+
+void uhf_filter_init(uhf_filter_t* f)
+{
+    memset(f, 0, sizeof(*f));
+}
+
+/**
+ *  @brief Add a rule
+ *  @param f the filter
+ *  @param rule "VALUE" or "VALUE/MASK" in hex, e.g. "E200C0DE"
+ *  @return 0 if succeed, -1 if the rule is invalid or the filter is full
+ */
+int uhf_filter_add(uhf_filter_t* f, const char* rule)
+{
+    if (f->cnt >= UHF_FILTER_MAX) return -1;
+
+    uhf_filter_rule_t* r = &f->rules[f->cnt];
+    memset(r, 0, sizeof(*r));
+
+    int len = __parse_hex(&rule, r->value);
+    if (len <= 0) return -1;
+    if (*rule == '/') {
+        rule++;
+        if (__parse_hex(&rule, r->mask) != len) return -1;
+    } else {
+        memset(r->mask, 0xFF, len);
+    }
+    for (int i = 0; i < len; i++) r->value[i] &= r->mask[i];
+    r->len = len;
+    r->prefix_bits = __prefix_bits(r->mask, len);
+    f->cnt++;
+    return 0;
+}
+
+/**
+ *  @brief Check an EPC against the rules and count it
+ *  @return 1 if the tag is kept, 0 if it is dropped
+ */
+uint8_t uhf_filter_match(uhf_filter_t* f, const uint8_t* epc, uint8_t epc_len)
+{
+    if (f->cnt == 0) {
+        atomic_fetch_add_explicit(&f->accepted, 1, memory_order_relaxed);
+        return 1;
+    }
+    for (uint8_t i = 0; i < f->cnt; i++) {
+        const uhf_filter_rule_t* r = &f->rules[i];
+        if (epc_len < r->len) continue;
+
+        uint8_t j = 0;
+        while (j < r->len && (epc[j] & r->mask[j]) == r->value[j]) j++;
+        if (j == r->len) {
+            atomic_fetch_add_explicit(&f->accepted, 1, memory_order_relaxed);
+            return 1;
+        }
+    }
+    atomic_fetch_add_explicit(&f->rejected, 1, memory_order_relaxed);
+    return 0;
+}
+
+/**
+ *  @brief Tags kept and dropped by a filter so far
+ */
+void uhf_filter_stats(uhf_filter_t* f, uint32_t* accepted, uint32_t* rejected)
+{
+    *accepted = atomic_load_explicit(&f->accepted, memory_order_relaxed);
+    *rejected = atomic_load_explicit(&f->rejected, memory_order_relaxed);
+}
+
+//--------------------------------------------------------------
+#endif //__UHF_FILTER_C
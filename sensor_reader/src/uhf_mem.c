@@ -0,0 +1,269 @@
+/** ------------------------------------------------------------*-
+ * UHF membank cache - function file
+ * CheckinGate Project.
+ * (c) Minh-An Dao 2020
+ * version 1.00 - 19/10/2020
+ *--------------------------------------------------------------
+ * The TID or USER data of a tag (employee number, etc.) does not
+ * change between passages, so it is read once and kept by EPC in a
+ * fixed-size LRU cache instead of being read on every passage.
+ *
+ * - Touch: every inventory read of a tag marks it as recently seen.
+ *   A tag not in the cache gets a pending entry, the least recently
+ *   seen tag is dropped when the cache is full.
+ * - Next: the thread of a reader asks for the next pending tag and
+ *   sends the read with uhf_request_read(). One read per reader is in
+ *   flight at a time, the most recently seen tags go first.
+ * - Complete: the answer is stored; errors and timeouts are tried
+ *   again up to UHF_MEM_TRIES times, then the tag is left alone for
+ *   UHF_MEM_HOLDOFF ms.
+ * - Get: the data of a tag if it is known, counted as hit or miss.
+ *
+ * Entries are found by tag key (tag_key.h), the EPC bytes are only
+ * kept to send the read.
+ *
+ -------------------------------------------------------------- */
+#ifndef __UHF_MEM_C
+#define __UHF_MEM_C
+
+#include <string.h>
+#include <pthread.h>
+
+#include <uhf_mem.h>
+
+// ------ Private constants -----------------------------------
+#define BUCKET_CNT  (UHF_MEM_CACHE_SIZE * 2)
+#define NONE        -1
+
+// Entry states
+#define MEM_PENDING    0 // not read yet
+#define MEM_REQUESTED  1 // read sent, waiting for the answer
+#define MEM_VALID      2
+#define MEM_FAILED     3 // given up until UHF_MEM_HOLDOFF
+
+// ------ Private types ---------------------------------------
+typedef struct {
+    tag_key_t key;
+    uint8_t epc[UHF_EPC_MAX_LEN];
+    uint8_t epc_len;
+    uint8_t data[UHF_READ_MAX_LEN];
+    uint8_t data_len;
+    uint8_t state;
+    uint8_t source;      // reader which saw the tag last, to read it
+    uint8_t requester;   // reader the read in flight was sent to
+    uint8_t tries;
+    uint64_t req_time;   // ms, last read sent
+    int16_t prev, next;  // LRU list, head is the most recently seen
+    int16_t hnext;       // hash chain
+} mem_entry_t;
+
+// ------ Private variables -----------------------------------
+static mem_entry_t entries[UHF_MEM_CACHE_SIZE];
+static int16_t buckets[BUCKET_CNT];
+static int16_t head = NONE, tail = NONE;
+static int16_t used = 0;
+static uint32_t hits = 0, misses = 0;
+static pthread_mutex_t mem_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//--------------------------------------------------------------
+// FUNCTION DEFINITIONS
+//--------------------------------------------------------------
+static uint32_t __bucket(const tag_key_t* key)
+{
+    return tag_key_hash(key) % BUCKET_CNT;
+}
+
+static int16_t __find(const tag_key_t* key)
+{
+    for (int16_t i = buckets[__bucket(key)]; i != NONE; i = entries[i].hnext)
+        if (tag_key_equal(&entries[i].key, key)) return i;
+    return NONE;
+}
+
+static void __lru_unlink(int16_t i)
+{
+    mem_entry_t* e = &entries[i];
+    if (e->prev != NONE) entries[e->prev].next = e->next; else head = e->next;
+    if (e->next != NONE) entries[e->next].prev = e->prev; else tail = e->prev;
+}
+
+static void __lru_push_head(int16_t i)
+{
+    entries[i].prev = NONE;
+    entries[i].next = head;
+    if (head != NONE) entries[head].prev = i;
+    head = i;
+    if (tail == NONE) tail = i;
+}
+
+static void __hash_unlink(int16_t i)
+{
+    int16_t* p = &buckets[__bucket(&entries[i].key)];
+    while (*p != i) p = &entries[*p].hnext;
+    *p = entries[i].hnext;
+}
+
+/**
+ *  @brief Count a failed read of an entry, give the tag up after UHF_MEM_TRIES
+ */
+static void __failed(mem_entry_t* e)
+{
+    e->state = ++e->tries >= UHF_MEM_TRIES ? MEM_FAILED : MEM_PENDING;
+}
+
+/**
+ *  @brief Note that a reader has seen a tag
+ *  @param epc EPC of the tag
+ *  @param epc_len EPC length (bytes)
+ *  @param source reader which saw it
+ *  @param now current time (ms)
+ */
+void uhf_mem_touch(const uint8_t* epc, uint8_t epc_len, uint8_t source, uint64_t now)
+{
+    if (epc_len > UHF_EPC_MAX_LEN) return;
+    tag_key_t key;
+    tag_key_make(&key, TAG_KEY_EPC, epc, epc_len);
+
+    pthread_mutex_lock(&mem_lock);
+    int16_t i = __find(&key);
+    if (i != NONE) {
+        __lru_unlink(i);
+    } else {
+        if (used < UHF_MEM_CACHE_SIZE) i = used++;
+        else {
+            i = tail; // drop the least recently seen tag
+            __lru_unlink(i);
+            __hash_unlink(i);
+        }
+        memset(&entries[i], 0, sizeof(entries[i]));
+        entries[i].key = key;
+        memcpy(entries[i].epc, epc, epc_len);
+        entries[i].epc_len = epc_len;
+        entries[i].state = MEM_PENDING;
+
+        uint32_t b = __bucket(&key);
+        entries[i].hnext = buckets[b];
+        buckets[b] = i;
+    }
+    __lru_push_head(i);
+
+    mem_entry_t* e = &entries[i];
+    if (e->state == MEM_PENDING || e->state == MEM_FAILED) e->source = source; // a read in flight stays with its reader
+    if (e->state == MEM_FAILED && now - e->req_time >= UHF_MEM_HOLDOFF) {
+        e->state = MEM_PENDING;
+        e->tries = 0;
+    }
+    pthread_mutex_unlock(&mem_lock);
+}
+
+/**
+ *  @brief Get the next tag a reader should read
+ *  @param source the reader
+ *  @param now current time (ms)
+ *  @param epc set to the EPC to read, at least UHF_EPC_MAX_LEN bytes
+ *  @param epc_len set to the EPC length
+ *  @return 1 if a read should be sent now, 0 otherwise
+ */
+uint8_t uhf_mem_next(uint8_t source, uint64_t now, uint8_t* epc, uint8_t* epc_len)
+{
+    int16_t pick = NONE;
+
+    pthread_mutex_lock(&mem_lock);
+    for (int16_t i = head; i != NONE; i = entries[i].next) {
+        mem_entry_t* e = &entries[i];
+        if (e->state == MEM_REQUESTED && e->requester == source) {
+            if (now - e->req_time < UHF_MEM_TIMEOUT) { // one read in flight per reader
+                pthread_mutex_unlock(&mem_lock);
+                return 0;
+            }
+            __failed(e);
+        }
+        if (e->state == MEM_PENDING && e->source == source && pick == NONE) pick = i;
+    }
+    if (pick != NONE) {
+        mem_entry_t* e = &entries[pick];
+        e->state = MEM_REQUESTED;
+        e->requester = source;
+        e->req_time = now;
+        memcpy(epc, e->epc, e->epc_len);
+        *epc_len = e->epc_len;
+    }
+    pthread_mutex_unlock(&mem_lock);
+    return pick != NONE;
+}
+
+/**
+ *  @brief Store the answer of a read
+ *  @param source the reader which answered
+ *  @param read the answer, from uhf_get_read()
+ */
+void uhf_mem_complete(uint8_t source, const uhf_read_t* read)
+{
+    pthread_mutex_lock(&mem_lock);
+    if (read->error) { // the answer has no EPC, it belongs to the read in flight
+        for (int16_t i = head; i != NONE; i = entries[i].next)
+            if (entries[i].requester == source && entries[i].state == MEM_REQUESTED) {
+                __failed(&entries[i]);
+                break;
+            }
+    } else {
+        tag_key_t key;
+        tag_key_make(&key, TAG_KEY_EPC, read->epc, read->epc_len);
+        int16_t i = __find(&key);
+        if (i != NONE) { // dropped from the cache meanwhile otherwise
+            memcpy(entries[i].data, read->data, read->data_len);
+            entries[i].data_len = read->data_len;
+            entries[i].state = MEM_VALID;
+        }
+    }
+    pthread_mutex_unlock(&mem_lock);
+}
+
+/**
+ *  @brief Get the membank data of a tag from the cache
+ *  @param key key of the tag
+ *  @param data set to the data, at least UHF_READ_MAX_LEN bytes
+ *  @param data_len set to the data length
+ *  @return 0 if the data is known (hit), 1 otherwise (miss)
+ */
+uint8_t uhf_mem_get(const tag_key_t* key, uint8_t* data, uint8_t* data_len)
+{
+    uint8_t ret = 1;
+
+    pthread_mutex_lock(&mem_lock);
+    int16_t i = __find(key);
+    if (i != NONE && entries[i].state == MEM_VALID) {
+        memcpy(data, entries[i].data, entries[i].data_len);
+        *data_len = entries[i].data_len;
+        ret = 0;
+    }
+    if (ret) misses++;
+    else hits++;
+    pthread_mutex_unlock(&mem_lock);
+    return ret;
+}
+
+void uhf_mem_stats(uint32_t* _hits, uint32_t* _misses)
+{
+    pthread_mutex_lock(&mem_lock);
+    *_hits = hits;
+    *_misses = misses;
+    pthread_mutex_unlock(&mem_lock);
+}
+
+//--------------------------------------------------------------
+/**
+ * @brief Empty the cache
+*/
+void uhf_mem_init(void)
+{
+    pthread_mutex_lock(&mem_lock);
+    for (int i = 0; i < BUCKET_CNT; i++) buckets[i] = NONE;
+    head = tail = NONE;
+    used = 0;
+    hits = misses = 0;
+    pthread_mutex_unlock(&mem_lock);
+}//end uhf_mem_init
+
+//--------------------------------------------------------------
+#endif //__UHF_MEM_C
@@ -0,0 +1,257 @@
+/** ------------------------------------------------------------*-
+ * UHF pass tracker - function file
+ * CheckinGate Project.
+ * (c) Minh-An Dao 2020
+ * version 1.00 - 19/10/2020
+ *--------------------------------------------------------------
+ * Every EPC seen by the reader gets a slot in a fixed-size table.
+ * The slot keeps the last UHF_TRACK_SAMPLES (time, RSSI, antenna)
+ * samples and, per antenna, the time of the strongest smoothed RSSI.
+ *
+ * - Peak: the strongest smoothed RSSI over all antennas is taken as
+ *   the closest approach of the tag to the gate.
+ * - Direction: the antenna order of the per-antenna peaks. A tag that
+ *   peaks on a lower antenna id first is going IN, the other way OUT.
+ * - Leave: a tag not seen for leave_timeout ms has left the field, its
+ *   pass is emitted once through the handler and the slot is freed.
+ *
+ * If the table is full, the tag seen the longest time ago is emitted
+ * early to make room. Slots are matched on the tag key (tag_key.h),
+ * built once per read.
+ *
+ -------------------------------------------------------------- */
+#ifndef __UHF_TRACK_C
+#define __UHF_TRACK_C
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <uhf_track.h>
+
+// ------ Private constants -----------------------------------
+#define SMOOTH_WINDOW  3 // samples of the same antenna averaged together
+
+// ------ Private types ---------------------------------------
+typedef struct {
+    uint64_t time;
+    uint8_t rssi;
+    uint8_t ant;
+} track_sample_t;
+
+typedef struct {
+    uint8_t used;
+    uint8_t source;
+    tag_key_t key;
+    uint8_t epc[UHF_EPC_MAX_LEN];
+    uint8_t epc_len;
+    uint16_t reads;
+    uint64_t first_seen;
+    uint64_t last_seen;
+    track_sample_t samples[UHF_TRACK_SAMPLES]; // ring buffer
+    uint8_t head;
+    uint8_t sample_cnt;
+    uint8_t ant_peak_rssi[UHF_TRACK_ANT_CNT];
+    uint64_t ant_peak_time[UHF_TRACK_ANT_CNT]; // 0 if never seen
+} track_slot_t;
+
+// ------ Private variables -----------------------------------
+static track_slot_t slots[UHF_TRACK_SLOTS];
+static uint32_t leave_timeout = 1000;
+static uhf_pass_handler_t pass_handler = NULL;
+static pthread_mutex_t track_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//--------------------------------------------------------------
+// FUNCTION DEFINITIONS
+//--------------------------------------------------------------
+/**
+ *  @brief Average of the latest samples of one antenna, the newest included
+ *  @param slot tracked tag
+ *  @param ant antenna id
+ *  @return smoothed RSSI
+ */
+static uint8_t __smoothed_rssi(const track_slot_t* slot, uint8_t ant)
+{
+    uint16_t sum = 0;
+    uint8_t cnt = 0;
+
+    for (uint8_t i = 0; i < slot->sample_cnt && cnt < SMOOTH_WINDOW; i++) {
+        const track_sample_t* s = &slot->samples[(slot->head + UHF_TRACK_SAMPLES - 1 - i) % UHF_TRACK_SAMPLES];
+        if (s->ant != ant) continue;
+        sum += s->rssi;
+        cnt++;
+    }
+    return cnt ? sum / cnt : 0;
+}
+
+/**
+ *  @brief Build the pass of a tracked tag and free its slot
+ *  @param slot tracked tag
+ *  @param out where the pass is stored
+ */
+static void __close_slot(track_slot_t* slot, uhf_pass_t* out)
+{
+    uhf_pass_t pass;
+    int8_t first_ant = -1, last_ant = -1;
+
+    pass.source = slot->source;
+    memcpy(pass.epc, slot->epc, slot->epc_len);
+    pass.epc_len = slot->epc_len;
+    pass.reads = slot->reads;
+    pass.first_seen = slot->first_seen;
+    pass.last_seen = slot->last_seen;
+    pass.peak_rssi = 0;
+    pass.peak_ant = 0;
+    pass.peak_time = slot->first_seen;
+
+    for (uint8_t a = 0; a < UHF_TRACK_ANT_CNT; a++) {
+        if (!slot->ant_peak_time[a]) continue;
+
+        if (slot->ant_peak_rssi[a] > pass.peak_rssi) {
+            pass.peak_rssi = slot->ant_peak_rssi[a];
+            pass.peak_ant = a;
+            pass.peak_time = slot->ant_peak_time[a];
+        }
+        if (first_ant < 0 || slot->ant_peak_time[a] < slot->ant_peak_time[first_ant]) first_ant = a;
+        if (last_ant < 0 || slot->ant_peak_time[a] >= slot->ant_peak_time[last_ant]) last_ant = a;
+    }
+
+    if (first_ant < 0 || first_ant == last_ant) pass.direction = UHF_DIR_UNKNOWN;
+    else pass.direction = first_ant < last_ant ? UHF_DIR_IN : UHF_DIR_OUT;
+
+    slot->used = 0;
+    *out = pass;
+}
+
+/**
+ *  @brief Find the slot of an EPC, or take a free one (evicting the oldest if full)
+ *  @param source reader the tag was read by
+ *  @param key key of the EPC
+ *  @param epc EPC bytes
+ *  @param epc_len EPC length
+ *  @param now time of the read (ms)
+ *  @param evicted filled with the pass of the evicted tag, if any
+ *  @param evicted_cnt set to 1 if a tag was evicted
+ *  @return slot of the tag, already set up if it is new
+ */
+static track_slot_t* __get_slot(uint8_t source, const tag_key_t* key, const uint8_t* epc, uint8_t epc_len, uint64_t now,
+                                uhf_pass_t* evicted, uint8_t* evicted_cnt)
+{
+    track_slot_t* free_slot = NULL;
+    track_slot_t* oldest = NULL;
+
+    for (uint8_t i = 0; i < UHF_TRACK_SLOTS; i++) {
+        track_slot_t* slot = &slots[i];
+        if (!slot->used) {
+            if (free_slot == NULL) free_slot = slot;
+            continue;
+        }
+        if (slot->source == source && tag_key_equal(&slot->key, key)) return slot;
+        if (oldest == NULL || slot->last_seen < oldest->last_seen) oldest = slot;
+    }
+
+    if (free_slot == NULL) {
+        __close_slot(oldest, evicted);
+        *evicted_cnt = 1;
+        free_slot = oldest;
+    }
+
+    memset(free_slot, 0, sizeof(*free_slot));
+    free_slot->used = 1;
+    free_slot->source = source;
+    free_slot->key = *key;
+    memcpy(free_slot->epc, epc, epc_len);
+    free_slot->epc_len = epc_len;
+    free_slot->first_seen = now;
+    return free_slot;
+}
+
+/**
+ *  @brief Add one inventory read to the tracker
+ *  @param tag tag report from the reader
+ *  @param source reader the tag was read by, the same EPC on two readers makes two passes
+ *  @param now time of the read (ms)
+ */
+void uhf_track_add(const uhf_tag_t* tag, uint8_t source, uint64_t now)
+{
+    uint8_t ant = tag->ant % UHF_TRACK_ANT_CNT;
+    uhf_pass_t evicted;
+    uint8_t evicted_cnt = 0;
+    tag_key_t key;
+    tag_key_make(&key, TAG_KEY_EPC, tag->epc, tag->epc_len);
+
+    pthread_mutex_lock(&track_lock);
+
+    track_slot_t* slot = __get_slot(source, &key, tag->epc, tag->epc_len, now, &evicted, &evicted_cnt);
+    track_sample_t* sample = &slot->samples[slot->head];
+    sample->time = now;
+    sample->rssi = tag->rssi;
+    sample->ant = ant;
+    slot->head = (slot->head + 1) % UHF_TRACK_SAMPLES;
+    if (slot->sample_cnt < UHF_TRACK_SAMPLES) slot->sample_cnt++;
+
+    slot->reads++;
+    slot->last_seen = now;
+
+    uint8_t rssi = __smoothed_rssi(slot, ant);
+    if (!slot->ant_peak_time[ant] || rssi > slot->ant_peak_rssi[ant]) {
+        slot->ant_peak_rssi[ant] = rssi;
+        slot->ant_peak_time[ant] = now;
+    }
+
+    pthread_mutex_unlock(&track_lock);
+
+    if (evicted_cnt && pass_handler != NULL) pass_handler(&evicted);
+}
+
+/**
+ *  @brief Emit the pass of every tag which has left the field
+ *  @param now current time (ms)
+ */
+void uhf_track_tick(uint64_t now)
+{
+    uhf_pass_t passes[UHF_TRACK_SLOTS];
+    uint8_t pass_cnt = 0;
+
+    pthread_mutex_lock(&track_lock);
+    for (uint8_t i = 0; i < UHF_TRACK_SLOTS; i++) {
+        // another reader may have seen the tag after now was read, before the lock
+        if (slots[i].used && slots[i].last_seen <= now && now - slots[i].last_seen >= leave_timeout)
+            __close_slot(&slots[i], &passes[pass_cnt++]);
+    }
+    pthread_mutex_unlock(&track_lock);
+
+    // publish outside of the lock, the handler may block on the network
+    for (uint8_t i = 0; i < pass_cnt; i++)
+        if (pass_handler != NULL) pass_handler(&passes[i]);
+}
+
+/**
+ *  @brief Direction as it is written in the pass event
+ */
+const char* uhf_track_dir_str(uint8_t direction)
+{
+    switch (direction) {
+        case UHF_DIR_IN:  return "in";
+        case UHF_DIR_OUT: return "out";
+        default:          return "unknown";
+    }
+}
+
+//--------------------------------------------------------------
+/**
+ * @brief Initialize the tracker
+ * @param leave_timeout_ms time without reads after which a tag has left (ms)
+ * @param handler called once per pass, from the thread calling uhf_track_add/uhf_track_tick
+*/
+void uhf_track_init(uint32_t leave_timeout_ms, uhf_pass_handler_t handler)
+{
+    pthread_mutex_lock(&track_lock);
+    memset(slots, 0, sizeof(slots));
+    leave_timeout = leave_timeout_ms;
+    pass_handler = handler;
+    pthread_mutex_unlock(&track_lock);
+}//end uhf_track_init
+
+//--------------------------------------------------------------
+#endif //__UHF_TRACK_C
@@ -0,0 +1,199 @@
+/** ------------------------------------------------------------*-
+ * UHF inventory auto-tuner - function file
+ * CheckinGate Project.
+ * (c) Minh-An Dao 2020
+ * version 1.00 - 19/10/2020
+ *--------------------------------------------------------------
+ * The IND8002 protocol (V2.38) has no command to set the Q value,
+ * the reader adapts Q by itself inside a round. What the host can
+ * choose per round is the session, the target inventoried flag
+ * (cmd_customized_session_target_inventory, 0x8B) and the number of
+ * repeats. The reader does not report collisions or empty slots
+ * either, so a round is judged by what it delivered: how many
+ * different tags it read per second.
+ *
+ * - Session: with a few tags in the field S0 is used, every tag
+ *   answers every round which keeps the RSSI series dense. Once the
+ *   tags per round go over UHF_TUNE_DENSE_TAGS, S1 is used and the
+ *   target alternates A/B: a tag which has answered is quiet in the
+ *   next round, so its slots go to the tags not read yet.
+ * - Repeat: hill climbing on the different tags per second, every
+ *   UHF_TUNE_EVAL_ROUNDS rounds the repeat value is doubled or halved,
+ *   kept if it did better and reverted (and the direction reversed)
+ *   if not. The best score decays so the climb keeps following the
+ *   population.
+ *
+ * Every change of setting is logged.
+ *
+ -------------------------------------------------------------- */
+#ifndef __UHF_TUNE_C
+#define __UHF_TUNE_C
+
+#include <stdio.h>
+#include <string.h>
+
+#include <uhf_tune.h>
+
+// ------ Private constants -----------------------------------
+#define DEFAULT_REPEAT  10
+#define MAX_REPEAT      255
+#define NO_TAG_ERROR    0x36
+
+//--------------------------------------------------------------
+// FUNCTION DEFINITIONS
+//--------------------------------------------------------------
+static void __log(const uhf_tune_t* t, const char* reason, uint32_t score)
+{
+    printf("UHF %d tune: S%d target %s repeat %d - %s (%u.%u tags/round, %u tags/s)\n",
+        t->id, t->session, t->session ? "A/B" : "A", t->repeat, reason,
+        t->population_x16 / 16, (t->population_x16 % 16) * 10 / 16, score);
+    fflush(stdout);
+}
+
+/**
+ *  @brief Switch between S0 and S1 dual-target from the tags per round
+ */
+static void __tune_session(uhf_tune_t* t, uint32_t score)
+{
+    uint32_t population = t->population_x16 / 16;
+    uint8_t session = t->session;
+
+    if (t->session == 0 && population >= UHF_TUNE_DENSE_TAGS) session = 1;
+    else if (t->session != 0 && population < UHF_TUNE_SPARSE_TAGS) session = 0;
+    if (session == t->session) return;
+
+    t->session = session;
+    t->target = 0;
+    t->eval_sum = t->eval_rounds = 0;
+    t->best_score = 0;
+    __log(t, session ? "dense population" : "sparse population", score);
+}
+
+/**
+ *  @brief Hill climbing step on the repeat value
+ */
+static void __tune_repeat(uhf_tune_t* t, uint32_t score)
+{
+    t->eval_sum += score;
+    if (++t->eval_rounds < UHF_TUNE_EVAL_ROUNDS) return;
+
+    uint32_t avg = t->eval_sum / t->eval_rounds;
+    uint8_t old_repeat = t->repeat;
+    uint8_t better = avg >= t->best_score;
+    t->eval_sum = t->eval_rounds = 0;
+
+    if (better) {
+        t->best_score = avg;
+        t->best_repeat = t->repeat;
+    } else {
+        t->step = -t->step;
+        t->repeat = t->best_repeat;
+    }
+    t->best_score -= t->best_score / 8; // forget slowly, the population moves
+
+    int next = t->step > 0 ? t->repeat * 2 : t->repeat / 2;
+    if (next < 1 || next > MAX_REPEAT) {
+        t->step = -t->step;
+        next = t->step > 0 ? t->repeat * 2 : t->repeat / 2;
+    }
+    if (next >= 1 && next <= MAX_REPEAT) t->repeat = next;
+
+    if (t->repeat != old_repeat) __log(t, better ? "climbing" : "reverted", avg);
+}
+
+/**
+ *  @brief Get the setting of the next round, if the previous round is over
+ *  @param t tuner of the reader
+ *  @param now current time (ms)
+ *  @param session set to the session to use
+ *  @param target set to the inventoried flag to use
+ *  @param repeat set to the number of repeats
+ *  @return 1 if a round can be started now, 0 if one is still running
+ */
+uint8_t uhf_tune_command(uhf_tune_t* t, uint64_t now, uint8_t* session, uint8_t* target, uint8_t* repeat)
+{
+    pthread_mutex_lock(&t->lock);
+    if (t->in_flight && now - t->round_start < UHF_TUNE_ROUND_TIMEOUT) {
+        pthread_mutex_unlock(&t->lock);
+        return 0;
+    }
+    if (t->in_flight) t->failed_rounds++; // end packet lost
+
+    *session = t->session;
+    *target = t->target;
+    *repeat = t->repeat;
+    if (t->session != 0) t->target ^= 1; // dual target
+
+    t->in_flight = 1;
+    t->round_start = now;
+    t->round_unique = 0;
+    pthread_mutex_unlock(&t->lock);
+    return 1;
+}
+
+/**
+ *  @brief Count a tag read in the current round
+ */
+void uhf_tune_tag(uhf_tune_t* t, const uhf_tag_t* tag)
+{
+    tag_key_t key;
+    tag_key_make(&key, TAG_KEY_EPC, tag->epc, tag->epc_len);
+
+    pthread_mutex_lock(&t->lock);
+    uint8_t i = 0;
+    while (i < t->round_unique && !tag_key_equal(&t->round_keys[i], &key)) i++;
+    if (i == t->round_unique && t->round_unique < UHF_TUNE_MAX_TAGS)
+        t->round_keys[t->round_unique++] = key;
+    pthread_mutex_unlock(&t->lock);
+}
+
+/**
+ *  @brief Judge the round which has just ended and tune the next ones
+ *  @param t tuner of the reader
+ *  @param round end packet of the round
+ *  @param now current time (ms)
+ */
+void uhf_tune_round_end(uhf_tune_t* t, const uhf_round_t* round, uint64_t now)
+{
+    pthread_mutex_lock(&t->lock);
+    if (!t->in_flight) {
+        pthread_mutex_unlock(&t->lock);
+        return;
+    }
+    t->in_flight = 0;
+    t->rounds++;
+
+    if (round->error && round->error != NO_TAG_ERROR) {
+        t->failed_rounds++;
+        pthread_mutex_unlock(&t->lock);
+        return;
+    }
+
+    uint64_t duration = now - t->round_start;
+    uint32_t score = t->round_unique * 1000 / (duration ? duration : 1);
+    int32_t delta = (int32_t)t->round_unique * 16 - (int32_t)t->population_x16;
+    t->population_x16 += delta / 4;
+
+    __tune_session(t, score);
+    __tune_repeat(t, score);
+    pthread_mutex_unlock(&t->lock);
+}
+
+//--------------------------------------------------------------
+/**
+ * @brief Initialize the tuner of one reader: S0, target A, 10 repeats
+ * @param t the tuner
+ * @param id reader source id, used in the log
+*/
+void uhf_tune_init(uhf_tune_t* t, uint8_t id)
+{
+    memset(t, 0, sizeof(*t));
+    pthread_mutex_init(&t->lock, NULL);
+    t->id = id;
+    t->repeat = DEFAULT_REPEAT;
+    t->best_repeat = DEFAULT_REPEAT;
+    t->step = 1;
+}//end uhf_tune_init
+
+//--------------------------------------------------------------
+#endif //__UHF_TUNE_C
@@ -0,0 +1,221 @@
+/** ------------------------------------------------------------*-
+ * Chafon UHF USB reader benchmark
+ * CheckinGate Project.
+ * (c) Minh-An Dao 2020
+ * version 1.00 - 19/10/2020
+ *--------------------------------------------------------------
+ * Callback mode against poll mode on the same reader and the same
+ * tags, one after the other:
+ *
+ * - Callback: CFHid_StartRead for -t seconds, every report the library
+ *   gives us is counted.
+ * - Poll: CFHid_InventoryG2 rounds back to back (or every -i ms) for -t
+ *   seconds, every answer decoded by cfuhf_decode() like cfuhf.c does.
+ *
+ * For each mode: reports/s, distinct EPCs seen, and the worst gap
+ * between two reads of a same tag, which bounds how late a badge
+ * walking in is seen. Poll mode also gives rounds/s and tags/round.
+ * Leave the badges still in the field during the whole run.
+ *
+ * -d prints the first answer in hex, and every one which does not
+ * frame as [len, x, x, EPC] records: the capture to check the record
+ * format of a firmware against.
+ *
+ * Usage: ./cfuhf_bench [-t seconds] [-i poll_interval_ms] [-d]
+ *
+ -------------------------------------------------------------- */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <CFHidApi.h>
+#include <cfuhf.h>
+
+// ------ Private constants -----------------------------------
+#define DEV_ADDR   0xFF
+#define TAGS_MAX   256  // distinct EPCs tracked
+#define EPC_MAX    (TAG_POOL_DATA_LEN - 3)
+
+// ------ Private types ---------------------------------------
+typedef struct {
+    uint8_t epc[EPC_MAX];
+    uint8_t epc_len;
+    uint64_t last;     // us, last read
+    uint64_t max_gap;  // us
+} seen_t;
+
+// ------ Private variables -----------------------------------
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static seen_t seen[TAGS_MAX];
+static int seen_cnt;
+static uint64_t reports;
+static int seconds = 10;
+static int poll_interval = 0;
+static int dump = 0;          // -d
+
+//--------------------------------------------------------------
+// FUNCTION DEFINITIONS
+//--------------------------------------------------------------
+static uint64_t __now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void __reset(void)
+{
+    pthread_mutex_lock(&lock);
+    seen_cnt = 0;
+    reports = 0;
+    pthread_mutex_unlock(&lock);
+}
+
+/**
+ *  @brief Count one report [len, x, x, EPC]
+ */
+static void __count(const uint8_t* data, int len)
+{
+    if (len < 4 || data[0] < 4 || data[0] > len) return;
+    uint8_t epc_len = data[0] - 3;
+    uint64_t now = __now_us();
+
+    pthread_mutex_lock(&lock);
+    reports++;
+    int i;
+    for (i = 0; i < seen_cnt; i++)
+        if (seen[i].epc_len == epc_len && !memcmp(seen[i].epc, data + 3, epc_len)) break;
+    if (i == seen_cnt && seen_cnt < TAGS_MAX) {
+        memcpy(seen[i].epc, data + 3, epc_len);
+        seen[i].epc_len = epc_len;
+        seen[i].last = now;
+        seen[i].max_gap = 0;
+        seen_cnt++;
+    } else if (i < seen_cnt) {
+        if (now - seen[i].last > seen[i].max_gap) seen[i].max_gap = now - seen[i].last;
+        seen[i].last = now;
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+static void __callback(int msg, int tag_num, unsigned char* tag_data, int tag_data_len, unsigned char* devsn)
+{
+    (void)tag_num;
+    (void)devsn;
+    if (msg == 2) __count(tag_data, tag_data_len);
+}
+
+static void __poll_tag(const tag_slot_t* slot)
+{
+    __count(slot->data, slot->len);
+}
+
+static void __report(const char* mode, uint64_t elapsed_us)
+{
+    uint64_t worst = 0;
+    pthread_mutex_lock(&lock);
+    for (int i = 0; i < seen_cnt; i++)
+        if (seen[i].max_gap > worst) worst = seen[i].max_gap;
+    printf("%-9s %8.1f reports/s  %4d tags  worst gap %6.1f ms\n", mode,
+           reports * 1e6 / elapsed_us, seen_cnt, worst / 1e3);
+    pthread_mutex_unlock(&lock);
+    fflush(stdout);
+}
+
+static void __bench_callback(void)
+{
+    __reset();
+    CFHid_SetCallback(__callback);
+    uint64_t start = __now_us();
+    if (!CFHid_StartRead(DEV_ADDR)) {
+        printf("callback: StartRead failed\n");
+        return;
+    }
+    sleep(seconds);
+    CFHid_StopRead(DEV_ADDR);
+    __report("callback", __now_us() - start);
+    usleep(200000); // let the last reports drain before the next mode
+}
+
+/**
+ *  @brief Print an InventoryG2 answer in hex, to check its records against CFUHF_REC_HDR_LEN
+ */
+static void __dump(const uint8_t* buf, uint16_t len, uint16_t cnt)
+{
+    printf("answer, %u records, %u bytes:", cnt, len);
+    for (uint16_t i = 0; i < len; i++) printf(" %02X", buf[i]);
+    printf("\n");
+}
+
+static void __bench_poll(void)
+{
+    static uint8_t buf[CFUHF_POLL_BUF_LEN];
+    uint16_t len, cnt, used;
+    uint32_t rounds = 0, errors = 0, bad = 0, tags = 0;
+
+    __reset();
+    uint64_t start = __now_us(), end = start + (uint64_t)seconds * 1000000;
+    for (uint64_t now = start; now < end; now = __now_us()) {
+        len = sizeof(buf);
+        cnt = 0;
+        rounds++;
+        if (CFHid_InventoryG2(DEV_ADDR, buf, &len, &cnt)) {
+            if (len > sizeof(buf)) len = 0;
+            uint16_t n = cfuhf_decode(buf, len, cnt, 0, 0, __poll_tag, &used);
+            tags += n;
+            uint8_t framed = n == cnt && used == len;
+            if (!framed) bad++;
+            if (dump && (!framed || rounds == 1)) __dump(buf, len, cnt);
+        } else
+            errors++;
+        uint64_t spent = (__now_us() - now) / 1000;
+        if (poll_interval && spent < (uint64_t)poll_interval) usleep((poll_interval - spent) * 1000);
+    }
+    uint64_t elapsed = __now_us() - start;
+    __report("poll", elapsed);
+    printf("          %8.1f rounds/s   %6.1f tags/round  %u failed rounds, %u not framed\n",
+           rounds * 1e6 / elapsed, rounds ? (double)tags / rounds : 0.0, errors, bad);
+    fflush(stdout);
+}
+
+static void __show_usage(const char* name)
+{
+    printf("\nHow to use:\n");
+    printf("\n\t%s [-t seconds] [-i poll_interval_ms] [-d]\n\n", name);
+    printf("With:\n");
+    printf("\t-t seconds: length of each mode (default %d)\n", seconds);
+    printf("\t-i poll_interval_ms: from the start of a round to the next, 0 = back to back (default %d)\n", poll_interval);
+    printf("\t-d: print the first answer, and the ones which do not frame, in hex\n\n");
+    fflush(stdout);
+}
+
+int main(int argc, char** argv)
+{
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:i:dh")) != -1) {
+        switch (opt) {
+            case 't': seconds = atoi(optarg); break;
+            case 'i': poll_interval = atoi(optarg); break;
+            case 'd': dump = 1; break;
+            default: __show_usage(argv[0]); return 1;
+        }
+    }
+    if (seconds < 1 || poll_interval < 0) {
+        __show_usage(argv[0]);
+        return 1;
+    }
+    if (!CFHid_OpenDevice()) {
+        fprintf(stderr, "No CFHid reader\n");
+        return 1;
+    }
+
+    __bench_callback();
+    __bench_poll();
+
+    CFHid_CloseDevice();
+    return 0;
+}
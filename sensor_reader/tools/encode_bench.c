@@ -0,0 +1,211 @@
+/** ------------------------------------------------------------*-
+ * Encoding benchmark
+ * CheckinGate Project.
+ * (c) Minh-An Dao 2020
+ * version 1.00 - 19/10/2020
+ *--------------------------------------------------------------
+ * Compare encode.c with the printf based code it replaced: EPC to
+ * hex, timestamp to decimal, and a whole UHF pass event (data string
+ * and JSON message) as built by uhf_pass_handler() and
+ * format_message(). Then the same event in CBOR (MESSAGE_ENCODING):
+ * bytes on the wire and ns/event against JSON.
+ *
+ * Usage: ./encode_bench [-n iterations]
+ *
+ -------------------------------------------------------------- */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <encode.h>
+
+// ------ Private variables -----------------------------------
+static volatile size_t sink; // keeps the compiler from dropping the work
+
+static const uint8_t epc[12] = {0xE2, 0x00, 0xC0, 0xDE, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x2A};
+static uint8_t user[64];
+static const uint64_t timestamp = 1603094400123ull;
+
+//--------------------------------------------------------------
+// FUNCTION DEFINITIONS
+//--------------------------------------------------------------
+static uint64_t __now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// ------ printf based, as before encode.c --------------------
+static size_t __hex_printf(char* out, const uint8_t* in, size_t n)
+{
+    char* p = out;
+    for (size_t i = 0; i < n; i++) p += sprintf(p, "%02X", in[i]);
+    return p - out;
+}
+
+static size_t __u64_printf(char* out, uint64_t v)
+{
+    return snprintf(out, 32, "%llu", (unsigned long long)v);
+}
+
+static size_t __event_printf(char* out, uint64_t t)
+{
+    char epc_hex[25], data[150];
+    __hex_printf(epc_hex, epc, sizeof(epc));
+    snprintf(data, 150, "tag_id:0x%s,dir:%s,rssi:%d,ant:%d,reads:%d,dwell:%llu",
+        epc_hex, "in", -45, 1, 37, 1250ull);
+    return snprintf(out, 400,
+        "{"
+            "\"timestamp\":%llu,"
+            "\"event_type\":\"%s\","
+            "\"source\":\"%s\","
+            "\"data\":\"%s\""
+        "}",
+        (unsigned long long)t, "rfid", "rfid.3", data);
+}
+
+// ------ encode.c --------------------------------------------
+static size_t __hex_encode(char* out, const uint8_t* in, size_t n)
+{
+    return encode_hex_raw(out, in, n) - out;
+}
+
+static size_t __u64_encode(char* out, uint64_t v)
+{
+    return encode_u64_raw(out, v) - out;
+}
+
+static void __pass_data(char* data, size_t data_len)
+{
+    encode_buf_t b;
+    encode_init(&b, data, data_len);
+    encode_str(&b, "tag_id:0x");
+    encode_hex(&b, epc, sizeof(epc));
+    encode_str(&b, ",dir:in,rssi:");
+    encode_i64(&b, -45);
+    encode_str(&b, ",ant:");
+    encode_u64(&b, 1);
+    encode_str(&b, ",reads:");
+    encode_u64(&b, 37);
+    encode_str(&b, ",dwell:");
+    encode_u64(&b, 1250);
+}
+
+static size_t __event_encode(char* out, uint64_t t)
+{
+    char data[150];
+    __pass_data(data, sizeof(data));
+
+    encode_buf_t m;
+    encode_init(&m, out, 400);
+    encode_json_begin(&m);
+    encode_json_u64(&m, "timestamp", t);
+    encode_json_str(&m, "event_type", "rfid");
+    encode_json_str(&m, "source", "rfid.3");
+    encode_json_str(&m, "data", data);
+    encode_json_end(&m);
+    return m.len;
+}
+
+static size_t __event_cbor(char* out, uint64_t t)
+{
+    char data[150];
+    __pass_data(data, sizeof(data));
+
+    encode_buf_t m;
+    encode_init(&m, out, 400);
+    encode_cbor_tag(&m, 55799);
+    encode_cbor_map(&m, 6);
+    encode_cbor_u64(&m, 0);
+    encode_cbor_u64(&m, 1);
+    encode_cbor_u64(&m, 1);
+    encode_cbor_u64(&m, t);
+    encode_cbor_u64(&m, 2);
+    encode_cbor_text(&m, "rfid");
+    encode_cbor_u64(&m, 3);
+    encode_cbor_text(&m, "rfid.3");
+    encode_cbor_u64(&m, 4);
+    encode_cbor_text(&m, data);
+    encode_cbor_u64(&m, 5);
+    encode_cbor_u64(&m, 0);
+    return m.len;
+}
+
+//--------------------------------------------------------------
+static double __bench_hex(size_t (*f)(char*, const uint8_t*, size_t), const uint8_t* in, size_t n, int iterations)
+{
+    char out[256];
+    uint64_t start = __now_ns();
+    for (int i = 0; i < iterations; i++) sink += f(out, in, n);
+    return (double)(__now_ns() - start) / iterations;
+}
+
+static double __bench_u64(size_t (*f)(char*, uint64_t), int iterations)
+{
+    char out[32];
+    uint64_t start = __now_ns();
+    for (int i = 0; i < iterations; i++) sink += f(out, timestamp + i);
+    return (double)(__now_ns() - start) / iterations;
+}
+
+static double __bench_event(size_t (*f)(char*, uint64_t), int iterations)
+{
+    char out[400];
+    uint64_t start = __now_ns();
+    for (int i = 0; i < iterations; i++) sink += f(out, timestamp + i);
+    return (double)(__now_ns() - start) / iterations;
+}
+
+static void __row(const char* name, double before, double after)
+{
+    printf("%-22s %10.1f %10.1f %8.1fx\n", name, before, after, before / after);
+}
+
+int main(int argc, char** argv)
+{
+    int iterations = 1000000;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:h")) != -1) {
+        switch (opt) {
+            case 'n': iterations = atoi(optarg); break;
+            default:
+                printf("Usage: %s [-n iterations]\n", argv[0]);
+                return 1;
+        }
+    }
+    for (size_t i = 0; i < sizeof(user); i++) user[i] = i * 37;
+
+    // both sides must produce the same text
+    char a[400], b[400];
+    a[__event_printf(a, timestamp)] = '\0';
+    b[__event_encode(b, timestamp)] = '\0';
+    if (strcmp(a, b)) {
+        printf("Output differs:\n%s\n%s\n", a, b);
+        return 1;
+    }
+
+#if defined(__SSSE3__)
+    printf("hex kernel: SSSE3\n");
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    printf("hex kernel: NEON\n");
+#else
+    printf("hex kernel: table\n");
+#endif
+    printf("%-22s %10s %10s %9s\n", "ns/op", "printf", "encode", "speedup");
+    __row("hex, 12 byte EPC", __bench_hex(__hex_printf, epc, sizeof(epc), iterations),
+                              __bench_hex(__hex_encode, epc, sizeof(epc), iterations));
+    __row("hex, 64 byte USER", __bench_hex(__hex_printf, user, sizeof(user), iterations),
+                               __bench_hex(__hex_encode, user, sizeof(user), iterations));
+    __row("u64, timestamp", __bench_u64(__u64_printf, iterations), __bench_u64(__u64_encode, iterations));
+    __row("UHF pass event", __bench_event(__event_printf, iterations), __bench_event(__event_encode, iterations));
+
+    size_t json_len = __event_encode(a, timestamp), cbor_len = __event_cbor(b, timestamp);
+    printf("\n%-22s %10s %10s %9s\n", "UHF pass event", "JSON", "CBOR", "ratio");
+    __row("bytes", json_len, cbor_len);
+    __row("ns/event", __bench_event(__event_encode, iterations), __bench_event(__event_cbor, iterations));
+    return 0;
+}
@@ -0,0 +1,187 @@
+/** ------------------------------------------------------------*-
+ * Serial backend benchmark
+ * CheckinGate Project.
+ * (c) Minh-An Dao 2020
+ * version 1.00 - 19/10/2020
+ *--------------------------------------------------------------
+ * Measure frame latency and throughput of serial.c for several
+ * VMIN/VTIME settings and baud rates, over a pseudo-terminal pair
+ * so no reader needs to be attached.
+ *
+ * A writer thread plays the reader: it sends real-time inventory
+ * packets on the master side, paced at the line rate of the baud
+ * rate under test (a pty itself has no line rate), with the send
+ * time stamped into the EPC. The main thread reads the packets the
+ * same way uhf.c does and measures the delay of every packet.
+ *
+ * Usage: ./serial_bench [-n packets] [-b baudrate]
+ *
+ -------------------------------------------------------------- */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <termios.h>
+
+#include <serial.h>
+
+// ------ Private constants -----------------------------------
+#define HEADER        0xA0
+#define PACKET_LEN    21 // real-time inventory packet with a 12 bytes EPC
+#define FRAME_TIMEOUT 50 // ms
+
+// ------ Private types ---------------------------------------
+typedef struct {
+    int master;
+    uint32_t baudrate;
+    int packets;
+} writer_arg_t;
+
+// ------ Private variables -----------------------------------
+static const serial_opts_t settings[] = {
+    {1, 0, 1},  // wake up for every byte
+    {8, 1, 1},  // batch 8 bytes, 100 ms inter-byte timeout
+    {PACKET_LEN, 1, 1}, // one packet per read()
+    {1, 0, 0},  // low latency off
+};
+static const uint32_t baudrates[] = {115200, 460800, 921600, 3000000};
+
+//--------------------------------------------------------------
+// FUNCTION DEFINITIONS
+//--------------------------------------------------------------
+static uint64_t __now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint8_t __checksum(const uint8_t* buf, uint8_t len)
+{
+    uint8_t cs = 0;
+    for (uint8_t i = 0; i < len; i++) cs += buf[i];
+    return ~cs + 1;
+}
+
+static int __cmp_u64(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ *  @brief Play the reader: send stamped packets paced at the line rate
+ */
+static void* __writer_thread(void* arg)
+{
+    writer_arg_t* w = (writer_arg_t*)arg;
+    uint8_t pkt[PACKET_LEN];
+    uint64_t pkt_ns = (uint64_t)PACKET_LEN * 10 * 1000000000ull / w->baudrate; // 8N1: 10 bits/byte
+    uint64_t next = __now_ns();
+
+    for (int i = 0; i < w->packets; i++) {
+        while (__now_ns() < next) ;
+        next += pkt_ns;
+
+        uint64_t ts = __now_ns();
+        pkt[0] = HEADER;
+        pkt[1] = PACKET_LEN - 2;
+        pkt[2] = 0x01;
+        pkt[3] = 0x89;
+        pkt[4] = 0x00;
+        pkt[5] = 0x30; pkt[6] = 0x00;
+        memcpy(pkt + 7, &ts, sizeof(ts));
+        memset(pkt + 15, 0xE2, 4);
+        pkt[19] = 0x50;
+        pkt[20] = __checksum(pkt, PACKET_LEN - 1);
+        serial_write(w->master, pkt, PACKET_LEN);
+    }
+    return NULL;
+}
+
+/**
+ *  @brief Run one setting and print one result line
+ */
+static void __run(const char* slave_name, int master, uint32_t baudrate, const serial_opts_t* opts, int packets)
+{
+    uint64_t* latency = (uint64_t*)malloc(sizeof(uint64_t) * packets);
+    uint8_t pkt[256];
+    int fd = serial_open(slave_name, baudrate, opts);
+    int got = 0, bad = 0;
+
+    if (fd < 0 || latency == NULL) {
+        perror("serial_open");
+        free(latency);
+        return;
+    }
+
+    pthread_t tid;
+    writer_arg_t w = {master, baudrate, packets};
+    uint64_t start = __now_ns();
+    pthread_create(&tid, NULL, __writer_thread, &w);
+
+    while (got + bad < packets) {
+        if (serial_wait(fd, 1000) <= 0) break;
+        if (serial_read(fd, pkt, 2, FRAME_TIMEOUT) != 2 || pkt[0] != HEADER) { bad++; continue; }
+        if (serial_read(fd, pkt + 2, pkt[1], FRAME_TIMEOUT) != pkt[1]) { bad++; continue; }
+
+        uint64_t now = __now_ns(), ts;
+        memcpy(&ts, pkt + 7, sizeof(ts));
+        latency[got++] = now - ts;
+    }
+    uint64_t elapsed = __now_ns() - start;
+    pthread_join(tid, NULL);
+    serial_close(fd);
+
+    qsort(latency, got, sizeof(uint64_t), __cmp_u64);
+    printf("%8u  %4u  %5u  %3u  %8d  %10.0f  %8.1f  %8.1f  %8.1f  %d\n",
+        baudrate, opts->vmin, opts->vtime, opts->low_latency, got,
+        got * 1e9 / elapsed,
+        got ? latency[got / 2] / 1e3 : 0.0,
+        got ? latency[(got * 99) / 100] / 1e3 : 0.0,
+        got ? latency[got - 1] / 1e3 : 0.0,
+        bad);
+    free(latency);
+}
+
+int main(int argc, char** argv)
+{
+    int packets = 20000;
+    uint32_t only_baudrate = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:b:h")) != -1) {
+        switch (opt) {
+            case 'n': packets = atoi(optarg); break;
+            case 'b': only_baudrate = atoi(optarg); break;
+            default:
+                printf("Usage: %s [-n packets] [-b baudrate]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master < 0 || grantpt(master) < 0 || unlockpt(master) < 0) {
+        perror("posix_openpt");
+        return 1;
+    }
+    struct termios raw;
+    tcgetattr(master, &raw);
+    cfmakeraw(&raw);
+    tcsetattr(master, TCSANOW, &raw);
+    const char* slave_name = ptsname(master);
+
+    printf("    baud  vmin  vtime  low   packets   packets/s  p50 (us)  p99 (us)  max (us)  bad\n");
+    for (size_t b = 0; b < sizeof(baudrates)/sizeof(baudrates[0]); b++) {
+        if (only_baudrate && baudrates[b] != only_baudrate) continue;
+        for (size_t s = 0; s < sizeof(settings)/sizeof(settings[0]); s++)
+            __run(slave_name, master, baudrates[b], &settings[s], packets);
+    }
+
+    close(master);
+    return 0;
+}
@@ -0,0 +1,177 @@
+/** ------------------------------------------------------------*-
+ * Message spool recovery check
+ * CheckinGate Project.
+ * (c) Minh-An Dao 2020
+ * version 1.00 - 19/10/2020
+ *--------------------------------------------------------------
+ * Crashes of the publisher simulated on a small spool, each followed
+ * by a spool_open() of the same file, as after a restart:
+ *
+ * - Torn head: the ring is full, every append drops the oldest
+ *   records, and the bytes of the record the head was on are torn
+ *   right after. Recovery must find the header past them and keep the
+ *   whole backlog, not start empty.
+ * - Torn tail: the last record is torn. Recovery keeps every record
+ *   before it.
+ * - Lanes: records of three lanes given out a lane at a time and
+ *   acked out of order. Only the records older than every one not
+ *   acked are trimmed, and a rewind gives out none that is acked.
+ *
+ * Every record kept must be intact and in order. Prints one line per
+ * case, exits with 1 if one fails.
+ *
+ * Usage: ./spool_check [file]
+ *
+ -------------------------------------------------------------- */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <spool.h>
+
+// ------ Private constants -----------------------------------
+#define RING_SIZE   (64 * 1024) // bytes, a few hundred records
+#define COMMIT_EVERY 10         // appends between two commits, like a batch taken from the queue
+
+// ------ Private variables -----------------------------------
+static const char* path = "/tmp/spool_check.bin";
+static uint32_t counter;       // body of the next record
+
+//--------------------------------------------------------------
+// FUNCTION DEFINITIONS
+//--------------------------------------------------------------
+static void __append(spool_t* sp, uint8_t lane)
+{
+    static msg_t msg;
+    msg.body_len = snprintf(msg.body, sizeof(msg.body), "{\"data\":\"%u\",\"pad\":\"%0100u\"}", counter, counter);
+    strcpy(msg.exchange, "ex");
+    strcpy(msg.routing_key, "event.pir.3");
+    msg.queued = counter;
+    msg.lane = lane;
+    counter++;
+    spool_append(sp, &msg);
+}
+
+/**
+ *  @brief Walk the records of a reopened spool
+ *  @return records read, all intact and following each other, -1 if one is not
+ */
+static int __walk(spool_t* sp)
+{
+    spool_rec_t rec;
+    int n = 0;
+    uint64_t prev = 0;
+
+    while (spool_next(sp, 0, &rec)) {
+        unsigned int data;
+        if (sscanf(rec.body, "{\"data\":\"%u\"", &data) != 1 || data != rec.queued) return -1;
+        if (n && rec.queued != prev + 1) return -1;
+        prev = rec.queued;
+        n++;
+    }
+    return n;
+}
+
+static uint8_t __report(const char* name, uint8_t ok, int kept, uint32_t pending)
+{
+    printf("%-10s %s: %d records kept out of %u\n", name, ok ? "ok" : "FAILED", kept, pending);
+    fflush(stdout);
+    return ok ? 0 : 1;
+}
+
+/**
+ *  @brief The record at the head is overwritten by appends to a full ring, then torn
+ */
+static uint8_t __torn_head(void)
+{
+    spool_t sp, after;
+
+    unlink(path);
+    counter = 0;
+    if (spool_open(&sp, path, RING_SIZE)) return __report("torn head", 0, 0, 0);
+    uint32_t appended = 0;
+    while (sp.dropped < 3 * RING_SIZE / 200) { // wrap a few times: the long outage
+        __append(&sp, 0);
+        if (++appended % COMMIT_EVERY == 0) spool_commit(&sp);
+    }
+    spool_commit(&sp);
+
+    uint32_t dropped = sp.dropped, old_head = sp.head;
+    while (sp.dropped == dropped) __append(&sp, 0); // the next drop, not committed
+    memset(sp.ring + old_head, 0xA5, 64);         // crash while its bytes are written
+
+    uint32_t pending = spool_pending(&sp);
+    spool_open(&after, path, RING_SIZE);
+    int kept = __walk(&after);
+    return __report("torn head", kept > 0 && (uint32_t)kept + 1 >= pending, kept, pending);
+}
+
+/**
+ *  @brief The last record appended is torn
+ */
+static uint8_t __torn_tail(void)
+{
+    spool_t sp, after;
+
+    unlink(path);
+    counter = 0;
+    if (spool_open(&sp, path, RING_SIZE)) return __report("torn tail", 0, 0, 0);
+    for (int i = 0; i < 100; i++) __append(&sp, 0);
+    spool_commit(&sp);
+    uint32_t last = sp.tail;
+    __append(&sp, 0);
+    sp.ring[last + 20] ^= 0xFF; // one byte of its header
+
+    uint32_t pending = spool_pending(&sp);
+    spool_open(&after, path, RING_SIZE);
+    int kept = __walk(&after);
+    return __report("torn tail", kept == (int)pending - 1, kept, pending);
+}
+
+/**
+ *  @brief Give out and ack every record of a lane
+ *  @return records given out, -1 if one is of another lane or out of order
+ */
+static int __drain(spool_t* sp, uint8_t lane)
+{
+    spool_rec_t rec;
+    int n = 0;
+    uint64_t prev = 0;
+
+    while (spool_next(sp, lane, &rec)) {
+        if (rec.lane != lane || rec.queued % 3 != lane || (n && rec.queued <= prev)) return -1;
+        prev = rec.queued;
+        spool_ack(sp, rec.seq);
+        n++;
+    }
+    return n;
+}
+
+/**
+ *  @brief Lanes given out one after the other, acks out of order
+ */
+static uint8_t __lanes(void)
+{
+    spool_t sp;
+
+    unlink(path);
+    counter = 0;
+    if (spool_open(&sp, path, RING_SIZE)) return __report("lanes", 0, 0, 0);
+    for (int i = 0; i < 30; i++) __append(&sp, i % 3);
+
+    uint8_t ok = __drain(&sp, 1) == 10 && spool_pending(&sp) == 30;  // the oldest record is not acked
+    ok &= __drain(&sp, 0) == 10 && spool_pending(&sp) == 28;         // trimmed up to the first of lane 2
+    spool_rewind(&sp);
+    ok &= spool_unsent(&sp) == 10 && spool_lane_unsent(&sp, 2) == 10; // nothing acked given out again
+    ok &= __drain(&sp, 0) == 0 && __drain(&sp, 2) == 10 && spool_pending(&sp) == 0;
+    return __report("lanes", ok, 30 - spool_pending(&sp), 30);
+}
+
+int main(int argc, char** argv)
+{
+    if (argc > 1) path = argv[1];
+    uint8_t failed = __torn_head() | __torn_tail() | __lanes();
+    unlink(path);
+    return failed;
+}
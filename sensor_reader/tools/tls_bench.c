@@ -0,0 +1,150 @@
+/** ------------------------------------------------------------*-
+ * TLS handshake benchmark
+ * CheckinGate Project.
+ * (c) Minh-An Dao 2020
+ * version 1.00 - 19/10/2020
+ *--------------------------------------------------------------
+ * Cost of a reconnect over TLS with and without session resumption,
+ * through tls.c and the SSL socket of rabbitmq-c like the publisher:
+ *
+ * - Full: the session is dropped before every connection.
+ * - Resumed: every connection offers the session of the one before.
+ *
+ * Every connection opens the socket (TCP connect and handshake, the
+ * part measured, wall clock and CPU time of the process), logs in
+ * (which also takes the TLS 1.3 session tickets off the socket) and
+ * closes. Run it on the Pi against a local broker with a TLS
+ * listener, e.g. RabbitMQ on 5671.
+ *
+ * Usage: ./tls_bench [-b host:port] [-c cacert] [-k] [-n connections] [-u user] [-p password]
+ *
+ -------------------------------------------------------------- */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <amqp.h>
+#include <amqp_ssl_socket.h>
+#include <tls.h>
+
+// ------ Private variables -----------------------------------
+static char host[64] = "localhost";
+static int port = 5671;
+static const char* cacert = NULL;
+static uint8_t verify = 1;
+static int connections = 50;
+static const char* user = "guest";
+static const char* password = "guest";
+
+//--------------------------------------------------------------
+// FUNCTION DEFINITIONS
+//--------------------------------------------------------------
+static uint64_t __now_ns(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ *  @brief Connect, log in and close, connections times
+ *  @param resume offer the session of the previous connection
+ *  @return 0 if every connection was made
+ */
+static int __bench(const char* mode, uint8_t resume)
+{
+    tls_t t;
+    uint64_t wall_sum = 0, wall_max = 0, cpu_sum = 0;
+    uint32_t resumed = 0, logins = 0;
+    struct timeval timeout = {5, 0};
+
+    if (tls_init(&t, cacert, verify)) {
+        printf("No TLS context, check %s\n", cacert ? cacert : "the system CA certificates");
+        return 1;
+    }
+    for (int i = 0; i < connections; i++) {
+        if (!resume) tls_forget(&t);
+        amqp_connection_state_t conn = amqp_new_connection();
+        amqp_socket_t* socket = tls_socket(&t, conn);
+        if (socket == NULL) {
+            printf("%s: no socket\n", mode);
+            return 1;
+        }
+
+        uint64_t wall = __now_ns(CLOCK_MONOTONIC), cpu = __now_ns(CLOCK_PROCESS_CPUTIME_ID);
+        int status = amqp_socket_open_noblock(socket, host, port, &timeout);
+        cpu = __now_ns(CLOCK_PROCESS_CPUTIME_ID) - cpu;
+        wall = __now_ns(CLOCK_MONOTONIC) - wall;
+        if (status) {
+            printf("%s: cannot open %s:%d: %s\n", mode, host, port, amqp_error_string2(status));
+            amqp_destroy_connection(conn);
+            return 1;
+        }
+        if (amqp_ssl_socket_session_reused(socket)) resumed++;
+        wall_sum += wall;
+        cpu_sum += cpu;
+        if (wall > wall_max) wall_max = wall;
+
+        if (amqp_login(conn, "/", 0, 131072, 0, AMQP_SASL_METHOD_PLAIN, user, password).reply_type == AMQP_RESPONSE_NORMAL) {
+            logins++;
+            amqp_connection_close(conn, AMQP_REPLY_SUCCESS);
+        }
+        amqp_destroy_connection(conn);
+    }
+
+    printf("%-8s %5d %8u %10.2f %10.2f %10.2f %7u\n", mode, connections, resumed,
+           wall_sum / 1e6 / connections, wall_max / 1e6, cpu_sum / 1e6 / connections, logins);
+    fflush(stdout);
+    return 0;
+}
+
+static void __show_usage(const char* name)
+{
+    printf("\nHow to use:\n");
+    printf("\n\t%s [-b host:port] [-c cacert] [-k] [-n connections] [-u user] [-p password]\n\n", name);
+    printf("With:\n");
+    printf("\t-b host:port: broker with a TLS listener (default %s:%d)\n", host, port);
+    printf("\t-c cacert: CA certificates of the broker, PEM (default: the system ones)\n");
+    printf("\t-k: accept any certificate\n");
+    printf("\t-n connections: per mode (default %d)\n", connections);
+    printf("\t-u user, -p password: login (default %s/%s)\n\n", user, password);
+    fflush(stdout);
+}
+
+int main(int argc, char** argv)
+{
+    int opt;
+
+    while ((opt = getopt(argc, argv, "b:c:kn:u:p:h")) != -1) {
+        switch (opt) {
+            case 'b': {
+                const char* colon = strchr(optarg, ':');
+                size_t len = colon ? (size_t)(colon - optarg) : strlen(optarg);
+                if (len == 0 || len >= sizeof(host)) {
+                    __show_usage(argv[0]);
+                    return 1;
+                }
+                memcpy(host, optarg, len);
+                host[len] = '\0';
+                if (colon) port = atoi(colon + 1);
+                break;
+            }
+            case 'c': cacert = optarg; break;
+            case 'k': verify = 0; break;
+            case 'n': connections = atoi(optarg); break;
+            case 'u': user = optarg; break;
+            case 'p': password = optarg; break;
+            default: __show_usage(argv[0]); return 1;
+        }
+    }
+    if (connections < 1) {
+        __show_usage(argv[0]);
+        return 1;
+    }
+
+    printf("%-8s %5s %8s %10s %10s %10s %7s\n", "mode", "conns", "resumed", "avg ms", "max ms", "cpu ms", "logins");
+    if (__bench("full", 0) || __bench("resumed", 1)) return 1;
+    return 0;
+}
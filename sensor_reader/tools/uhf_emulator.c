@@ -0,0 +1,683 @@
+/** ------------------------------------------------------------*-
+ * IND8002 reader emulator
+ * CheckinGate Project.
+ * (c) Minh-An Dao 2020
+ * version 1.00 - 19/10/2020
+ *--------------------------------------------------------------
+ * Expose a pseudo-terminal which speaks the IND8002 (YR8001) serial
+ * protocol, so uhf.c and the whole publishing pipeline can be run and
+ * stress-tested on any Linux box without the reader on /dev/serial0.
+ *
+ * - Tag population: -t tags walk through the gate one after another,
+ *   in groups of -g tags (a crowd), each pass lasts -d ms. The RSSI rises to a peak in the middle of
+ *   the pass and falls again; antenna 0 sees the first half and
+ *   antenna 1 the second half (reversed for every other tag, so both
+ *   directions show up). -f makes a share of the tags foreign ones.
+ * - Command mode (default): packets are sent for cmd_real_time_inventory
+ *   (0x89) rounds. cmd_read (0x81), cmd_write (0x82), access EPC match
+ *   (0x85), reset, mode and buzzer commands are answered too, a write
+ *   takes as long as on a real tag.
+ * - Sessions: cmd_customized_session_target_inventory (0x8B) rounds
+ *   model the anti-collision: only the tags whose inventoried flag
+ *   matches the target answer, a crowded field is singulated a few tags
+ *   per inventory, and a read tag flips its flag in S1-S3 (back to A
+ *   after the session persistence time). Rounds take longer with more
+ *   repeats and more tags, so session/repeat tuning can be measured.
+ * - Continuous mode (-c): tag packets are streamed at -r packets/s
+ *   without any command, up to thousands per second.
+ * - Tag masks: cmd_tag_mask (0x98) masks on the EPC hide the tags
+ *   which match none of them from every inventory. -m answers the
+ *   command with an error instead, like a reader without mask support.
+ * - Faults: -e error packets, -x corrupted checksums, -n noise bytes
+ *   between packets, each given as a ratio of the packets sent.
+ *
+ * Usage: ./uhf_emulator [-l link] [-t tags] [-g group] [-d pass_ms] [-r rate] [-c]
+ *                       [-e ratio] [-x ratio] [-n ratio] [-f ratio] [-m] [-s seed]
+ *
+ * The pty path is printed on start, -l also makes a symlink to it.
+ *
+ -------------------------------------------------------------- */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+
+// ------ Private constants -----------------------------------
+#define HEADER            0xA0
+#define READER_ADDRESS    0x01
+
+#define RESET_CMD         0x70
+#define READ_CMD          0x81
+#define WRITE_CMD         0x82
+#define ACCESS_MATCH_CMD  0x85
+#define TAG_MASK_CMD      0x98
+#define RT_INVENTORY_CMD  0x89
+#define SESSION_INV_CMD   0x8B
+#define BUZZER_CMD        0x7A
+#define MODE_CMD          0xA0
+
+#define COMMAND_SUCCESS   0x10
+#define COMMAND_FAIL      0x11
+#define TAG_INV_ERROR     0x31
+#define NO_TAG_ERROR      0x36
+#define PARAM_INVALID     0x41
+
+#define EPC_LEN           12
+#define MASK_CNT          5
+#define EPC_BIT_OFFSET    0x20 // EPC membank: CRC, PC, then the EPC
+#define TID_LEN           12
+#define USER_LEN          64
+#define MAX_TAGS          10000
+#define PEAK_RSSI         0x5A // -39 dBm
+#define EDGE_RSSI         0x32 // -79 dBm
+
+#define SLOT_US           300  // one anti-collision slot
+#define ROUND_SETUP_US    4000 // carrier and Query setup of a round
+#define REPLY_SLOTS       3.0  // tags singulated per inventory, on average, when crowded
+#define WRITE_WORD_US     2500 // Gen2 Write of one word, the reader waits for the tag to commit it
+
+// ------ Private types ---------------------------------------
+typedef struct {
+    uint8_t epc[EPC_LEN];
+    uint8_t tid[TID_LEN];
+    uint8_t user[USER_LEN];
+    uint8_t reverse; // walks from antenna 1 to antenna 0
+    uint8_t flag[4];           // inventoried flag per session, 0 = A, 1 = B
+    uint64_t flag_time[4];     // when the flag was last set to B
+} emu_tag_t;
+
+// ------ Private variables -----------------------------------
+static emu_tag_t* tags;
+static int tag_cnt = 20;
+static int group = 1;           // tags passing together
+static int pass_ms = 1500;
+static int rate = 1000;         // packets/s
+static int continuous = 0;
+static double error_ratio = 0;
+static double corrupt_ratio = 0;
+static double noise_ratio = 0;
+static double foreign_ratio = 0;
+static int no_mask = 0;         // answer cmd_tag_mask with an error
+
+static int master = -1;
+static uint64_t start_ms;
+static uint32_t total_read = 0;
+static uint8_t match_epc[EPC_LEN];
+static uint8_t match_len = 0; // 0 = access EPC match off
+static uint8_t mask_bits[MASK_CNT]; // 0 = mask not set
+static uint8_t mask_value[MASK_CNT][EPC_LEN];
+static const int persistence_ms[4] = {0, 1000, 5000, 5000}; // S0 flag drops at once, S1 after ~1 s
+
+static uint64_t sent_packets = 0, sent_errors = 0, sent_noise = 0;
+static volatile sig_atomic_t running = 1;
+
+//--------------------------------------------------------------
+// FUNCTION DEFINITIONS
+//--------------------------------------------------------------
+static uint64_t __now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static double __rand01(void)
+{
+    return rand() / (RAND_MAX + 1.0);
+}
+
+static uint8_t __checksum(const uint8_t* buf, int len)
+{
+    uint8_t cs = 0;
+    for (int i = 0; i < len; i++) cs += buf[i];
+    return ~cs + 1;
+}
+
+static void __write_all(const uint8_t* buf, int len)
+{
+    while (len > 0) {
+        ssize_t n = write(master, buf, len);
+        if (n < 0) return; // host not reading fast enough: bytes are lost, like a UART overrun
+        buf += n;
+        len -= n;
+    }
+}
+
+/**
+ *  @brief Send one packet, applying the checksum corruption and line noise faults
+ *  @param cmd command code
+ *  @param payload bytes after the command code
+ *  @param len payload length
+ */
+static void __send_packet(uint8_t cmd, const uint8_t* payload, int len)
+{
+    uint8_t pkt[300];
+
+    pkt[0] = HEADER;
+    pkt[1] = len + 3;
+    pkt[2] = READER_ADDRESS;
+    pkt[3] = cmd;
+    memcpy(pkt + 4, payload, len);
+    pkt[4 + len] = __checksum(pkt, 4 + len);
+    if (__rand01() < corrupt_ratio) pkt[4 + len] ^= 0x5A;
+
+    if (__rand01() < noise_ratio) {
+        uint8_t noise[8];
+        int n = 1 + rand() % sizeof(noise);
+        for (int i = 0; i < n; i++) noise[i] = rand() & 0xFF;
+        noise[0] = noise[0] == HEADER ? 0x00 : noise[0];
+        __write_all(noise, n);
+        sent_noise++;
+    }
+    __write_all(pkt, len + 5);
+    sent_packets++;
+}
+
+static void __send_error(uint8_t cmd, uint8_t code)
+{
+    __send_packet(cmd, &code, 1);
+    sent_errors++;
+}
+
+/**
+ *  @brief Build the tag population
+ */
+static void __init_tags(void)
+{
+    tags = (emu_tag_t*)calloc(tag_cnt, sizeof(emu_tag_t));
+    for (int i = 0; i < tag_cnt; i++) {
+        emu_tag_t* t = &tags[i];
+        int foreign = __rand01() < foreign_ratio;
+
+        // our badges: E2 00 C0 DE + serial, foreign ones: 30 + random
+        t->epc[0] = foreign ? 0x30 : 0xE2;
+        t->epc[1] = foreign ? rand() & 0xFF : 0x00;
+        t->epc[2] = foreign ? rand() & 0xFF : 0xC0;
+        t->epc[3] = foreign ? rand() & 0xFF : 0xDE;
+        for (int b = 4; b < EPC_LEN; b++) t->epc[b] = (i >> (8 * (EPC_LEN - 1 - b))) & 0xFF;
+
+        t->tid[0] = 0xE2; t->tid[1] = 0x80; t->tid[2] = 0x11; t->tid[3] = 0x05;
+        for (int b = 4; b < TID_LEN; b++) t->tid[b] = rand() & 0xFF;
+        snprintf((char*)t->user, USER_LEN, "EMP%05d", i);
+        t->reverse = i & 1;
+    }
+}
+
+/**
+ *  @brief Check a tag against the tag masks
+ *  @return 1 if the tag answers inventories
+ */
+static int __selected_by_mask(int i)
+{
+    int any = 0;
+    for (int m = 0; m < MASK_CNT; m++) {
+        if (!mask_bits[m]) continue;
+        any = 1;
+        int b = 0;
+        for (; b < mask_bits[m]; b++) {
+            uint8_t bit = 0x80 >> (b % 8);
+            if ((tags[i].epc[b / 8] & bit) != (mask_value[m][b / 8] & bit)) break;
+        }
+        if (b == mask_bits[m]) return 1;
+    }
+    return !any;
+}
+
+/**
+ *  @brief Answer cmd_tag_mask (0x98): clear all, or set one EPC mask
+ */
+static void __tag_mask(const uint8_t* arg, int len)
+{
+    uint8_t ok = COMMAND_SUCCESS;
+
+    if (no_mask) ok = COMMAND_FAIL;
+    else if (len >= 1 && arg[0] == 0x00) memset(mask_bits, 0, sizeof(mask_bits));
+    else if (len >= 8 && arg[0] >= 1 && arg[0] <= MASK_CNT && arg[3] == 0x01 && arg[4] == EPC_BIT_OFFSET &&
+             arg[5] > 0 && arg[5] <= EPC_LEN * 8 && len >= 7 + (arg[5] + 7) / 8) {
+        mask_bits[arg[0] - 1] = arg[5];
+        memcpy(mask_value[arg[0] - 1], arg + 6, (arg[5] + 7) / 8);
+    } else {
+        ok = PARAM_INVALID;
+    }
+    __send_packet(TAG_MASK_CMD, &ok, 1);
+}
+
+/**
+ *  @brief Where a tag is in its pass
+ *  @param i tag index
+ *  @param now emulator time (ms)
+ *  @param rssi set to the RSSI of a read now
+ *  @param ant set to the antenna which reads it now
+ *  @return 1 if the tag is in the field
+ */
+static int __tag_state(int i, uint64_t now, uint8_t* rssi, uint8_t* ant)
+{
+    // passes of the groups follow each other with a 1/4 pass overlap
+    uint64_t period = (uint64_t)((tag_cnt + group - 1) / group) * pass_ms * 3 / 4 + pass_ms;
+    uint64_t offset = (uint64_t)(i / group) * pass_ms * 3 / 4;
+    uint64_t phase = (now + period - offset % period) % period;
+
+    if (phase >= (uint64_t)pass_ms) return 0;
+
+    int half = pass_ms / 2;
+    int dist = phase > (uint64_t)half ? phase - half : half - phase;
+    int value = PEAK_RSSI - (PEAK_RSSI - EDGE_RSSI) * dist / (half ? half : 1) + (rand() % 5) - 2;
+    *rssi = value < 0 ? 0 : value;
+    *ant = (phase < (uint64_t)half) ^ !tags[i].reverse ? 1 : 0;
+    return 1;
+}
+
+/**
+ *  @brief Send the real-time inventory packet of one tag
+ */
+static void __send_tag(uint8_t cmd, int i, uint8_t rssi, uint8_t ant)
+{
+    uint8_t payload[1 + 2 + EPC_LEN + 1];
+    uint8_t freq = rand() % 50;
+
+    payload[0] = (freq << 2) | (ant & 0x03);
+    payload[1] = (EPC_LEN / 2) << 3; // PC: EPC length in words
+    payload[2] = 0x00;
+    memcpy(payload + 3, tags[i].epc, EPC_LEN);
+    payload[3 + EPC_LEN] = rssi;
+    __send_packet(cmd, payload, sizeof(payload));
+    total_read++;
+}
+
+/**
+ *  @brief Run one inventory round: every tag in the field once, then the round-end packet
+ *  @return number of tag packets sent
+ */
+static int __inventory_round(uint8_t cmd)
+{
+    uint64_t now = __now_ms() - start_ms;
+    uint64_t round_start = __now_ms();
+    uint32_t round_reads = 0;
+    uint8_t rssi, ant = 0, last_ant = 0;
+
+    for (int i = 0; i < tag_cnt; i++) {
+        if (!__selected_by_mask(i) || !__tag_state(i, now, &rssi, &ant)) continue;
+        if (__rand01() < error_ratio) {
+            __send_error(cmd, TAG_INV_ERROR);
+            continue;
+        }
+        __send_tag(cmd, i, rssi, ant);
+        last_ant = ant;
+        round_reads++;
+        // pace at the configured packet rate
+        if (rate > 0) usleep(1000000 / rate);
+    }
+
+    uint64_t elapsed = __now_ms() - round_start;
+    uint16_t read_rate = elapsed ? round_reads * 1000 / elapsed : round_reads;
+    uint8_t end[7] = {last_ant, read_rate >> 8, read_rate & 0xFF,
+                      total_read >> 24, (total_read >> 16) & 0xFF, (total_read >> 8) & 0xFF, total_read & 0xFF};
+    __send_packet(cmd, end, sizeof(end));
+    return round_reads;
+}
+
+/**
+ *  @brief Run one session inventory round (0x8B) with the anti-collision model
+ *  @return number of tag packets sent
+ */
+static int __session_round(const uint8_t* arg, int len)
+{
+    if (len < 3 || arg[0] > 3 || arg[1] > 1 || arg[2] == 0) {
+        __send_error(SESSION_INV_CMD, PARAM_INVALID);
+        return 0;
+    }
+    uint8_t session = arg[0], target = arg[1], repeat = arg[2];
+    uint64_t round_start = __now_ms();
+    uint64_t now = round_start - start_ms;
+    uint32_t round_reads = 0;
+    uint8_t rssi[MAX_TAGS], ant[MAX_TAGS], in_field[MAX_TAGS], last_ant = 0;
+
+    for (int i = 0; i < tag_cnt; i++) {
+        emu_tag_t* t = &tags[i];
+        in_field[i] = __selected_by_mask(i) && __tag_state(i, now, &rssi[i], &ant[i]);
+        if (!in_field[i]) t->flag[session] = 0; // out of the field: power lost
+        else if (t->flag[session] && now - t->flag_time[session] >= (uint64_t)persistence_ms[session])
+            t->flag[session] = 0;
+    }
+    usleep(ROUND_SETUP_US);
+
+    for (int r = 0; r < repeat; r++) {
+        int eligible = 0;
+        for (int i = 0; i < tag_cnt; i++) eligible += in_field[i] && tags[i].flag[session] == target;
+
+        double p = eligible ? REPLY_SLOTS / eligible : 0;
+        usleep(SLOT_US * (eligible > 2 ? eligible * 2 : 4));
+        for (int i = 0; i < tag_cnt && eligible; i++) {
+            emu_tag_t* t = &tags[i];
+            if (!in_field[i] || t->flag[session] != target || __rand01() >= p) continue;
+            if (__rand01() < error_ratio) {
+                __send_error(SESSION_INV_CMD, TAG_INV_ERROR);
+                continue;
+            }
+            __send_tag(SESSION_INV_CMD, i, rssi[i], ant[i]);
+            last_ant = ant[i];
+            round_reads++;
+            if (session != 0) {
+                t->flag[session] = !target;
+                t->flag_time[session] = now;
+            }
+        }
+    }
+
+    uint64_t elapsed = __now_ms() - round_start;
+    uint16_t read_rate = elapsed ? round_reads * 1000 / elapsed : round_reads;
+    uint8_t end[7] = {last_ant, read_rate >> 8, read_rate & 0xFF,
+                      total_read >> 24, (total_read >> 16) & 0xFF, (total_read >> 8) & 0xFF, total_read & 0xFF};
+    __send_packet(SESSION_INV_CMD, end, sizeof(end));
+    return round_reads;
+}
+
+/**
+ *  @brief Find the tags a read/write command talks to
+ *  @return 1 if tag i is selected by the access EPC match
+ */
+static int __selected(int i)
+{
+    return match_len == 0 || !memcmp(tags[i].epc, match_epc, match_len);
+}
+
+/**
+ *  @brief Answer cmd_read (0x81) for every selected tag in the field
+ */
+static void __read_tags(const uint8_t* arg, int len)
+{
+    if (len < 3) { __send_error(READ_CMD, PARAM_INVALID); return; }
+
+    uint8_t membank = arg[0], word_add = arg[1], word_cnt = arg[2];
+    uint64_t now = __now_ms() - start_ms;
+    uint8_t rssi, ant;
+    int found = 0;
+
+    for (int i = 0; i < tag_cnt; i++) {
+        if (!__selected(i) || !__tag_state(i, now, &rssi, &ant)) continue;
+
+        uint8_t* mem = membank == 1 ? tags[i].epc : membank == 2 ? tags[i].tid : tags[i].user;
+        int mem_len = membank == 1 ? EPC_LEN : membank == 2 ? TID_LEN : USER_LEN;
+        int read_len = word_cnt * 2;
+        if (membank == 0 || word_add * 2 + read_len > mem_len + (membank == 1 ? 4 : 0)) {
+            __send_error(READ_CMD, PARAM_INVALID);
+            return;
+        }
+
+        // [TagCount(2), DataLen, PC(2) EPC CRC(2) data, ReadLen, AntID, ReadCount]
+        uint8_t payload[300];
+        int p = 0;
+        payload[p++] = 0x00;
+        payload[p++] = 0x01;
+        payload[p++] = 2 + EPC_LEN + 2 + read_len;
+        payload[p++] = (EPC_LEN / 2) << 3;
+        payload[p++] = 0x00;
+        memcpy(payload + p, tags[i].epc, EPC_LEN); p += EPC_LEN;
+        payload[p++] = 0x12; payload[p++] = 0x34;
+        if (membank == 1) { // EPC bank starts with CRC and PC
+            uint8_t epc_bank[4 + EPC_LEN] = {0x12, 0x34, (EPC_LEN / 2) << 3, 0x00};
+            memcpy(epc_bank + 4, tags[i].epc, EPC_LEN);
+            memcpy(payload + p, epc_bank + word_add * 2, read_len);
+        } else {
+            memcpy(payload + p, mem + word_add * 2, read_len);
+        }
+        p += read_len;
+        payload[p++] = read_len;
+        payload[p++] = ant;
+        payload[p++] = 0x01;
+        __send_packet(READ_CMD, payload, p);
+        found++;
+    }
+    if (!found) __send_error(READ_CMD, NO_TAG_ERROR);
+}
+
+/**
+ *  @brief Answer cmd_write (0x82) for every selected tag in the field
+ */
+static void __write_tags(const uint8_t* arg, int len)
+{
+    if (len < 7) { __send_error(WRITE_CMD, PARAM_INVALID); return; }
+
+    uint8_t membank = arg[4], word_add = arg[5], word_cnt = arg[6];
+    const uint8_t* data = arg + 7;
+    uint64_t now = __now_ms() - start_ms;
+    uint8_t rssi, ant;
+    int found = 0;
+
+    if (len < 7 + word_cnt * 2) { __send_error(WRITE_CMD, PARAM_INVALID); return; }
+
+    for (int i = 0; i < tag_cnt; i++) {
+        if (!__selected(i) || !__tag_state(i, now, &rssi, &ant)) continue;
+
+        if (membank == 1 && word_add >= 2 && (word_add - 2 + word_cnt) * 2 <= EPC_LEN)
+            memcpy(tags[i].epc + (word_add - 2) * 2, data, word_cnt * 2);
+        else if (membank == 3 && (word_add + word_cnt) * 2 <= USER_LEN)
+            memcpy(tags[i].user + word_add * 2, data, word_cnt * 2);
+        else {
+            __send_error(WRITE_CMD, PARAM_INVALID);
+            return;
+        }
+        usleep(word_cnt * WRITE_WORD_US);
+
+        // [TagCount(2), DataLen, PC(2) EPC CRC(2), ErrCode, AntID, WriteCount]
+        uint8_t payload[64];
+        int p = 0;
+        payload[p++] = 0x00;
+        payload[p++] = 0x01;
+        payload[p++] = 2 + EPC_LEN + 2;
+        payload[p++] = (EPC_LEN / 2) << 3;
+        payload[p++] = 0x00;
+        memcpy(payload + p, tags[i].epc, EPC_LEN); p += EPC_LEN;
+        payload[p++] = 0x12; payload[p++] = 0x34;
+        payload[p++] = COMMAND_SUCCESS;
+        payload[p++] = ant;
+        payload[p++] = 0x01;
+        __send_packet(WRITE_CMD, payload, p);
+        found++;
+    }
+    if (!found) __send_error(WRITE_CMD, NO_TAG_ERROR);
+}
+
+/**
+ *  @brief Answer one host command
+ */
+static void __handle_command(const uint8_t* pkt, int len)
+{
+    uint8_t cmd = pkt[3];
+    const uint8_t* arg = pkt + 4;
+    int arg_len = len - 5;
+    uint8_t ok = COMMAND_SUCCESS;
+
+    switch (cmd) {
+        case RESET_CMD:
+            match_len = 0;
+            break; // no response, the reader restarts
+        case RT_INVENTORY_CMD:
+            __inventory_round(cmd);
+            break;
+        case SESSION_INV_CMD:
+            __session_round(arg, arg_len);
+            break;
+        case READ_CMD:
+            __read_tags(arg, arg_len);
+            break;
+        case WRITE_CMD:
+            __write_tags(arg, arg_len);
+            break;
+        case TAG_MASK_CMD:
+            __tag_mask(arg, arg_len);
+            break;
+        case ACCESS_MATCH_CMD:
+            if (arg_len >= 1 && arg[0] == 0x01) match_len = 0;
+            else if (arg_len >= 2 && arg[1] <= EPC_LEN && arg_len >= 2 + arg[1]) {
+                match_len = arg[1];
+                memcpy(match_epc, arg + 2, match_len);
+            } else {
+                ok = PARAM_INVALID;
+            }
+            __send_packet(cmd, &ok, 1);
+            break;
+        case BUZZER_CMD:
+        case MODE_CMD:
+            __send_packet(cmd, &ok, 1);
+            break;
+        default:
+            __send_error(cmd, COMMAND_FAIL);
+            break;
+    }
+}
+
+/**
+ *  @brief Read host commands from the pty, drop bytes until a valid packet shows up
+ */
+static void __poll_commands(int timeout_ms)
+{
+    static uint8_t buf[512];
+    static int used = 0;
+    struct pollfd pfd = {master, POLLIN, 0};
+
+    if (poll(&pfd, 1, timeout_ms) <= 0 || !(pfd.revents & POLLIN)) return;
+
+    ssize_t n = read(master, buf + used, sizeof(buf) - used);
+    if (n <= 0) return;
+    used += n;
+
+    int p = 0;
+    while (used - p >= 5) {
+        if (buf[p] != HEADER) { p++; continue; }
+        int len = buf[p + 1] + 2;
+        if (len < 5) { p++; continue; }
+        if (used - p < len) break;
+        if (__checksum(buf + p, len - 1) == buf[p + len - 1]) __handle_command(buf + p, len);
+        p += len;
+    }
+    memmove(buf, buf + p, used - p);
+    used -= p;
+}
+
+/**
+ *  @brief Stream tag packets at the configured rate without waiting for commands
+ */
+static void __continuous_tick(void)
+{
+    static int next_tag = 0;
+    static uint64_t last_ms = 0;
+    static double budget = 0;
+    uint64_t now = __now_ms();
+    uint8_t rssi, ant;
+
+    if (last_ms == 0) last_ms = now;
+    budget += (now - last_ms) * rate / 1000.0;
+    last_ms = now;
+    if (budget > rate) budget = rate; // do not burst after a stall
+
+    for (int scanned = 0; budget >= 1 && scanned < tag_cnt; scanned++) {
+        int i = next_tag;
+        next_tag = (next_tag + 1) % tag_cnt;
+        if (!__selected_by_mask(i) || !__tag_state(i, now - start_ms, &rssi, &ant)) continue;
+
+        if (__rand01() < error_ratio) __send_error(RT_INVENTORY_CMD, TAG_INV_ERROR);
+        else __send_tag(RT_INVENTORY_CMD, i, rssi, ant);
+        budget -= 1;
+        scanned = -1; // keep going while there is budget
+    }
+}
+
+static void __stop(int sig)
+{
+    (void)sig;
+    running = 0;
+}
+
+static void __show_usage(const char* name)
+{
+    printf("\nHow to use:\n");
+    printf("\n\t%s [-l link] [-t tags] [-g group] [-d pass_ms] [-r rate] [-c] [-e ratio] [-x ratio] [-n ratio] [-f ratio] [-m] [-s seed]\n\n", name);
+    printf("With:\n");
+    printf("\t-l link: also make a symlink to the pty, e.g. /tmp/uhf0\n");
+    printf("\t-t tags: tag population (default 20)\n");
+    printf("\t-g group: tags passing the gate together (default 1)\n");
+    printf("\t-d pass_ms: time a tag spends in the field (default 1500)\n");
+    printf("\t-r rate: packets per second (default 1000)\n");
+    printf("\t-c: continuous mode, stream packets without inventory commands\n");
+    printf("\t-e ratio: error packets, -x ratio: bad checksums, -n ratio: noise bytes\n");
+    printf("\t-f ratio: foreign (non badge) tags in the population\n");
+    printf("\t-m: no tag mask support, cmd_tag_mask fails\n");
+    printf("\t-s seed: random seed\n\n");
+}
+
+int main(int argc, char** argv)
+{
+    const char* link_path = NULL;
+    int opt;
+
+    srand(time(NULL));
+    while ((opt = getopt(argc, argv, "l:t:g:d:r:ce:x:n:f:ms:h")) != -1) {
+        switch (opt) {
+            case 'l': link_path = optarg; break;
+            case 't': tag_cnt = atoi(optarg); break;
+            case 'g': group = atoi(optarg); break;
+            case 'd': pass_ms = atoi(optarg); break;
+            case 'r': rate = atoi(optarg); break;
+            case 'c': continuous = 1; break;
+            case 'e': error_ratio = atof(optarg); break;
+            case 'x': corrupt_ratio = atof(optarg); break;
+            case 'n': noise_ratio = atof(optarg); break;
+            case 'f': foreign_ratio = atof(optarg); break;
+            case 'm': no_mask = 1; break;
+            case 's': srand(atoi(optarg)); break;
+            default: __show_usage(argv[0]); return 1;
+        }
+    }
+    if (tag_cnt < 1 || tag_cnt > MAX_TAGS || group < 1 || pass_ms < 2 || rate < 0) {
+        __show_usage(argv[0]);
+        return 1;
+    }
+
+    master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (master < 0 || grantpt(master) < 0 || unlockpt(master) < 0) {
+        perror("posix_openpt");
+        return 1;
+    }
+    struct termios raw;
+    tcgetattr(master, &raw);
+    cfmakeraw(&raw);
+    tcsetattr(master, TCSANOW, &raw);
+
+    const char* slave_name = ptsname(master);
+    if (link_path != NULL) {
+        unlink(link_path);
+        if (symlink(slave_name, link_path) < 0) perror("symlink");
+    }
+    // keep the slave open ourselves so writes do not fail before a client attaches
+    int keep = open(slave_name, O_RDWR | O_NOCTTY);
+
+    __init_tags();
+    start_ms = __now_ms();
+    signal(SIGINT, __stop);
+    signal(SIGTERM, __stop);
+    printf("IND8002 emulator on %s (%d tags, %s mode, %d packets/s)\n",
+        slave_name, tag_cnt, continuous ? "continuous" : "command", rate);
+    fflush(stdout);
+
+    while (running) {
+        __poll_commands(continuous ? 1 : 100);
+        if (continuous) __continuous_tick();
+    }
+
+    printf("\nSent %llu packets (%llu errors), %llu noise bursts, %u tag reads\n",
+        (unsigned long long)sent_packets, (unsigned long long)sent_errors,
+        (unsigned long long)sent_noise, total_read);
+    if (link_path != NULL) unlink(link_path);
+    if (keep >= 0) close(keep);
+    close(master);
+    free(tags);
+    return 0;
+}
@@ -0,0 +1,564 @@
+/** ------------------------------------------------------------*-
+ * UHF badge provisioning
+ * CheckinGate Project.
+ * (c) Minh-An Dao 2020
+ * version 1.00 - 19/10/2020
+ *--------------------------------------------------------------
+ * Enroll a batch of badges on the RS232 reader: every employee of the
+ * list gets one tag of the field, with its EPC and its employee code in
+ * the USER membank, checked by reading it back.
+ *
+ * - List: CSV export of docs/upload.xlsx (Ma nhan vien, RFID tag, Ten,
+ *   Don vi, SDT, Email), ',' ';' or tab separated. Only the first two
+ *   columns are used, rows without a valid code (the header) are
+ *   skipped. The RFID tag column is the EPC the badge must carry; when
+ *   it is empty the EPC is the -e prefix followed by the code.
+ * - A tag already carrying the EPC of an employee only gets its USER
+ *   membank written. Every other tag in the field is blank and takes
+ *   the next employee. Blank tags need distinct EPCs: the access EPC
+ *   match is how one of them is picked among the others.
+ * - Pipelining: an inventory round finds the tags, then the commands
+ *   of up to -j tags (EPC write, USER write, read back) are sent back to
+ *   back and the answers are checked as they come, so the reader never
+ *   waits for the host between two tags.
+ * - A tag which failed (left the field, write error, wrong read back)
+ *   is tried again up to -r times, on the same tag if it already
+ *   carries its new EPC.
+ *
+ * The result of every employee is written as code,EPC,status,tries to
+ * -o (stdout by default); progress and the tags/minute summary go to
+ * stderr.
+ *
+ * Usage: ./uhf_provision [-p port] [-b baudrate] [-e prefix] [-w words] [-j depth]
+ *                        [-r retries] [-i idle_s] [-o results.csv] list.csv
+ *
+ -------------------------------------------------------------- */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <encode.h>
+#include <uhf.h>
+
+// ------ Private constants -----------------------------------
+#define PORT            "/dev/serial0"
+#define BAUDRATE        115200
+
+#define EPC_LEN         12   // bytes, 96 bit EPC: words 2-7 of the EPC membank
+#define PC_WORD_ADD     1
+#define EPC_WORD_ADD    2
+#define CODE_MAX_LEN    32
+#define POOL_MAX        1024 // tags kept from one inventory round
+#define DEPTH_MAX       32   // tags in flight
+#define ROUND_TIMEOUT   2000 // ms for an inventory round
+#define REPLY_TIMEOUT   1000 // ms without any answer while some are expected
+
+// Employee states
+#define REC_TODO        0
+#define REC_DONE        1
+#define REC_FAILED      2
+
+// Commands of a tag, in the order they are answered
+#define STEP_EPC        0 // match the old EPC, write PC/EPC
+#define STEP_USER       1 // match the new EPC, write USER
+#define STEP_READ       2 // match the new EPC, read USER back
+
+// ------ Private types ---------------------------------------
+typedef struct {
+    char code[CODE_MAX_LEN];
+    uint8_t epc[EPC_LEN];
+    uint8_t state;
+    uint8_t tries;
+    uint8_t in_pool;  // a tag of the last round already carries the EPC
+} record_t;
+
+typedef struct {
+    uint8_t epc[UHF_EPC_MAX_LEN];
+    uint8_t epc_len;
+    int record;       // employee whose EPC the tag carries, -1 for a blank tag
+    uint8_t used;
+} pool_tag_t;
+
+typedef struct {
+    int record;
+    int tag;              // pool index
+    uint8_t write_epc;
+    uint8_t verified;
+    const char* error;    // first failure, NULL if none
+} job_t;
+
+typedef struct {
+    uint8_t job;
+    uint8_t kind;
+} step_t;
+
+// ------ Private variables -----------------------------------
+static record_t* records = NULL;
+static int record_cnt = 0;
+static pool_tag_t pool[POOL_MAX];
+static int pool_cnt = 0;
+static job_t jobs[DEPTH_MAX];
+static step_t steps[DEPTH_MAX * 3];
+static int step_head = 0, step_cnt = 0;
+
+static uint8_t prefix[EPC_LEN] = {0xE2, 0x00, 0xC0, 0xDE};
+static int prefix_len = 4;
+static int user_words = 4;
+static int depth = 8;
+static int retries = 3;
+static int idle_ms = 30000;
+static FILE* results;
+
+//--------------------------------------------------------------
+// FUNCTION DEFINITIONS
+//--------------------------------------------------------------
+static uint64_t __now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int __hex_value(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+/**
+ *  @brief Parse hex, with or without 0x
+ *  @return number of bytes, -1 if invalid or longer than max
+ */
+static int __parse_hex(const char* s, uint8_t* out, int max)
+{
+    int n = 0;
+    if (s[0] == '0' && (s[1] == 'x' || s[1] == 'X')) s += 2;
+    while (*s) {
+        int hi = __hex_value(s[0]);
+        int lo = s[1] ? __hex_value(s[1]) : -1;
+        if (hi < 0 || lo < 0 || n >= max) return -1;
+        out[n++] = (hi << 4) | lo;
+        s += 2;
+    }
+    return n;
+}
+
+static void __print_epc(FILE* f, const uint8_t* epc, uint8_t len)
+{
+    char hex[2*UHF_EPC_MAX_LEN + 1];
+    *encode_hex_raw(hex, epc, len) = '\0';
+    fprintf(f, "%s", hex);
+}
+
+/**
+ *  @brief Split one CSV line in place, quotes and spaces around a field are dropped
+ *  @return number of fields
+ */
+static int __split(char* line, char** fields, int max)
+{
+    int n = 0;
+    char* p = line;
+
+    while (n < max) {
+        while (*p == ' ' || *p == '"') p++;
+        fields[n++] = p;
+        while (*p && *p != ',' && *p != ';' && *p != '\t' && *p != '\r' && *p != '\n') p++;
+        char sep = *p;
+        char* end = p;
+        while (end > fields[n-1] && (end[-1] == ' ' || end[-1] == '"')) end--;
+        *end = '\0';
+        if (sep != ',' && sep != ';' && sep != '\t') break;
+        p++;
+    }
+    return n;
+}
+
+static int __valid_code(const char* code)
+{
+    if (!*code || strlen(code) >= CODE_MAX_LEN) return 0;
+    for (; *code; code++)
+        if (!((*code >= '0' && *code <= '9') || (*code >= 'A' && *code <= 'Z') ||
+              (*code >= 'a' && *code <= 'z') || *code == '-' || *code == '_')) return 0;
+    return 1;
+}
+
+/**
+ *  @brief The EPC of an employee without one in the list: prefix, then the code as a big-endian number
+ *  @return 0 if succeed, 1 if the code is not a number or does not fit
+ */
+static uint8_t __make_epc(const char* code, uint8_t* epc)
+{
+    uint64_t v = 0;
+    for (const char* c = code; *c; c++) {
+        if (*c < '0' || *c > '9') return 1;
+        v = v * 10 + (*c - '0');
+    }
+    memset(epc, 0, EPC_LEN);
+    memcpy(epc, prefix, prefix_len);
+    for (int i = EPC_LEN - 1; i >= prefix_len; i--, v >>= 8) epc[i] = v & 0xFF;
+    return v != 0;
+}
+
+static int __find_record(const uint8_t* epc, uint8_t epc_len)
+{
+    if (epc_len != EPC_LEN) return -1;
+    for (int i = 0; i < record_cnt; i++)
+        if (!memcmp(records[i].epc, epc, EPC_LEN)) return i;
+    return -1;
+}
+
+/**
+ *  @brief Load the employee list
+ *  @return number of employees, -1 if the file cannot be read
+ */
+static int __load_list(const char* path)
+{
+    FILE* f = fopen(path, "r");
+    if (f == NULL) {
+        perror(path);
+        return -1;
+    }
+
+    char line[512];
+    int line_no = 0, cap = 0;
+    while (fgets(line, sizeof(line), f)) {
+        char* fields[2];
+        line_no++;
+        int n = __split(line, fields, 2);
+        if (!__valid_code(fields[0])) {
+            if (*fields[0]) fprintf(stderr, "Line %d skipped: no employee code\n", line_no);
+            continue;
+        }
+        if (record_cnt == cap) {
+            cap = cap ? cap * 2 : 256;
+            records = realloc(records, cap * sizeof(record_t));
+            if (records == NULL) {
+                fclose(f);
+                return -1;
+            }
+        }
+
+        record_t* r = &records[record_cnt];
+        memset(r, 0, sizeof(*r));
+        strcpy(r->code, fields[0]);
+        if ((int)strlen(r->code) > 2*user_words) {
+            fprintf(stderr, "Line %d skipped: code %s is longer than %d USER words\n", line_no, r->code, user_words);
+            continue;
+        }
+        if (n > 1 && *fields[1]) {
+            if (__parse_hex(fields[1], r->epc, EPC_LEN) != EPC_LEN) {
+                fprintf(stderr, "Line %d skipped: RFID tag %s is not a 96 bit EPC\n", line_no, fields[1]);
+                continue;
+            }
+        } else if (__make_epc(r->code, r->epc)) {
+            fprintf(stderr, "Line %d skipped: no RFID tag and code %s does not fit an EPC\n", line_no, r->code);
+            continue;
+        }
+        if (__find_record(r->epc, EPC_LEN) >= 0) {
+            fprintf(stderr, "Line %d skipped: EPC given twice\n", line_no);
+            continue;
+        }
+        record_cnt++;
+    }
+    fclose(f);
+    return record_cnt;
+}
+
+//--------------------------------------------------------------
+/**
+ *  @brief Run one inventory round and keep the tags of the field
+ *  @return number of tags seen
+ */
+static int __inventory(uhf_reader_t* reader)
+{
+    uhf_tag_t tag;
+    uhf_round_t round;
+    uint64_t start = __now_ms();
+
+    pool_cnt = 0;
+    for (int i = 0; i < record_cnt; i++) records[i].in_pool = 0;
+
+    uhf_realtime_inventory(reader);
+    while (__now_ms() - start < ROUND_TIMEOUT) {
+        if (uhf_read_rt_inventory_tag(reader, &tag)) {
+            if (uhf_get_round(reader, &round)) break;
+            continue;
+        }
+
+        int i = 0;
+        while (i < pool_cnt && !(pool[i].epc_len == tag.epc_len && !memcmp(pool[i].epc, tag.epc, tag.epc_len))) i++;
+        if (i < pool_cnt || pool_cnt == POOL_MAX) continue;
+
+        pool_tag_t* t = &pool[pool_cnt++];
+        memcpy(t->epc, tag.epc, tag.epc_len);
+        t->epc_len = tag.epc_len;
+        t->record = __find_record(tag.epc, tag.epc_len);
+        t->used = t->record >= 0 && records[t->record].state != REC_TODO;
+        if (t->record >= 0) records[t->record].in_pool = 1;
+    }
+    return pool_cnt;
+}
+
+/**
+ *  @brief Pick the tags of the next batch: tags carrying their EPC first, then blank tags
+ *  @return number of jobs
+ */
+static int __plan_batch(void)
+{
+    int n = 0;
+
+    for (int t = 0; t < pool_cnt && n < depth; t++) {
+        if (pool[t].used || pool[t].record < 0 || records[pool[t].record].state != REC_TODO) continue;
+        pool[t].used = 1;
+        jobs[n++] = (job_t){pool[t].record, t, 0, 0, NULL};
+    }
+
+    int t = 0;
+    for (int r = 0; r < record_cnt && n < depth; r++) {
+        if (records[r].state != REC_TODO || records[r].in_pool) continue;
+        while (t < pool_cnt && (pool[t].used || pool[t].record >= 0)) t++;
+        if (t == pool_cnt) break;
+        pool[t].used = 1;
+        records[r].in_pool = 1;
+        jobs[n++] = (job_t){r, t, 1, 0, NULL};
+    }
+    return n;
+}
+
+static void __user_data(const record_t* r, uint8_t* data)
+{
+    memset(data, 0, 2*user_words);
+    memcpy(data, r->code, strlen(r->code));
+}
+
+/**
+ *  @brief Send every command of a batch without waiting for the answers
+ */
+static void __send_batch(uhf_reader_t* reader, int n)
+{
+    uint8_t data[2*UHF_READ_MAX_LEN];
+
+    step_head = step_cnt = 0;
+    for (int j = 0; j < n; j++) {
+        record_t* r = &records[jobs[j].record];
+        pool_tag_t* t = &pool[jobs[j].tag];
+
+        if (jobs[j].write_epc) {
+            if (t->epc_len == EPC_LEN) {
+                uhf_request_write(reader, t->epc, t->epc_len, EPC_MEMBANK, EPC_WORD_ADD, r->epc, EPC_LEN/2);
+            } else { // another EPC length, the PC gets the new one
+                data[0] = (EPC_LEN/2) << 3;
+                data[1] = 0x00;
+                memcpy(data + 2, r->epc, EPC_LEN);
+                uhf_request_write(reader, t->epc, t->epc_len, EPC_MEMBANK, PC_WORD_ADD, data, EPC_LEN/2 + 1);
+            }
+            steps[step_cnt++] = (step_t){j, STEP_EPC};
+        }
+        __user_data(r, data);
+        uhf_request_write(reader, r->epc, EPC_LEN, USER_MEMBANK, 0x00, data, user_words);
+        steps[step_cnt++] = (step_t){j, STEP_USER};
+        uhf_request_read(reader, r->epc, EPC_LEN);
+        steps[step_cnt++] = (step_t){j, STEP_READ};
+    }
+}
+
+static void __fail(job_t* job, const char* error)
+{
+    if (job->error == NULL) job->error = error;
+}
+
+static void __on_write(const uhf_write_t* w)
+{
+    if (step_head == step_cnt || steps[step_head].kind == STEP_READ) return; // not ours
+    step_t* s = &steps[step_head++];
+    job_t* job = &jobs[s->job];
+
+    if (w->error) __fail(job, s->kind == STEP_EPC ? "EPC write" : "USER write");
+    else if (w->tag_cnt > 1) __fail(job, "shared EPC");
+    else if (s->kind == STEP_EPC) { // the tag answers to its new EPC from now on
+        memcpy(pool[job->tag].epc, records[job->record].epc, EPC_LEN);
+        pool[job->tag].epc_len = EPC_LEN;
+        pool[job->tag].record = job->record;
+    }
+}
+
+static void __on_read(const uhf_read_t* rd)
+{
+    uint8_t data[2*UHF_READ_MAX_LEN];
+
+    // writes answered by nothing: the reader dropped them
+    while (step_head < step_cnt && steps[step_head].kind != STEP_READ)
+        __fail(&jobs[steps[step_head++].job], "no answer");
+    if (step_head == step_cnt) return;
+
+    job_t* job = &jobs[steps[step_head++].job];
+    record_t* r = &records[job->record];
+    __user_data(r, data);
+
+    if (rd->error) __fail(job, "read back");
+    else if (rd->epc_len != EPC_LEN || memcmp(rd->epc, r->epc, EPC_LEN) ||
+             rd->data_len != 2*user_words || memcmp(rd->data, data, rd->data_len)) __fail(job, "verify");
+    else if (job->error == NULL) job->verified = 1;
+}
+
+/**
+ *  @brief Check the answers of a batch as they come
+ */
+static void __collect(uhf_reader_t* reader)
+{
+    uhf_tag_t tag;
+    uhf_write_t w;
+    uhf_read_t rd;
+    uint64_t last = __now_ms();
+
+    while (step_head < step_cnt) {
+        uhf_read_rt_inventory_tag(reader, &tag);
+        if (uhf_get_write(reader, &w)) {
+            __on_write(&w);
+            last = __now_ms();
+        }
+        if (uhf_get_read(reader, &rd)) {
+            __on_read(&rd);
+            last = __now_ms();
+        }
+        if (__now_ms() - last > REPLY_TIMEOUT) {
+            while (step_head < step_cnt) __fail(&jobs[steps[step_head++].job], "timeout");
+        }
+    }
+}
+
+static void __report(const record_t* r, const char* status)
+{
+    fprintf(results, "%s,", r->code);
+    __print_epc(results, r->epc, EPC_LEN);
+    fprintf(results, ",%s,%d\n", status, r->tries);
+    fflush(results);
+}
+
+/**
+ *  @brief Close a batch: done, failed for good, or back in the list
+ *  @return number of employees done
+ */
+static int __finish_batch(int n, int* failed)
+{
+    int done = 0, retry = 0;
+
+    for (int j = 0; j < n; j++) {
+        record_t* r = &records[jobs[j].record];
+        r->tries++;
+        if (jobs[j].verified) {
+            r->state = REC_DONE;
+            __report(r, "ok");
+            done++;
+        } else if (r->tries >= retries) {
+            r->state = REC_FAILED;
+            __report(r, jobs[j].error);
+            (*failed)++;
+        } else {
+            retry = 1;
+        }
+    }
+    // tags may have left the field: a new round tells which ones to try again, on their new EPC if it was written
+    if (retry) pool_cnt = 0;
+    return done;
+}
+
+static void __show_usage(const char* name)
+{
+    printf("\nHow to use:\n");
+    printf("\n\t%s [-p port] [-b baudrate] [-e prefix] [-w words] [-j depth] [-r retries] [-i idle_s] [-o results.csv] list.csv\n\n", name);
+    printf("With:\n");
+    printf("\t-p port: serial port of the reader (default %s)\n", PORT);
+    printf("\t-b baudrate: baudrate speed (default %d)\n", BAUDRATE);
+    printf("\t-e prefix: hex start of the EPCs made from the employee code (default E200C0DE)\n");
+    printf("\t-w words: USER words holding the employee code (default %d)\n", user_words);
+    printf("\t-j depth: tags whose commands are sent back to back (default %d, max %d)\n", depth, DEPTH_MAX);
+    printf("\t-r retries: tries per employee before giving up (default %d)\n", retries);
+    printf("\t-i idle_s: stop after this long without a tag to write (default %d)\n", idle_ms / 1000);
+    printf("\t-o results.csv: result of every employee (default stdout)\n");
+    printf("\tlist.csv: docs/upload.xlsx saved as CSV\n\n");
+    fflush(stdout);
+}
+
+int main(int argc, char** argv)
+{
+    const char* port = PORT;
+    const char* out_path = NULL;
+    uint32_t baudrate = BAUDRATE;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "p:b:e:w:j:r:i:o:h")) != -1) {
+        switch (opt) {
+            case 'p': port = optarg; break;
+            case 'b': baudrate = atoi(optarg); break;
+            case 'e': prefix_len = __parse_hex(optarg, prefix, EPC_LEN - 1); break;
+            case 'w': user_words = atoi(optarg); break;
+            case 'j': depth = atoi(optarg); break;
+            case 'r': retries = atoi(optarg); break;
+            case 'i': idle_ms = atoi(optarg) * 1000; break;
+            case 'o': out_path = optarg; break;
+            default: __show_usage(argv[0]); return 1;
+        }
+    }
+    if (optind != argc - 1 || prefix_len < 0 || user_words < 1 || user_words > UHF_READ_MAX_LEN / 2 ||
+        depth < 1 || depth > DEPTH_MAX || retries < 1) {
+        __show_usage(argv[0]);
+        return 1;
+    }
+    if ((results = out_path ? fopen(out_path, "w") : stdout) == NULL) {
+        perror(out_path);
+        return 1;
+    }
+    if (__load_list(argv[optind]) <= 0) {
+        fprintf(stderr, "No employee to provision\n");
+        return 1;
+    }
+
+    uhf_reader_t* reader = uhf_open(port, baudrate, -1, NULL);
+    if (reader == NULL) return 1;
+    uhf_set_rx_timeout(reader, 50);
+    uhf_set_param(reader, USER_MEMBANK, 0x00, user_words);
+    uhf_set_filter(reader, NULL); // masks left by sensor_reader would hide the blank tags
+
+    int done = 0, failed = 0, waiting = 0;
+    uint64_t start = __now_ms(), progress = start;
+
+    fprintf(stderr, "%d employees to provision\n", record_cnt);
+    while (done + failed < record_cnt) {
+        int n = __plan_batch();
+        if (n == 0) {
+            if (__now_ms() - progress > (uint64_t)idle_ms) break;
+            int seen = __inventory(reader);
+            n = __plan_batch();
+            if (n == 0) {
+                if (!waiting) fprintf(stderr, "%d tags in the field, none to write: waiting for blank tags\n", seen);
+                waiting = 1;
+                usleep(200000);
+                continue;
+            }
+        }
+        waiting = 0;
+        __send_batch(reader, n);
+        __collect(reader);
+        int batch_done = __finish_batch(n, &failed);
+        if (batch_done) progress = __now_ms();
+        done += batch_done;
+    }
+
+    // employees left without a tag
+    for (int i = 0; i < record_cnt; i++)
+        if (records[i].state == REC_TODO) __report(&records[i], "no tag");
+
+    double minutes = (progress - start) / 60000.0; // up to the last tag written, not the idle wait
+    fprintf(stderr, "%d provisioned, %d failed, %d without a tag in %.1f s: %.0f tags/min\n",
+            done, failed, record_cnt - done - failed, minutes * 60, minutes > 0 ? done / minutes : 0);
+
+    uhf_close(reader);
+    free(records);
+    if (results != stdout) fclose(results);
+    return failed || done < record_cnt;
+}